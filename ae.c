@@ -55,6 +55,8 @@ aeEventLoop *aeCreateEventLoop(void) {
     eventLoop->timeEventNextId = 0;
     //停止位标记为0
     eventLoop->stop = 0;
+    eventLoop->beforesleep = NULL;
+    eventLoop->aftersleep = NULL;
     //返回相应的事件循环
     return eventLoop;
 }
@@ -352,6 +354,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         }
         //返回值
         retval = select(maxfd+1, &rfds, &wfds, &efds, tvp);
+        if (eventLoop->aftersleep != NULL && flags & AE_CALL_AFTER_SLEEP)
+            eventLoop->aftersleep(eventLoop);
         if (retval > 0) {
             fe = eventLoop->fileEventHead;
             while(fe != NULL) {
@@ -468,6 +472,17 @@ int aeWait(int fd, int mask, long long milliseconds) {
 void aeMain(aeEventLoop *eventLoop)
 {
     eventLoop->stop = 0;
-    while (!eventLoop->stop)
-        aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+    while (!eventLoop->stop) {
+        if (eventLoop->beforesleep != NULL)
+            eventLoop->beforesleep(eventLoop);
+        aeProcessEvents(eventLoop, AE_ALL_EVENTS|AE_CALL_AFTER_SLEEP);
+    }
+}
+
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
+    eventLoop->beforesleep = beforesleep;
+}
+
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
+    eventLoop->aftersleep = aftersleep;
 }
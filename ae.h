@@ -70,6 +70,7 @@ struct aeEventLoop;
 typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
+typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
 
 /* File event structure */
 /**
@@ -123,6 +124,9 @@ typedef struct aeEventLoop {
     aeTimeEvent *timeEventHead;
     //stop用于停止事件轮询
     int stop;
+    //每次进入select()等待之前及返回之后调用的函数
+    aeBeforeSleepProc *beforesleep;
+    aeBeforeSleepProc *aftersleep;
 } aeEventLoop;
 
 /* Defines */
@@ -150,6 +154,8 @@ typedef struct aeEventLoop {
 #define AE_DONT_WAIT 4
 //没事事件标记
 #define AE_NOMORE -1
+//select()返回后调用aftersleep函数
+#define AE_CALL_AFTER_SLEEP 8
 
 /* Macros */
 //未使用标记
@@ -200,5 +206,10 @@ int aeWait(int fd, int mask, long long milliseconds);
  * 开始运行事件
  */
 void aeMain(aeEventLoop *eventLoop);
+/**
+ * 设置每次等待事件之前及之后调用的函数
+ */
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
 
 #endif
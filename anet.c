@@ -332,3 +332,14 @@ int anetAccept(char *err, int serversock, char *ip, int *port)
     if (port) *port = ntohs(sa.sin_port);
     return fd;
 }
+
+int anetPeerToString(int fd, char *ip, int *port)
+{
+    struct sockaddr_in sa;
+    socklen_t salen = sizeof(sa);
+
+    if (getpeername(fd,(struct sockaddr*)&sa,&salen) == -1) return ANET_ERR;
+    if (ip) strcpy(ip,inet_ntoa(sa.sin_addr));
+    if (port) *port = ntohs(sa.sin_port);
+    return ANET_OK;
+}
@@ -63,6 +63,10 @@ int anetTcpServer(char *err, int port, char *bindaddr);
  * 用于接收连接
  */
 int anetAccept(char *err, int serversock, char *ip, int *port);
+/**
+ * 获取已连接套接字对端的地址和端口
+ */
+int anetPeerToString(int fd, char *ip, int *port);
 /**
  * 用于套接字的写功能
  */
@@ -38,157 +38,761 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
 
 #include "ae.h"
 #include "anet.h"
 #include "sds.h"
 #include "adlist.h"
 #include "zmalloc.h"
-
-#define REPLY_INT 0
-#define REPLY_RETCODE 1
-#define REPLY_BULK 2
+#include "protocol.h"
 
 #define CLIENT_CONNECTING 0
 #define CLIENT_SENDQUERY 1
 #define CLIENT_READREPLY 2
 
-#define MAX_LATENCY 5000
+#define OUTPUT_STANDARD 0
+#define OUTPUT_CSV 1
+#define OUTPUT_JSON 2
+
+/* Latency histogram in microseconds. Values below 2*HIST_SUB are recorded
+ * exactly, every following power of two is split in HIST_SUB buckets, so a
+ * bucket is never wider than 1/HIST_SUB of the values it holds. */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_MAX_SHIFT 32
+#define HIST_BUCKETS (HIST_SUB*(HIST_MAX_SHIFT+2))
+
+/* Workload mode, see --workload */
+#define KEYDIST_UNIFORM 0
+#define KEYDIST_ZIPF 1
+#define KEYDIST_HOTSPOT 2
+
+#define WORKLOAD_KEYSPACELEN 10000  /* keys when -r is not given */
+#define WORKLOAD_ELEMENTS 10        /* elements of the preloaded lists/sets */
+#define WORKLOAD_MGET_KEYS 10
+#define WORKLOAD_PRELOAD_BATCH 1000 /* commands pipelined by the preload */
+
+#define WORKLOAD_NONE 0     /* keys used by a command */
+#define WORKLOAD_STRING 1
+#define WORKLOAD_LIST 2
+#define WORKLOAD_SET 3
+
+/* Replay mode, see --replay. The file is written by redis-cli --capture. */
+#define CAPTURE_HEADER "REDISCAP"
+#define CAPTURE_VERSION 1
+#define REPLAY_SELECT -2    /* op of the SELECTs added by the replay */
+
+#define MAX_OPS 64          /* commands with their own latency histogram */
 
 #define REDIS_NOTUSED(V) ((void) V)
 
+typedef struct histogram {
+    long long count[HIST_BUCKETS];
+    long long total;
+    long long sum;
+    long long min;
+    long long max;
+} histogram;
+
+/* Commands of the workload, the weights are set by --workload */
+static struct workloadOp {
+    char *name;
+    int keytype;
+    int weight;
+} workloadOps[] = {
+    {"get",WORKLOAD_STRING,0},
+    {"set",WORKLOAD_STRING,0},
+    {"incr",WORKLOAD_NONE,0},
+    {"mget",WORKLOAD_STRING,0},
+    {"lpush",WORKLOAD_LIST,0},
+    {"lpop",WORKLOAD_LIST,0},
+    {"lrange",WORKLOAD_LIST,0},
+    {"sort",WORKLOAD_LIST,0},
+    {"sadd",WORKLOAD_SET,0},
+    {"spop",WORKLOAD_SET,0},
+    {"sinter",WORKLOAD_SET,0},
+    {"ping",WORKLOAD_NONE,0}
+};
+
+#define WORKLOAD_OPS ((int)(sizeof(workloadOps)/sizeof(workloadOps[0])))
+
+/* Every thread runs its own event loop with its share of the clients and
+ * of the requests. Nothing is shared between threads while a test runs. */
+typedef struct benchThread {
+    pthread_t thread;
+    aeEventLoop *el;
+    list *clients;
+    int numclients;
+    int liveclients;
+    int requests;
+    int donerequests;
+    histogram latency;
+    histogram oplatency[MAX_OPS];
+    /* Open loop, see --rate */
+    long long timer;        /* dispatchRequests() time event, -1 if none */
+    int sentrequests;
+    double nextsend;        /* time the next request is due, in usec */
+    double interval;        /* usec between two requests of this thread */
+    listNode *nextclient;   /* round robin among the clients */
+} benchThread;
+
 static struct config {
     int numclients;
     int requests;
-    int liveclients;
     int donerequests;
     int keysize;
     int datasize;
     int randomkeys;
     int randomkeys_keyspacelen;
-    aeEventLoop *el;
     char *hostip;
     int hostport;
     int keepalive;
     long long start;
     long long totlatency;
-    int *latency;
-    list *clients;
+    histogram latency;
+    histogram oplatency[MAX_OPS];
+    char *opnames[MAX_OPS]; /* commands with a latency histogram */
+    int numops;
     int quiet;
     int loop;
+    int pipeline;
+    int numthreads;
+    benchThread *threads;
+    int output;
+    int tests;          /* tests reported in this run, see outputStart() */
+    sds cmd;            /* command of the test, NULL in workload mode */
+    sds cmds;           /* config.pipeline times config.cmd */
+    /* Workload mode */
+    int workload;
+    int totweight;
+    int keydist;
+    double zipf_theta;
+    double zipf_zetan, zipf_eta, zipf_alpha, zipf_half;
+    double hot_keys;    /* fraction of the keys that are hot */
+    double hot_ops;     /* fraction of the requests to hot keys */
+    int valuesize_min;
+    int valuesize_max;
+    char *valuebuf;
+    int preload;
+    double rate;        /* requests per second, 0 for closed loop */
+    int openloop;       /* --rate or a timed replay */
+    /* Replay mode */
+    char *replay;       /* capture file */
+    double speed;       /* replay speed, 0 for max speed */
+    struct replayRecord *records;
+    int numrecords;
+    int *slothead;      /* first record of every client, -1 if none */
+    struct _client **slotclients;
+    long long replaystart;
 } config;
 
+/* A captured command. Captured clients are mapped to the benchmark clients
+ * by id modulo the number of clients ("slots"): the commands of a captured
+ * client are replayed in order on the same connection. */
+typedef struct replayRecord {
+    long long time;     /* capture time in microseconds */
+    int db;
+    int op;
+    int slot;
+    int next;           /* next record of the same slot, -1 if last */
+    sds cmd;            /* the command in the protocol format */
+} replayRecord;
+
+typedef struct pendingRequest {
+    int op;             /* config.opnames index, -1 if none */
+    long long start;    /* start time in microseconds */
+} pendingRequest;
+
 typedef struct _client {
+    benchThread *t;
     int state;
     int fd;
     sds obuf;
     sds ibuf;
-    int readlen;        /* readlen == -1 means read a single line */
     unsigned int written;        /* bytes of 'obuf' already written */
-    int replytype;
-    long long start;    /* start time in milliseconds */
+    int writing;        /* the write handler is installed */
+    int db;             /* selected DB, in replay mode */
+    int slot;
+    int replaypos;      /* next record to send at max speed, -1 if none */
+    /* Requests sent and not yet replied, a circular queue */
+    pendingRequest *queue;
+    int qhead, qlen, qsize;
 } *client;
 
 /* Prototypes */
 static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
-static void createMissingClients(client c);
+static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+static void createMissingClients(benchThread *t);
 
 /* Implementation */
-static long long mstime(void) {
+static long long ustime(void) {
     struct timeval tv;
-    long long mst;
+    long long ust;
 
     gettimeofday(&tv, NULL);
-    mst = ((long)tv.tv_sec)*1000;
-    mst += tv.tv_usec/1000;
-    return mst;
+    ust = ((long long)tv.tv_sec)*1000000;
+    ust += tv.tv_usec;
+    return ust;
+}
+
+static int histBucket(long long v) {
+    int shift = 0;
+
+    if (v < 0) v = 0;
+    while ((v>>shift) >= 2*HIST_SUB && shift < HIST_MAX_SHIFT) shift++;
+    if ((v>>shift) >= 2*HIST_SUB) return HIST_BUCKETS-1;
+    return HIST_SUB*shift+(int)(v>>shift);
+}
+
+/* Highest value recorded in bucket 'b' */
+static long long histBucketMax(int b) {
+    int shift = (b < 2*HIST_SUB) ? 0 : b/HIST_SUB-1;
+    long long sub = b-HIST_SUB*shift;
+
+    return ((sub+1)<<shift)-1;
+}
+
+static void histReset(histogram *h) {
+    memset(h,0,sizeof(*h));
+    h->min = -1;
+}
+
+static void histRecord(histogram *h, long long v) {
+    h->count[histBucket(v)]++;
+    h->total++;
+    h->sum += v;
+    if (h->min == -1 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+static void histMerge(histogram *dst, histogram *src) {
+    int b;
+
+    if (src->total == 0) return;
+    for (b = 0; b < HIST_BUCKETS; b++) dst->count[b] += src->count[b];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (dst->min == -1 || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+/* Value below which 'perc' percent of the recorded values fall */
+static long long histPercentile(histogram *h, double perc) {
+    long long target = (long long)(perc*h->total/100+0.5), seen = 0;
+    int b;
+
+    if (target < 1) target = 1;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= target)
+            return histBucketMax(b) < h->max ? histBucketMax(b) : h->max;
+    }
+    return h->max;
+}
+
+/* ------------------------------ Workload ---------------------------------- */
+
+static double randomUnit(void) {
+    return (double)random()/((double)RAND_MAX+1);
+}
+
+/* Zipfian keys as in "Quickly Generating Billion-Record Synthetic
+ * Databases" (Gray et al.): zeta(n) is computed once, then every key costs
+ * O(1). Key 0 is the most popular one. */
+static void zipfInit(long n, double theta) {
+    double zeta2 = 1+pow(0.5,theta);
+    long i;
+
+    config.zipf_zetan = 0;
+    for (i = 1; i <= n; i++) config.zipf_zetan += 1/pow((double)i,theta);
+    config.zipf_alpha = 1/(1-theta);
+    config.zipf_eta = (1-pow(2.0/n,1-theta))/(1-zeta2/config.zipf_zetan);
+    config.zipf_half = zeta2;
+}
+
+static long workloadKey(void) {
+    long n = config.randomkeys_keyspacelen, k;
+
+    switch(config.keydist) {
+    case KEYDIST_ZIPF: {
+        double u = randomUnit(), uz = u*config.zipf_zetan;
+
+        if (uz < 1) return 0;
+        if (uz < config.zipf_half) return 1;
+        k = (long)(n*pow(config.zipf_eta*u-config.zipf_eta+1,config.zipf_alpha));
+        return k < n ? k : n-1;
+    }
+    case KEYDIST_HOTSPOT: {
+        long hot = (long)(n*config.hot_keys);
+
+        if (hot < 1) hot = 1;
+        if (hot >= n || randomUnit() < config.hot_ops) return random() % hot;
+        return hot + random() % (n-hot);
+    }
+    default:
+        return random() % n;
+    }
+}
+
+static int workloadValueSize(void) {
+    return config.valuesize_min +
+        random() % (config.valuesize_max-config.valuesize_min+1);
+}
+
+static sds workloadBulk(sds buf, char *value, int len) {
+    buf = sdscatprintf(buf,"%d\r\n",len);
+    buf = sdscatlen(buf,value,len);
+    return sdscatlen(buf,"\r\n",2);
+}
+
+/* Append a random command of the workload to 'buf'. The command index is
+ * stored in *op. */
+static sds workloadCommand(sds buf, int *op) {
+    int r = random() % config.totweight, j;
+    char member[32];
+
+    for (*op = 0; r >= workloadOps[*op].weight; (*op)++)
+        r -= workloadOps[*op].weight;
+    switch(*op) {
+    case 0: return sdscatprintf(buf,"GET key:%ld\r\n",workloadKey());
+    case 1:
+        buf = sdscatprintf(buf,"SET key:%ld ",workloadKey());
+        return workloadBulk(buf,config.valuebuf,workloadValueSize());
+    case 2: return sdscatprintf(buf,"INCR counter:%ld\r\n",workloadKey());
+    case 3:
+        buf = sdscat(buf,"MGET");
+        for (j = 0; j < WORKLOAD_MGET_KEYS; j++)
+            buf = sdscatprintf(buf," key:%ld",workloadKey());
+        return sdscat(buf,"\r\n");
+    case 4:
+        buf = sdscatprintf(buf,"LPUSH list:%ld ",workloadKey());
+        return workloadBulk(buf,config.valuebuf,workloadValueSize());
+    case 5: return sdscatprintf(buf,"LPOP list:%ld\r\n",workloadKey());
+    case 6: return sdscatprintf(buf,"LRANGE list:%ld 0 %d\r\n",workloadKey(),
+                                WORKLOAD_ELEMENTS-1);
+    case 7: return sdscatprintf(buf,"SORT list:%ld LIMIT 0 %d\r\n",workloadKey(),
+                                WORKLOAD_ELEMENTS);
+    case 8:
+        buf = sdscatprintf(buf,"SADD set:%ld ",workloadKey());
+        snprintf(member,sizeof(member),"m:%ld",workloadKey());
+        return workloadBulk(buf,member,strlen(member));
+    case 9: return sdscatprintf(buf,"SPOP set:%ld\r\n",workloadKey());
+    case 10: return sdscatprintf(buf,"SINTER set:%ld set:%ld\r\n",
+                                 workloadKey(),workloadKey());
+    default: return sdscat(buf,"PING\r\n");
+    }
+}
+
+static int workloadUsesKeys(int keytype) {
+    int j;
+
+    for (j = 0; j < WORKLOAD_OPS; j++)
+        if (workloadOps[j].weight && workloadOps[j].keytype == keytype)
+            return 1;
+    return 0;
+}
+
+/* Send the pipelined preload commands and read all the replies */
+static void preloadFlush(int fd, sds *buf, int *pending) {
+    sds replies = sdsempty();
+    char readbuf[1024*16];
+    size_t pos = 0;
+
+    if (anetWrite(fd,*buf,sdslen(*buf)) == -1) {
+        fprintf(stderr,"Preload: writing to socket: %s\n",strerror(errno));
+        exit(1);
+    }
+    while(*pending) {
+        long len = protocolReplyLength(replies+pos,sdslen(replies)-pos);
+
+        if (len) {
+            if (replies[pos] == '-') {
+                fprintf(stderr,"Preload: %.*s\n",(int)len,replies+pos);
+                exit(1);
+            }
+            pos += len;
+            (*pending)--;
+        } else {
+            int nread = read(fd,readbuf,sizeof(readbuf));
+
+            if (nread <= 0) {
+                fprintf(stderr,"Preload: reading from socket failed\n");
+                exit(1);
+            }
+            replies = sdscatlen(replies,readbuf,nread);
+        }
+    }
+    sdsfree(replies);
+    sdsfree(*buf);
+    *buf = sdsempty();
+}
+
+/* Create every key the workload reads, so that a read heavy workload
+ * measures hits and not misses */
+static void preloadKeyspace(void) {
+    int lists = workloadUsesKeys(WORKLOAD_LIST);
+    int sets = workloadUsesKeys(WORKLOAD_SET);
+    long long start = ustime(), commands = 0;
+    char err[ANET_ERR_LEN];
+    sds buf = sdsempty();
+    int fd, pending = 0, j;
+    long k;
+
+    fd = anetTcpConnect(err,config.hostip,config.hostport);
+    if (fd == ANET_ERR) {
+        fprintf(stderr,"Connect: %s\n",err);
+        exit(1);
+    }
+    for (k = 0; k < config.randomkeys_keyspacelen; k++) {
+        buf = sdscatprintf(buf,"SET key:%ld ",k);
+        buf = workloadBulk(buf,config.valuebuf,workloadValueSize());
+        pending++;
+        for (j = 0; lists && j < WORKLOAD_ELEMENTS; j++) {
+            buf = sdscatprintf(buf,"RPUSH list:%ld ",k);
+            buf = workloadBulk(buf,config.valuebuf,workloadValueSize());
+            pending++;
+        }
+        for (j = 0; sets && j < WORKLOAD_ELEMENTS; j++) {
+            char member[32];
+
+            snprintf(member,sizeof(member),"m:%ld",workloadKey());
+            buf = sdscatprintf(buf,"SADD set:%ld ",k);
+            buf = workloadBulk(buf,member,strlen(member));
+            pending++;
+        }
+        if (pending >= WORKLOAD_PRELOAD_BATCH) {
+            commands += pending;
+            preloadFlush(fd,&buf,&pending);
+        }
+    }
+    commands += pending;
+    preloadFlush(fd,&buf,&pending);
+    sdsfree(buf);
+    close(fd);
+    fprintf(stderr,"Preloaded %d keys (%lld commands) in %.2f seconds\n",
+        config.randomkeys_keyspacelen, commands,
+        (double)(ustime()-start)/1000000);
+}
+
+/* -------------------------------- Replay ---------------------------------- */
+
+static int replayReadVarint(unsigned char **p, unsigned char *end,
+                            unsigned long long *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while(*p < end && shift < 64) {
+        unsigned char byte = *(*p)++;
+
+        *v |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 1;
+        shift += 7;
+    }
+    return 0;
+}
+
+/* Latency histogram of the command 'name', the commands after the first
+ * MAX_OPS-1 share the "other" one */
+static int replayOp(sds name) {
+    int op;
+
+    sdstolower(name);
+    for (op = 0; op < config.numops; op++)
+        if (!strcmp(config.opnames[op],name)) return op;
+    if (config.numops == MAX_OPS) return MAX_OPS-1;
+    config.opnames[op] = sdsnew(op == MAX_OPS-1 ? "other" : name);
+    return config.numops++;
+}
+
+/* Commands that would turn the replaying connection in something else or
+ * stop the server are not replayed */
+static int replaySkipCommand(sds name) {
+    static char *skip[] = {"monitor","sync","psync","slaveof","shutdown",NULL};
+    int j;
+
+    for (j = 0; skip[j]; j++)
+        if (!strcasecmp(name,skip[j])) return 1;
+    return 0;
+}
+
+/* Load the records of the capture file, see captureFeedMonitors() in
+ * redis.c for the format. A truncated record at the end, as left by a
+ * capture stopped in the middle of a write, is ignored. */
+static void replayLoad(void) {
+    unsigned char *p, *end;
+    sds buf = sdsempty();
+    char readbuf[1024*16];
+    int *slottail, skipped = 0, j;
+    size_t nread;
+    FILE *fp;
+
+    if ((fp = fopen(config.replay,"rb")) == NULL) {
+        fprintf(stderr,"Opening %s: %s\n",config.replay,strerror(errno));
+        exit(1);
+    }
+    while((nread = fread(readbuf,1,sizeof(readbuf),fp)) > 0)
+        buf = sdscatlen(buf,readbuf,nread);
+    fclose(fp);
+    if (sdslen(buf) < strlen(CAPTURE_HEADER)+1 ||
+        memcmp(buf,CAPTURE_HEADER,strlen(CAPTURE_HEADER)) ||
+        buf[strlen(CAPTURE_HEADER)] != CAPTURE_VERSION)
+    {
+        fprintf(stderr,"%s is not a capture file\n",config.replay);
+        exit(1);
+    }
+
+    config.slothead = zmalloc(sizeof(int)*config.numclients);
+    config.slotclients = zmalloc(sizeof(client)*config.numclients);
+    slottail = zmalloc(sizeof(int)*config.numclients);
+    for (j = 0; j < config.numclients; j++) {
+        config.slothead[j] = slottail[j] = -1;
+        config.slotclients[j] = NULL;
+    }
+    p = (unsigned char*)buf+strlen(CAPTURE_HEADER)+1;
+    end = (unsigned char*)buf+sdslen(buf);
+    while(p < end) {
+        unsigned long long id, db, argc, len, a;
+        replayRecord r;
+        sds name = NULL;
+        int flags;
+
+        if (end-p < 9) break;
+        for (r.time = 0, j = 0; j < 8; j++)
+            r.time |= (long long)p[j] << (j*8);
+        p += 8;
+        if (!replayReadVarint(&p,end,&id) || !replayReadVarint(&p,end,&db) ||
+            p == end) break;
+        flags = *p++;
+        if (!replayReadVarint(&p,end,&argc) || argc == 0) break;
+        r.cmd = sdsempty();
+        for (a = 0; a < argc; a++) {
+            if (!replayReadVarint(&p,end,&len) ||
+                (unsigned long long)(end-p) < len) break;
+            if (a == 0) name = sdsnewlen(p,len);
+            if (a != 0) r.cmd = sdscatlen(r.cmd," ",1);
+            if ((flags & 1) && a == argc-1)
+                r.cmd = workloadBulk(r.cmd,(char*)p,len);
+            else
+                r.cmd = sdscatlen(r.cmd,p,len);
+            p += len;
+        }
+        if (a != argc) {
+            sdsfree(name);
+            sdsfree(r.cmd);
+            break;
+        }
+        if (!(flags & 1)) r.cmd = sdscatlen(r.cmd,"\r\n",2);
+        if (replaySkipCommand(name)) {
+            sdsfree(name);
+            sdsfree(r.cmd);
+            skipped++;
+            continue;
+        }
+        r.db = db;
+        r.op = replayOp(name);
+        r.slot = id % config.numclients;
+        r.next = -1;
+        sdsfree(name);
+        if ((config.numrecords & (config.numrecords-1)) == 0)
+            config.records = zrealloc(config.records,
+                sizeof(replayRecord)*(config.numrecords ? config.numrecords*2 : 1));
+        if (slottail[r.slot] == -1)
+            config.slothead[r.slot] = config.numrecords;
+        else
+            config.records[slottail[r.slot]].next = config.numrecords;
+        slottail[r.slot] = config.numrecords;
+        config.records[config.numrecords++] = r;
+    }
+    if (p != end)
+        fprintf(stderr,"Ignoring a truncated record at the end of %s\n",
+            config.replay);
+    if (skipped)
+        fprintf(stderr,"Skipped %d MONITOR, SYNC, SLAVEOF or SHUTDOWN commands\n",
+            skipped);
+    if (config.numrecords == 0) {
+        fprintf(stderr,"No commands to replay in %s\n",config.replay);
+        exit(1);
+    }
+    fprintf(stderr,"Loaded %d commands spanning %.2f seconds\n",
+        config.numrecords, (double)(config.records[config.numrecords-1].time-
+        config.records[0].time)/1000000);
+    zfree(slottail);
+    sdsfree(buf);
+}
+
+/* ------------------------------- Clients ---------------------------------- */
+
+static void clientQueueRequest(client c, int op, long long start) {
+    if (c->qlen == c->qsize) {
+        pendingRequest *q = zmalloc(sizeof(pendingRequest)*c->qsize*2);
+        int j;
+
+        for (j = 0; j < c->qlen; j++)
+            q[j] = c->queue[(c->qhead+j) % c->qsize];
+        zfree(c->queue);
+        c->queue = q;
+        c->qhead = 0;
+        c->qsize *= 2;
+    }
+    c->queue[(c->qhead+c->qlen) % c->qsize].op = op;
+    c->queue[(c->qhead+c->qlen) % c->qsize].start = start;
+    c->qlen++;
+}
+
+static pendingRequest clientPopRequest(client c) {
+    pendingRequest req = c->queue[c->qhead];
+
+    c->qhead = (c->qhead+1) % c->qsize;
+    c->qlen--;
+    return req;
+}
+
+static void clientWantsWrite(client c) {
+    if (c->writing) return;
+    aeCreateFileEvent(c->t->el,c->fd,AE_WRITABLE,writeHandler,c,NULL);
+    c->writing = 1;
 }
 
 static void freeClient(client c) {
+    benchThread *t = c->t;
     listNode *ln;
 
-    aeDeleteFileEvent(config.el,c->fd,AE_WRITABLE);
-    aeDeleteFileEvent(config.el,c->fd,AE_READABLE);
+    aeDeleteFileEvent(t->el,c->fd,AE_WRITABLE);
+    aeDeleteFileEvent(t->el,c->fd,AE_READABLE);
     sdsfree(c->ibuf);
     sdsfree(c->obuf);
     close(c->fd);
+    zfree(c->queue);
+    if (config.replay) config.slotclients[c->slot] = NULL;
     zfree(c);
-    config.liveclients--;
-    ln = listSearchKey(config.clients,c);
+    t->liveclients--;
+    ln = listSearchKey(t->clients,c);
     assert(ln != NULL);
-    listDelNode(config.clients,ln);
+    if (t->nextclient == ln) t->nextclient = NULL;
+    listDelNode(t->clients,ln);
 }
 
 static void freeAllClients(void) {
-    listNode *ln = config.clients->head, *next;
+    int j;
 
-    while(ln) {
-        next = ln->next;
-        freeClient(ln->value);
-        ln = next;
-    }
-}
+    for (j = 0; j < config.numthreads; j++) {
+        listNode *ln = config.threads[j].clients->head, *next;
 
-static void resetClient(client c) {
-    aeDeleteFileEvent(config.el,c->fd,AE_WRITABLE);
-    aeDeleteFileEvent(config.el,c->fd,AE_READABLE);
-    aeCreateFileEvent(config.el,c->fd, AE_WRITABLE,writeHandler,c,NULL);
-    sdsfree(c->ibuf);
-    c->ibuf = sdsempty();
-    c->readlen = (c->replytype == REPLY_BULK) ? -1 : 0;
-    c->written = 0;
-    c->state = CLIENT_SENDQUERY;
-    c->start = mstime();
-    createMissingClients(c);
+        while(ln) {
+            next = ln->next;
+            freeClient(ln->value);
+            ln = next;
+        }
+    }
 }
 
-static void randomizeClientKey(client c) {
-    char *p;
+/* Every command of the pipeline gets its own random key */
+static void randomizeKeys(char *p) {
     char buf[32];
     long r;
 
-    p = strstr(c->obuf, "_rand");
-    if (!p) return;
-    p += 5;
-    r = random() % config.randomkeys_keyspacelen;
-    sprintf(buf,"%ld",r);
-    memcpy(p,buf,strlen(buf));
+    while((p = strstr(p,"_rand")) != NULL) {
+        p += 5;
+        r = random() % config.randomkeys_keyspacelen;
+        sprintf(buf,"%ld",r);
+        memcpy(p,buf,strlen(buf));
+    }
 }
 
-static void clientDone(client c) {
+/* Queue a captured command, selecting its DB first if needed. The SELECT
+ * reply is not accounted. */
+static void replayQueue(client c, replayRecord *r, long long start) {
+    if (r->db != c->db) {
+        c->obuf = sdscatprintf(c->obuf,"SELECT %d\r\n",r->db);
+        clientQueueRequest(c,REPLAY_SELECT,start);
+        c->db = r->db;
+    }
+    c->obuf = sdscatlen(c->obuf,r->cmd,sdslen(r->cmd));
+    clientQueueRequest(c,r->op,start);
+}
+
+/* Closed loop: queue the next config.pipeline commands */
+static void clientFillPipeline(client c) {
+    long long now = ustime();
+    int j, op = -1;
+
+    sdsfree(c->obuf);
+    c->written = 0;
+    if (config.replay) {
+        c->obuf = sdsempty();
+        for (j = 0; j < config.pipeline && c->replaypos != -1; j++) {
+            replayQueue(c,config.records+c->replaypos,now);
+            c->replaypos = config.records[c->replaypos].next;
+        }
+    } else if (config.workload) {
+        c->obuf = sdsempty();
+        for (j = 0; j < config.pipeline; j++) {
+            c->obuf = workloadCommand(c->obuf,&op);
+            clientQueueRequest(c,op,now);
+        }
+    } else {
+        c->obuf = sdsdup(config.cmds);
+        if (config.randomkeys) randomizeKeys(c->obuf);
+        for (j = 0; j < config.pipeline; j++) clientQueueRequest(c,-1,now);
+    }
+    clientWantsWrite(c);
+}
+
+/* Called for every reply received. Returns 0 if the client was freed or
+ * the test is over. */
+static int clientDone(client c) {
+    benchThread *t = c->t;
+    pendingRequest req;
     long long latency;
-    config.donerequests ++;
-    latency = mstime() - c->start;
-    if (latency > MAX_LATENCY) latency = MAX_LATENCY;
-    config.latency[latency]++;
 
-    if (config.donerequests == config.requests) {
+    /* Other clients may be served in the same event loop iteration after
+     * the last request: their replies are not accounted */
+    if (t->donerequests == t->requests) return 0;
+    if (c->queue[c->qhead].op == REPLAY_SELECT) {
+        clientPopRequest(c);
+        return 1;
+    }
+    t->donerequests++;
+    req = clientPopRequest(c);
+    latency = ustime()-req.start;
+    histRecord(&t->latency,latency);
+    if (req.op != -1) histRecord(&t->oplatency[req.op],latency);
+
+    if (t->donerequests == t->requests) {
         freeClient(c);
-        aeStop(config.el);
-        return;
+        aeStop(t->el);
+        return 0;
     }
+    if (config.openloop || c->qlen) return 1;
     if (config.keepalive) {
-        resetClient(c);
-        if (config.randomkeys) randomizeClientKey(c);
+        clientFillPipeline(c);
+        return 1;
     } else {
-        config.liveclients--;
-        createMissingClients(c);
-        config.liveclients++;
+        t->liveclients--;
+        createMissingClients(t);
+        t->liveclients++;
         freeClient(c);
+        return 0;
     }
 }
 
 static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask)
 {
-    char buf[1024];
+    char buf[1024*16];
     int nread;
+    long len;
+    size_t pos = 0;
     client c = privdata;
     REDIS_NOTUSED(el);
     REDIS_NOTUSED(fd);
     REDIS_NOTUSED(mask);
 
-    nread = read(c->fd, buf, 1024);
+    nread = read(c->fd, buf, sizeof(buf));
     if (nread == -1) {
+        if (errno == EAGAIN) return;
         fprintf(stderr, "Reading from socket: %s\n", strerror(errno));
         freeClient(c);
         return;
@@ -200,31 +804,11 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask)
     }
     c->ibuf = sdscatlen(c->ibuf,buf,nread);
 
-    if (c->replytype == REPLY_INT ||
-        c->replytype == REPLY_RETCODE ||
-        (c->replytype == REPLY_BULK && c->readlen == -1)) {
-        char *p;
-
-        if ((p = strchr(c->ibuf,'\n')) != NULL) {
-            if (c->replytype == REPLY_BULK) {
-                *p = '\0';
-                *(p-1) = '\0';
-                c->readlen = atoi(c->ibuf+1)+2;
-                if (c->readlen-2 == -1) {
-                    clientDone(c);
-                    return;
-                }
-                c->ibuf = sdsrange(c->ibuf,(p-c->ibuf)+1,-1);
-            } else {
-                c->ibuf = sdstrim(c->ibuf,"\r\n");
-                clientDone(c);
-                return;
-            }
-        }
+    while(c->qlen && (len = protocolReplyLength(c->ibuf+pos,sdslen(c->ibuf)-pos))) {
+        pos += len;
+        if (!clientDone(c)) return;
     }
-    /* bulk read */
-    if ((unsigned)c->readlen == sdslen(c->ibuf))
-        clientDone(c);
+    c->ibuf = sdsrange(c->ibuf,pos,-1);
 }
 
 static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask)
@@ -235,28 +819,37 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask)
     REDIS_NOTUSED(mask);
 
     if (c->state == CLIENT_CONNECTING) {
+        int j;
+
         c->state = CLIENT_SENDQUERY;
-        c->start = mstime();
+        /* In closed loop the requests start once connected. In open loop
+         * they started when queued. */
+        for (j = 0; !config.openloop && j < c->qlen; j++)
+            c->queue[(c->qhead+j) % c->qsize].start = ustime();
     }
     if (sdslen(c->obuf) > c->written) {
         void *ptr = c->obuf+c->written;
         int len = sdslen(c->obuf) - c->written;
         int nwritten = write(c->fd, ptr, len);
         if (nwritten == -1) {
+            if (errno == EAGAIN) return;
             fprintf(stderr, "Writing to socket: %s\n", strerror(errno));
             freeClient(c);
             return;
         }
         c->written += nwritten;
-        if (sdslen(c->obuf) == c->written) {
-            aeDeleteFileEvent(config.el,c->fd,AE_WRITABLE);
-            aeCreateFileEvent(config.el,c->fd,AE_READABLE,readHandler,c,NULL);
-            c->state = CLIENT_READREPLY;
-        }
+    }
+    if (sdslen(c->obuf) == c->written) {
+        aeDeleteFileEvent(c->t->el,c->fd,AE_WRITABLE);
+        c->writing = 0;
+        c->state = CLIENT_READREPLY;
+        sdsfree(c->obuf);
+        c->obuf = sdsempty();
+        c->written = 0;
     }
 }
 
-static client createClient(void) {
+static client createClient(benchThread *t) {
     client c = zmalloc(sizeof(struct _client));
     char err[ANET_ERR_LEN];
 
@@ -267,69 +860,365 @@ static client createClient(void) {
         return NULL;
     }
     anetTcpNoDelay(NULL,c->fd);
+    c->t = t;
     c->obuf = sdsempty();
     c->ibuf = sdsempty();
-    c->readlen = 0;
     c->written = 0;
+    c->writing = 0;
+    c->db = 0;
+    if (config.replay) {
+        c->slot = listLength(t->clients);
+        c->replaypos = config.slothead[c->slot];
+        config.slotclients[c->slot] = c;
+    }
+    c->qhead = c->qlen = 0;
+    c->qsize = config.pipeline;
+    c->queue = zmalloc(sizeof(pendingRequest)*c->qsize);
     c->state = CLIENT_CONNECTING;
-    aeCreateFileEvent(config.el, c->fd, AE_WRITABLE, writeHandler, c, NULL);
-    config.liveclients++;
-    listAddNodeTail(config.clients,c);
+    aeCreateFileEvent(t->el, c->fd, AE_READABLE, readHandler, c, NULL);
+    clientWantsWrite(c);
+    t->liveclients++;
+    listAddNodeTail(t->clients,c);
     return c;
 }
 
-static void createMissingClients(client c) {
-    while(config.liveclients < config.numclients) {
-        client new = createClient();
+static void createMissingClients(benchThread *t) {
+    while(t->liveclients < t->numclients) {
+        client new = createClient(t);
         if (!new) continue;
-        sdsfree(new->obuf);
-        new->obuf = sdsdup(c->obuf);
-        if (config.randomkeys) randomizeClientKey(c);
-        new->replytype = c->replytype;
-        if (c->replytype == REPLY_BULK)
-            new->readlen = -1;
+        if (!config.openloop) clientFillPipeline(new);
+    }
+}
+
+/* Open loop: send every request when it is due, whatever the number of
+ * requests still waiting for a reply, so a stalled server can't slow down
+ * the requests rate and hide the latency of the requests it would have
+ * delayed (coordinated omission). The latency is measured from when the
+ * request is queued in the output buffer: a server not reading its input
+ * is accounted, the 1 ms resolution of the timer is not. */
+static int dispatchRequests(aeEventLoop *el, long long id, void *privdata) {
+    benchThread *t = privdata;
+    long long now = ustime();
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(id);
+
+    while(t->sentrequests < t->requests && t->nextsend <= now &&
+          listLength(t->clients))
+    {
+        client c;
+        int op = -1;
+
+        if (t->nextclient == NULL) t->nextclient = listFirst(t->clients);
+        c = listNodeValue(t->nextclient);
+        t->nextclient = t->nextclient->next;
+        if (config.workload) {
+            c->obuf = workloadCommand(c->obuf,&op);
+        } else {
+            size_t len = sdslen(c->obuf);
+
+            c->obuf = sdscat(c->obuf,config.cmd);
+            if (config.randomkeys) randomizeKeys(c->obuf+len);
+        }
+        clientQueueRequest(c,op,now);
+        clientWantsWrite(c);
+        t->nextsend += t->interval;
+        t->sentrequests++;
+    }
+    if (t->sentrequests == t->requests) {
+        t->timer = -1;
+        return AE_NOMORE;
+    }
+    return 1;
+}
+
+/* Timed replay: send every captured command when it is due, that is at
+ * the same distance from the first one as in the capture, divided by the
+ * speed. As with --rate the latency is measured from when it is queued. */
+static int dispatchReplay(aeEventLoop *el, long long id, void *privdata) {
+    benchThread *t = privdata;
+    long long now = ustime();
+    REDIS_NOTUSED(id);
+
+    while(t->sentrequests < config.numrecords) {
+        replayRecord *r = config.records+t->sentrequests;
+        client c = config.slotclients[r->slot];
+
+        if (config.replaystart+(r->time-config.records[0].time)/config.speed > now)
+            break;
+        t->sentrequests++;
+        if (c == NULL) {
+            /* Connection lost: account the command as done */
+            t->donerequests++;
+            continue;
+        }
+        replayQueue(c,r,now);
+        clientWantsWrite(c);
+    }
+    if (t->donerequests == t->requests) aeStop(el);
+    if (t->sentrequests == config.numrecords) {
+        t->timer = -1;
+        return AE_NOMORE;
     }
+    return 1;
+}
+
+/* ------------------------------- Reports ---------------------------------- */
+
+static void outputStart(void) {
+    config.tests = 0;
+    if (config.output == OUTPUT_CSV)
+        printf("\"test\",\"rps\",\"avg_msec\",\"min_msec\",\"p50_msec\",\"p99_msec\",\"p999_msec\",\"max_msec\"\n");
+    else if (config.output == OUTPUT_JSON)
+        printf("[");
+}
+
+static void outputEnd(void) {
+    if (config.output == OUTPUT_JSON) printf("\n]\n");
+    else if (config.output == OUTPUT_STANDARD) printf("\n");
+}
+
+static void showRecord(char *title, histogram *h) {
+    float reqpersec = (float)h->total/((float)config.totlatency/1000000);
+    double avg = h->total ? (double)h->sum/h->total/1000 : 0;
+
+    if (config.output == OUTPUT_CSV) {
+        printf("\"%s\",\"%.2f\",\"%.3f\",\"%.3f\",\"%.3f\",\"%.3f\",\"%.3f\",\"%.3f\"\n",
+            title, reqpersec, avg, (double)h->min/1000,
+            (double)histPercentile(h,50)/1000, (double)histPercentile(h,99)/1000,
+            (double)histPercentile(h,99.9)/1000, (double)h->max/1000);
+    } else {
+        printf("%s\n  {\"test\":\"%s\",\"requests\":%lld,\"clients\":%d,\"pipeline\":%d,"
+            "\"threads\":%d,\"rps\":%.2f,\"avg_msec\":%.3f,\"min_msec\":%.3f,"
+            "\"p50_msec\":%.3f,\"p99_msec\":%.3f,\"p999_msec\":%.3f,\"max_msec\":%.3f}",
+            config.tests ? "," : "", title, h->total,
+            config.numclients, config.pipeline, config.numthreads, reqpersec,
+            avg, (double)h->min/1000,
+            (double)histPercentile(h,50)/1000, (double)histPercentile(h,99)/1000,
+            (double)histPercentile(h,99.9)/1000, (double)h->max/1000);
+    }
+    config.tests++;
 }
 
 static void showLatencyReport(char *title) {
-    int j, seen = 0;
-    float perc, reqpersec;
+    static double percentiles[] = {50,75,90,95,99,99.9,100};
+    histogram *h = &config.latency;
+    float reqpersec;
+    double avg = h->total ? (double)h->sum/h->total/1000 : 0;
+    unsigned int j;
+    int op;
+
+    reqpersec = (float)config.donerequests/((float)config.totlatency/1000000);
+    if (config.output != OUTPUT_STANDARD) {
+        showRecord(title,h);
+        for (op = 0; op < config.numops; op++) {
+            char name[64];
 
-    reqpersec = (float)config.donerequests/((float)config.totlatency/1000);
-    if (!config.quiet) {
+            if (config.oplatency[op].total == 0) continue;
+            snprintf(name,sizeof(name),"%s:%s",title,config.opnames[op]);
+            showRecord(name,&config.oplatency[op]);
+        }
+    } else if (!config.quiet) {
         printf("====== %s ======\n", title);
         printf("  %d requests completed in %.2f seconds\n", config.donerequests,
-            (float)config.totlatency/1000);
+            (float)config.totlatency/1000000);
         printf("  %d parallel clients\n", config.numclients);
-        printf("  %d bytes payload\n", config.datasize);
+        if (config.replay && config.speed)
+            printf("  replay speed: %gx\n", config.speed);
+        else if (config.replay)
+            printf("  replay speed: max\n");
+        else if (config.workload)
+            printf("  %d-%d bytes payload\n", config.valuesize_min, config.valuesize_max);
+        else
+            printf("  %d bytes payload\n", config.datasize);
         printf("  keep alive: %d\n", config.keepalive);
+        printf("  pipeline: %d\n", config.pipeline);
+        printf("  threads: %d\n", config.numthreads);
+        if (config.rate) printf("  target rate: %.0f requests per second\n", config.rate);
         printf("\n");
-        for (j = 0; j <= MAX_LATENCY; j++) {
-            if (config.latency[j]) {
-                seen += config.latency[j];
-                perc = ((float)seen*100)/config.donerequests;
-                printf("%.2f%% <= %d milliseconds\n", perc, j);
-            }
+        for (j = 0; j < sizeof(percentiles)/sizeof(percentiles[0]); j++)
+            printf("%.2f%% <= %.3f milliseconds\n", percentiles[j],
+                (double)histPercentile(h,percentiles[j])/1000);
+        printf("latency (msec): avg=%.3f min=%.3f p50=%.3f p99=%.3f p99.9=%.3f max=%.3f\n",
+            avg, (double)h->min/1000,
+            (double)histPercentile(h,50)/1000, (double)histPercentile(h,99)/1000,
+            (double)histPercentile(h,99.9)/1000, (double)h->max/1000);
+        for (op = 0; op < config.numops; op++) {
+            histogram *oh = &config.oplatency[op];
+
+            if (oh->total == 0) continue;
+            printf("  %-7s %9lld requests avg=%.3f p50=%.3f p99=%.3f p99.9=%.3f max=%.3f\n",
+                config.opnames[op], oh->total, (double)oh->sum/oh->total/1000,
+                (double)histPercentile(oh,50)/1000, (double)histPercentile(oh,99)/1000,
+                (double)histPercentile(oh,99.9)/1000, (double)oh->max/1000);
         }
         printf("%.2f requests per second\n\n", reqpersec);
     } else {
         printf("%s: %.2f requests per second\n", title, reqpersec);
     }
+    fflush(stdout);
 }
 
 static void prepareForBenchmark(void)
 {
-    memset(config.latency,0,sizeof(int)*(MAX_LATENCY+1));
-    config.start = mstime();
+    int j, op;
+
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+
+        t->donerequests = 0;
+        t->sentrequests = 0;
+        t->nextclient = NULL;
+        histReset(&t->latency);
+        for (op = 0; op < config.numops; op++) histReset(&t->oplatency[op]);
+    }
+    config.start = ustime();
     config.donerequests = 0;
 }
 
 static void endBenchmark(char *title) {
-    config.totlatency = mstime()-config.start;
+    int j, op;
+
+    config.totlatency = ustime()-config.start;
+    histReset(&config.latency);
+    for (op = 0; op < config.numops; op++) histReset(&config.oplatency[op]);
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+
+        if (t->timer != -1) aeDeleteTimeEvent(t->el,t->timer);
+        t->timer = -1;
+        config.donerequests += t->donerequests;
+        histMerge(&config.latency,&t->latency);
+        for (op = 0; op < config.numops; op++)
+            histMerge(&config.oplatency[op],&t->oplatency[op]);
+    }
     showLatencyReport(title);
     freeAllClients();
 }
 
+static void *benchThreadMain(void *arg) {
+    benchThread *t = arg;
+
+    aeMain(t->el);
+    return NULL;
+}
+
+/* Run a test. In closed loop every client sends 'cmd' (a random command of
+ * the workload or the next captured commands if NULL) config.pipeline
+ * times, then waits for all the replies before sending the next batch. In
+ * open loop the requests are sent at the --rate pace by dispatchRequests(),
+ * or when due by dispatchReplay(). */
+static void benchmark(char *title, char *cmd) {
+    int j;
+
+    config.cmd = cmd ? sdsnew(cmd) : NULL;
+    config.cmds = sdsempty();
+    for (j = 0; cmd && j < config.pipeline; j++)
+        config.cmds = sdscat(config.cmds,cmd);
+    prepareForBenchmark();
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+
+        createMissingClients(t);
+        if (config.replay && config.speed) {
+            config.replaystart = ustime();
+            t->timer = aeCreateTimeEvent(t->el,1,dispatchReplay,t,NULL);
+        } else if (config.rate) {
+            t->nextsend = ustime();
+            t->timer = aeCreateTimeEvent(t->el,1,dispatchRequests,t,NULL);
+        }
+    }
+    if (config.numthreads == 1) {
+        aeMain(config.threads[0].el);
+    } else {
+        for (j = 0; j < config.numthreads; j++) {
+            if (pthread_create(&config.threads[j].thread,NULL,
+                               benchThreadMain,config.threads+j) != 0) {
+                fprintf(stderr,"Can't create the benchmark threads\n");
+                exit(1);
+            }
+        }
+        for (j = 0; j < config.numthreads; j++)
+            pthread_join(config.threads[j].thread,NULL);
+    }
+    endBenchmark(title);
+    sdsfree(config.cmd);
+    sdsfree(config.cmds);
+    config.cmd = config.cmds = NULL;
+}
+
+static void createThreads(void) {
+    int j;
+
+    if (config.numthreads > config.numclients) config.numthreads = config.numclients;
+    if (config.numthreads > config.requests) config.numthreads = config.requests;
+    if (config.numthreads < 1) config.numthreads = 1;
+    if (config.numthreads > 1) zmalloc_enable_thread_safeness();
+    config.threads = zmalloc(sizeof(benchThread)*config.numthreads);
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+
+        t->el = aeCreateEventLoop();
+        t->clients = listCreate();
+        t->liveclients = 0;
+        t->timer = -1;
+        t->numclients = config.numclients/config.numthreads +
+                        (j < config.numclients%config.numthreads);
+        t->requests = config.requests/config.numthreads +
+                      (j < config.requests%config.numthreads);
+        if (config.rate) t->interval = 1000000.0*config.numthreads/config.rate;
+    }
+}
+
+/* --workload get:80,set:20 */
+static int parseWorkload(char *spec) {
+    sds *ops;
+    int count, j, k;
+
+    ops = sdssplitlen(spec,strlen(spec),",",1,&count);
+    for (j = 0; j < count; j++) {
+        char *colon = strchr(ops[j],':');
+
+        if (colon == NULL) return 0;
+        *colon = '\0';
+        for (k = 0; k < WORKLOAD_OPS; k++)
+            if (!strcasecmp(ops[j],workloadOps[k].name)) break;
+        if (k == WORKLOAD_OPS || atoi(colon+1) < 0) return 0;
+        workloadOps[k].weight = atoi(colon+1);
+        config.totweight += workloadOps[k].weight;
+        sdsfree(ops[j]);
+    }
+    zfree(ops);
+    config.workload = 1;
+    return config.totweight > 0;
+}
+
+/* --keydist uniform|zipf[:<theta>]|hotspot[:<hot keys %>:<hot requests %>] */
+static int parseKeyDistribution(char *spec) {
+    if (!strcmp(spec,"uniform")) {
+        config.keydist = KEYDIST_UNIFORM;
+    } else if (!strncmp(spec,"zipf",4)) {
+        config.keydist = KEYDIST_ZIPF;
+        if (spec[4] == ':') config.zipf_theta = strtod(spec+5,NULL);
+        else if (spec[4] != '\0') return 0;
+        if (config.zipf_theta <= 0 || config.zipf_theta == 1) return 0;
+    } else if (!strncmp(spec,"hotspot",7)) {
+        config.keydist = KEYDIST_HOTSPOT;
+        if (spec[7] == ':') {
+            if (sscanf(spec+8,"%lf:%lf",&config.hot_keys,&config.hot_ops) != 2)
+                return 0;
+            config.hot_keys /= 100;
+            config.hot_ops /= 100;
+        } else if (spec[7] != '\0') {
+            return 0;
+        }
+        if (config.hot_keys <= 0 || config.hot_keys > 1 ||
+            config.hot_ops < 0 || config.hot_ops > 1) return 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
 void parseOptions(int argc, char **argv) {
     int i;
 
@@ -367,6 +1256,46 @@ void parseOptions(int argc, char **argv) {
             if (config.randomkeys_keyspacelen < 0)
                 config.randomkeys_keyspacelen = 0;
             i++;
+        } else if (!strcmp(argv[i],"-P") && !lastarg) {
+            config.pipeline = atoi(argv[i+1]);
+            if (config.pipeline < 1) config.pipeline = 1;
+            i++;
+        } else if (!strcmp(argv[i],"--threads") && !lastarg) {
+            config.numthreads = atoi(argv[i+1]);
+            i++;
+        } else if (!strcmp(argv[i],"--csv")) {
+            config.output = OUTPUT_CSV;
+        } else if (!strcmp(argv[i],"--json")) {
+            config.output = OUTPUT_JSON;
+        } else if (!strcmp(argv[i],"--workload") && !lastarg &&
+                   parseWorkload(argv[i+1])) {
+            i++;
+        } else if (!strcmp(argv[i],"--keydist") && !lastarg &&
+                   parseKeyDistribution(argv[i+1])) {
+            i++;
+        } else if (!strcmp(argv[i],"--valuesize") && !lastarg) {
+            int n = sscanf(argv[i+1],"%d-%d",&config.valuesize_min,
+                           &config.valuesize_max);
+
+            if (n == 1) config.valuesize_max = config.valuesize_min;
+            if (config.valuesize_min < 1) config.valuesize_min = 1;
+            if (config.valuesize_max > 1024*1024) config.valuesize_max = 1024*1024;
+            if (config.valuesize_max < config.valuesize_min)
+                config.valuesize_max = config.valuesize_min;
+            i++;
+        } else if (!strcmp(argv[i],"--preload")) {
+            config.preload = 1;
+        } else if (!strcmp(argv[i],"--rate") && !lastarg) {
+            config.rate = strtod(argv[i+1],NULL);
+            if (config.rate < 0) config.rate = 0;
+            i++;
+        } else if (!strcmp(argv[i],"--replay") && !lastarg) {
+            config.replay = argv[i+1];
+            i++;
+        } else if (!strcmp(argv[i],"--speed") && !lastarg &&
+                   (!strcasecmp(argv[i+1],"max") || strtod(argv[i+1],NULL) > 0)) {
+            config.speed = strcasecmp(argv[i+1],"max") ? strtod(argv[i+1],NULL) : 0;
+            i++;
         } else if (!strcmp(argv[i],"-q")) {
             config.quiet = 1;
         } else if (!strcmp(argv[i],"-l")) {
@@ -387,6 +1316,30 @@ void parseOptions(int argc, char **argv) {
             printf("  number of values for the random number. For instance\n");
             printf("  if set to 10 only rand000000000000 - rand000000000009\n");
             printf("  range will be allowed.\n");
+            printf(" -P <numreq>        Pipeline <numreq> requests (default 1)\n");
+            printf(" --threads <n>      Run the clients in <n> event loop threads (default 1)\n");
+            printf(" --csv              Output in CSV format\n");
+            printf(" --json             Output in JSON format\n");
+            printf(" --workload <mix>   Run a single test mixing the given commands, as\n");
+            printf("  <cmd>:<weight>,... for instance get:80,set:20. The commands\n");
+            printf("  are get set incr mget lpush lpop lrange sort sadd spop\n");
+            printf("  sinter ping, on -r keys (default 10000) named key:<n>,\n");
+            printf("  list:<n>, set:<n> and counter:<n>\n");
+            printf(" --keydist <dist>   Keys of the workload: uniform (default), zipf[:<theta>]\n");
+            printf("  (default 0.99) or hotspot[:<keys %%>:<requests %%>] (default\n");
+            printf("  20:80, 80%% of the requests to 20%% of the keys)\n");
+            printf(" --valuesize <min>[-<max>] Workload values size, uniform in the range\n");
+            printf("  (default -d)\n");
+            printf(" --preload          Create the keys of the workload before the test\n");
+            printf(" --rate <rps>       Open loop: send <rps> requests per second whatever\n");
+            printf("  the replies, the latency is measured from when every\n");
+            printf("  request was queued. Disables -P and -k 0\n");
+            printf(" --replay <file>    Replay the commands captured by redis-cli --capture,\n");
+            printf("  the commands of a captured client on the same connection\n");
+            printf("  (captured client id modulo -c). Runs a single thread\n");
+            printf(" --speed <n>|max    Replay <n> times faster than captured (default 1),\n");
+            printf("  or as fast as possible with -P commands in flight per\n");
+            printf("  connection\n");
             printf(" -q                 Quiet. Just show query/sec values\n");
             printf(" -l                 Loop. Run the tests forever\n");
             exit(1);
@@ -395,15 +1348,14 @@ void parseOptions(int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
-    client c;
+    char *data;
+    sds cmd;
 
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
 
     config.numclients = 50;
     config.requests = 10000;
-    config.liveclients = 0;
-    config.el = aeCreateEventLoop();
     config.keepalive = 1;
     config.donerequests = 0;
     config.datasize = 3;
@@ -411,84 +1363,98 @@ int main(int argc, char **argv) {
     config.randomkeys_keyspacelen = 0;
     config.quiet = 0;
     config.loop = 0;
-    config.latency = NULL;
-    config.clients = listCreate();
-    config.latency = zmalloc(sizeof(int)*(MAX_LATENCY+1));
+    config.pipeline = 1;
+    config.numthreads = 1;
+    config.output = OUTPUT_STANDARD;
+    config.cmd = config.cmds = NULL;
+    config.workload = 0;
+    config.totweight = 0;
+    config.keydist = KEYDIST_UNIFORM;
+    config.zipf_theta = 0.99;
+    config.hot_keys = 0.2;
+    config.hot_ops = 0.8;
+    config.valuesize_min = config.valuesize_max = 0;
+    config.preload = 0;
+    config.rate = 0;
+    config.numops = 0;
+    config.replay = NULL;
+    config.speed = 1;
+    config.records = NULL;
+    config.numrecords = 0;
 
     config.hostip = "127.0.0.1";
     config.hostport = 6379;
 
     parseOptions(argc,argv);
+    if (config.replay) {
+        replayLoad();
+        config.requests = config.numrecords;
+        config.numthreads = 1;
+        config.keepalive = 1;
+        config.workload = 0;
+        config.rate = 0;
+        if (config.speed) config.pipeline = 1;
+    }
+    if (config.rate) {
+        config.pipeline = 1;
+        config.keepalive = 1;
+    }
+    config.openloop = config.rate || (config.replay && config.speed);
+    createThreads();
 
     if (config.keepalive == 0) {
         printf("WARNING: keepalive disabled, you probably need 'echo 1 > /proc/sys/net/ipv4/tcp_tw_reuse' in order to use a lot of clients/requests\n");
     }
 
-    do {
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscatprintf(c->obuf,"SET foo_rand000000000000 %d\r\n",config.datasize);
-        {
-            char *data = zmalloc(config.datasize+2);
-            memset(data,'x',config.datasize);
-            data[config.datasize] = '\r';
-            data[config.datasize+1] = '\n';
-            c->obuf = sdscatlen(c->obuf,data,config.datasize+2);
-        }
-        c->replytype = REPLY_RETCODE;
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("SET");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"GET foo_rand000000000000\r\n");
-        c->replytype = REPLY_BULK;
-        c->readlen = -1;
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("GET");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"INCR counter_rand000000000000\r\n");
-        c->replytype = REPLY_INT;
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("INCR");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"LPUSH mylist 3\r\nbar\r\n");
-        c->replytype = REPLY_INT;
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("LPUSH");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"LPOP mylist\r\n");
-        c->replytype = REPLY_BULK;
-        c->readlen = -1;
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("LPOP");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"PING\r\n");
-        c->replytype = REPLY_RETCODE;
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("PING");
+    if (config.replay) {
+        do {
+            outputStart();
+            benchmark("REPLAY",NULL);
+            outputEnd();
+        } while(config.loop);
+        return 0;
+    }
 
-        printf("\n");
+    if (config.workload) {
+        int op;
+
+        for (op = 0; op < WORKLOAD_OPS; op++)
+            config.opnames[op] = workloadOps[op].name;
+        config.numops = WORKLOAD_OPS;
+        if (!config.randomkeys || config.randomkeys_keyspacelen == 0)
+            config.randomkeys_keyspacelen = WORKLOAD_KEYSPACELEN;
+        if (config.valuesize_min == 0)
+            config.valuesize_min = config.valuesize_max = config.datasize;
+        config.valuebuf = zmalloc(config.valuesize_max);
+        memset(config.valuebuf,'x',config.valuesize_max);
+        if (config.keydist == KEYDIST_ZIPF)
+            zipfInit(config.randomkeys_keyspacelen,config.zipf_theta);
+        if (config.preload) preloadKeyspace();
+        do {
+            outputStart();
+            benchmark("WORKLOAD",NULL);
+            outputEnd();
+        } while(config.loop);
+        return 0;
+    }
+
+    data = zmalloc(config.datasize+2);
+    memset(data,'x',config.datasize);
+    data[config.datasize] = '\r';
+    data[config.datasize+1] = '\n';
+    cmd = sdscatprintf(sdsempty(),"SET foo_rand000000000000 %d\r\n",config.datasize);
+    cmd = sdscatlen(cmd,data,config.datasize+2);
+    zfree(data);
+
+    do {
+        outputStart();
+        benchmark("SET",cmd);
+        benchmark("GET","GET foo_rand000000000000\r\n");
+        benchmark("INCR","INCR counter_rand000000000000\r\n");
+        benchmark("LPUSH","LPUSH mylist 3\r\nbar\r\n");
+        benchmark("LPOP","LPOP mylist\r\n");
+        benchmark("PING","PING\r\n");
+        outputEnd();
     } while(config.loop);
 
     return 0;
@@ -0,0 +1,188 @@
+/* Background jobs, see bio.h.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "bio.h"
+#include "adlist.h"
+#include "zmalloc.h"
+
+typedef struct bioJob {
+    bioJobProc *proc;           /* REDIS_BIO_LAZY_FREE only */
+    void *arg1, *arg2;
+} bioJob;
+
+static pthread_t bio_threads[REDIS_BIO_NUM_OPS];
+static pthread_mutex_t bio_mutex[REDIS_BIO_NUM_OPS]; /* protect the below */
+static pthread_cond_t bio_condvar[REDIS_BIO_NUM_OPS];
+static list *bio_jobs[REDIS_BIO_NUM_OPS];
+/* Pending counts the jobs queued and the one being executed, so that zero
+ * means that all the work submitted so far is done. */
+static unsigned long long bio_pending[REDIS_BIO_NUM_OPS];
+static unsigned long long bio_processed[REDIS_BIO_NUM_OPS];
+
+static const char *bio_names[REDIS_BIO_NUM_OPS] = {
+    "close_file", "fsync", "lazy_free"
+};
+
+static void bioExecuteJob(int type, bioJob *job) {
+    switch(type) {
+    case REDIS_BIO_CLOSE_FILE:
+        close((long)job->arg1);
+        break;
+    case REDIS_BIO_FSYNC:
+        fsync((long)job->arg1);
+        if (job->arg2) close((long)job->arg1);
+        break;
+    case REDIS_BIO_LAZY_FREE:
+        job->proc(job->arg1);
+        break;
+    }
+}
+
+static void *bioProcessBackgroundJobs(void *arg) {
+    int type = (long) arg;
+    sigset_t sigset;
+
+    /* The watchdog SIGALRM must reach the main thread only */
+    sigemptyset(&sigset);
+    sigaddset(&sigset,SIGALRM);
+    pthread_sigmask(SIG_BLOCK,&sigset,NULL);
+
+    pthread_mutex_lock(&bio_mutex[type]);
+    while(1) {
+        listNode *ln;
+        bioJob *job;
+
+        if (listLength(bio_jobs[type]) == 0) {
+            pthread_cond_wait(&bio_condvar[type],&bio_mutex[type]);
+            continue;
+        }
+        ln = listFirst(bio_jobs[type]);
+        job = listNodeValue(ln);
+        listDelNode(bio_jobs[type],ln);
+        pthread_mutex_unlock(&bio_mutex[type]);
+
+        bioExecuteJob(type,job);
+        zfree(job);
+
+        pthread_mutex_lock(&bio_mutex[type]);
+        bio_pending[type]--;
+        bio_processed[type]++;
+    }
+    return NULL;
+}
+
+int bioInit(void) {
+    long j;
+
+    zmalloc_enable_thread_safeness();
+    for (j = 0; j < REDIS_BIO_NUM_OPS; j++) {
+        pthread_mutex_init(&bio_mutex[j],NULL);
+        pthread_cond_init(&bio_condvar[j],NULL);
+        if ((bio_jobs[j] = listCreate()) == NULL) return -1;
+        bio_pending[j] = bio_processed[j] = 0;
+    }
+    for (j = 0; j < REDIS_BIO_NUM_OPS; j++) {
+        if (pthread_create(&bio_threads[j],NULL,
+                           bioProcessBackgroundJobs,(void*)j) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void bioSubmitJob(int type, bioJob *job) {
+    pthread_mutex_lock(&bio_mutex[type]);
+    if (!listAddNodeTail(bio_jobs[type],job)) {
+        /* Out of memory: better to block than to lose the job */
+        pthread_mutex_unlock(&bio_mutex[type]);
+        bioExecuteJob(type,job);
+        zfree(job);
+        return;
+    }
+    bio_pending[type]++;
+    pthread_cond_signal(&bio_condvar[type]);
+    pthread_mutex_unlock(&bio_mutex[type]);
+}
+
+void bioCreateBackgroundJob(int type, void *arg1, void *arg2) {
+    bioJob job, *j = zmalloc(sizeof(*j));
+
+    job.proc = NULL;
+    job.arg1 = arg1;
+    job.arg2 = arg2;
+    if (j == NULL) {
+        bioExecuteJob(type,&job);
+        return;
+    }
+    *j = job;
+    bioSubmitJob(type,j);
+}
+
+void bioCreateProcJob(int type, bioJobProc *proc, void *arg) {
+    bioJob job, *j = zmalloc(sizeof(*j));
+
+    job.proc = proc;
+    job.arg1 = arg;
+    job.arg2 = NULL;
+    if (j == NULL) {
+        bioExecuteJob(type,&job);
+        return;
+    }
+    *j = job;
+    bioSubmitJob(type,j);
+}
+
+unsigned long long bioPendingJobsOfType(int type) {
+    unsigned long long val;
+
+    pthread_mutex_lock(&bio_mutex[type]);
+    val = bio_pending[type];
+    pthread_mutex_unlock(&bio_mutex[type]);
+    return val;
+}
+
+unsigned long long bioProcessedJobsOfType(int type) {
+    unsigned long long val;
+
+    pthread_mutex_lock(&bio_mutex[type]);
+    val = bio_processed[type];
+    pthread_mutex_unlock(&bio_mutex[type]);
+    return val;
+}
+
+const char *bioJobTypeName(int type) {
+    return bio_names[type];
+}
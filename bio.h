@@ -0,0 +1,38 @@
+/* Background jobs: slow system calls and memory reclaiming moved out of
+ * the event loop.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * See the COPYING file for the license (BSD). */
+
+#ifndef __BIO_H
+#define __BIO_H
+
+/* Job types. Every type has its own queue served by its own thread, so a
+ * slow fsync() never delays a close() and jobs of the same type are always
+ * executed in the order they were created. */
+#define REDIS_BIO_CLOSE_FILE    0   /* close(arg1) */
+#define REDIS_BIO_FSYNC         1   /* fsync(arg1), then close it if arg2 */
+#define REDIS_BIO_LAZY_FREE     2   /* proc(arg1), see bioCreateProcJob() */
+#define REDIS_BIO_NUM_OPS       3
+
+/* There is no unlink job: removing a file that is still open only drops
+ * its name, the slow part is releasing the blocks and that happens on the
+ * last close(). To remove a file without blocking, open it, unlink() it and
+ * pass the fd to a REDIS_BIO_CLOSE_FILE job. Unlinking by name from another
+ * thread could also remove a new file created with the same name. */
+
+typedef void bioJobProc(void *arg);
+
+/* bioInit() returns -1 if the threads can't be created. Once called
+ * zmalloc() is thread safe, as the threads use it too. Call it after
+ * daemonize(): the threads don't survive a fork(). */
+int bioInit(void);
+void bioCreateBackgroundJob(int type, void *arg1, void *arg2);
+void bioCreateProcJob(int type, bioJobProc *proc, void *arg);
+unsigned long long bioPendingJobsOfType(int type);
+unsigned long long bioProcessedJobsOfType(int type);
+const char *bioJobTypeName(int type);
+
+#endif
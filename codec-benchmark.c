@@ -0,0 +1,170 @@
+/* RDB compression codecs benchmark.
+ *
+ * Splits a data set in values of the given size and compresses every value
+ * with the codecs available to the RDB code, reporting the compression
+ * ratio and the compression / decompression speed. Every value is
+ * decompressed and checked against the original.
+ *
+ * Usage: codec-benchmark [file] [value size]
+ *
+ * Without a file a synthetic data set is used. To test a real data set
+ * use a file with the kind of values stored in Redis.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * See the COPYING file for the license (BSD). */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "lzf.h"
+#include "lz4.h"
+
+#define DEFAULT_VALUE_SIZE 1024
+#define SYNTHETIC_SIZE (1024*1024*32)
+#define MIN_RUN_TIME 1000000    /* run every test at least one second */
+
+typedef unsigned int codecProc(const void *const in, unsigned int inlen,
+        void *out, unsigned int outlen);
+
+static struct {
+    char *name;
+    codecProc *compress;
+    codecProc *decompress;
+} codecs[] = {
+    {"lzf",lzf_compress,lzf_decompress},
+    {"lzf-fast",lzf_compress_fast,lzf_decompress},
+    {"lz4",lz4_compress,lz4_decompress},
+    {NULL,NULL,NULL}
+};
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Text made of words with some numbers, similar to many real values */
+static char *syntheticData(size_t len) {
+    char *words[] = {"user","session","profile","name","email","id",
+        "timestamp","value","score","status","active","\"","{","}",":",","};
+    char *p = malloc(len);
+    size_t j = 0;
+
+    if (!p) return NULL;
+    while(j < len) {
+        char buf[32];
+        int l;
+
+        if (random() % 4 == 0)
+            l = snprintf(buf,sizeof(buf),"%ld ",random() % 100000);
+        else
+            l = snprintf(buf,sizeof(buf),"%s ",
+                    words[random() % (sizeof(words)/sizeof(char*))]);
+        if (j+l > len) l = len-j;
+        memcpy(p+j,buf,l);
+        j += l;
+    }
+    return p;
+}
+
+static char *readFile(char *filename, size_t *len) {
+    FILE *fp = fopen(filename,"r");
+    char *p;
+
+    if (!fp) return NULL;
+    fseek(fp,0,SEEK_END);
+    *len = ftell(fp);
+    fseek(fp,0,SEEK_SET);
+    if ((p = malloc(*len)) == NULL || fread(p,*len,1,fp) == 0) {
+        fclose(fp);
+        free(p);
+        return NULL;
+    }
+    fclose(fp);
+    return p;
+}
+
+int main(int argc, char **argv) {
+    size_t len, vlen = DEFAULT_VALUE_SIZE, numvalues, j;
+    char *data, *out, *check;
+    unsigned int *clen;
+    int i, errors = 0;
+
+    if (argc >= 3) vlen = atoi(argv[2]);
+    if (argc >= 2 && strcmp(argv[1],"-")) {
+        if ((data = readFile(argv[1],&len)) == NULL) {
+            perror("Reading the data set");
+            exit(1);
+        }
+    } else {
+        len = SYNTHETIC_SIZE;
+        if ((data = syntheticData(len)) == NULL) exit(1);
+    }
+    if (vlen < 21 || vlen > len) {
+        fprintf(stderr,"Invalid value size\n");
+        exit(1);
+    }
+    numvalues = len/vlen;
+    out = malloc(numvalues*vlen);
+    check = malloc(vlen);
+    clen = malloc(sizeof(unsigned int)*numvalues);
+    if (!out || !check || !clen) exit(1);
+
+    printf("%lu values of %lu bytes\n",
+        (unsigned long)numvalues, (unsigned long)vlen);
+    for (i = 0; codecs[i].name; i++) {
+        long long start, ctime, dtime, rounds, csize = 0, saved = 0;
+
+        /* Values that don't shrink by at least four bytes are saved
+         * verbatim in the dump, like rdbSaveStringObject() does. */
+        rounds = 0;
+        start = ustime();
+        do {
+            for (j = 0; j < numvalues; j++)
+                clen[j] = codecs[i].compress(data+j*vlen,vlen,
+                                             out+j*vlen,vlen-4);
+            rounds++;
+        } while(ustime()-start < MIN_RUN_TIME);
+        ctime = (ustime()-start)/rounds;
+        for (j = 0; j < numvalues; j++) {
+            csize += clen[j] ? clen[j] : vlen;
+            if (clen[j]) saved++;
+        }
+
+        rounds = 0;
+        start = ustime();
+        do {
+            for (j = 0; j < numvalues; j++) {
+                if (clen[j] == 0) continue;
+                codecs[i].decompress(out+j*vlen,clen[j],check,vlen);
+            }
+            rounds++;
+        } while(ustime()-start < MIN_RUN_TIME);
+        dtime = (ustime()-start)/rounds;
+
+        for (j = 0; j < numvalues; j++) {
+            if (clen[j] == 0) continue;
+            if (codecs[i].decompress(out+j*vlen,clen[j],check,vlen) != vlen ||
+                memcmp(check,data+j*vlen,vlen) != 0) errors++;
+        }
+        printf("%s: ratio %.3f, %lld of %lu values compressed, "
+               "compress %.1f MB/s, decompress %.1f MB/s%s\n",
+            codecs[i].name, (double)csize/(numvalues*vlen), saved,
+            (unsigned long)numvalues,
+            (double)(numvalues*vlen)/ctime,
+            dtime ? (double)(numvalues*vlen)/dtime : 0,
+            errors ? ", ROUND TRIP ERRORS" : "");
+    }
+    free(data);
+    free(out);
+    free(check);
+    free(clen);
+    return errors ? 1 : 0;
+}
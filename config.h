@@ -17,6 +17,13 @@
 #define redis_malloc_size(p) malloc_size(p)
 #endif
 
+/* glibc can tell the usable size of a block as well */
+#if defined(__GLIBC__) && !defined(HAVE_MALLOC_SIZE)
+#include <malloc.h>
+#define HAVE_MALLOC_SIZE 1
+#define redis_malloc_size(p) malloc_usable_size(p)
+#endif
+
 /* define redis_fstat to fstat or fstat64() */
 #if defined(__APPLE__) && !defined(MAC_OS_X_VERSION_10_6)
 //MAC机下的stat函数原型
@@ -34,4 +41,9 @@
 #define HAVE_BACKTRACE 1
 #endif
 
+/* test for the __sync atomic builtins, used by zmalloc when thread safe */
+#if defined(__GNUC__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define HAVE_ATOMIC 1
+#endif
+
 #endif
@@ -0,0 +1,370 @@
+/* Microbenchmarks of the core data structures.
+ *
+ * Measures dict, sds, adlist, lzf, stringmatchlen() and the inline request
+ * parser in isolation, without a network, reporting the time and the
+ * zmalloc() allocations of every operation. An optional argument runs only
+ * the benchmarks whose name contains it:
+ *
+ *   ./core-benchmark [filter]
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * See the COPYING file for the license (BSD). */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dict.h"
+#include "sds.h"
+#include "adlist.h"
+#include "zmalloc.h"
+#include "lzf.h"
+#include "stringmatch.h"
+#include "protocol.h"
+
+#define MIN_OPS 1000000     /* small structures are measured more times */
+#define LZF_BLOCK 4096
+#define PIPELINE_LEN 100    /* commands in a parsed query buffer */
+
+static char *filter = NULL;
+static long long bench_start;
+static size_t bench_allocs;
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+static int benchEnabled(char *name) {
+    return filter == NULL || strstr(name,filter) != NULL;
+}
+
+static void benchStart(void) {
+    bench_allocs = zmalloc_total_allocs();
+    bench_start = ustime();
+}
+
+static void benchEnd(char *name, long long ops) {
+    long long usec = ustime()-bench_start;
+    size_t allocs = zmalloc_total_allocs()-bench_allocs;
+
+    printf("%-40s %10lld ops %10.1f ns/op %8.2f allocs/op\n", name, ops,
+        (double)usec*1000/ops, (double)allocs/ops);
+    fflush(stdout);
+}
+
+/* ---------------------------------- dict ---------------------------------- */
+
+static unsigned int benchSdsHash(const void *key) {
+    return dictGenHashFunction(key,sdslen((sds)key));
+}
+
+static int benchSdsKeyCompare(void *privdata, const void *key1, const void *key2) {
+    int l1 = sdslen((sds)key1), l2 = sdslen((sds)key2);
+
+    (void)privdata;
+    return l1 == l2 && memcmp(key1,key2,l1) == 0;
+}
+
+/* The keys are owned by the benchmark: the dict allocations only are
+ * accounted */
+static dictType benchDictType = {
+    benchSdsHash,
+    NULL,
+    NULL,
+    benchSdsKeyCompare,
+    NULL,
+    NULL
+};
+
+static void benchDict(long size) {
+    sds *keys = zmalloc(sizeof(sds)*size), *missing = zmalloc(sizeof(sds)*size);
+    long rounds = size >= MIN_OPS ? 1 : MIN_OPS/size, ops = size*rounds, j, r;
+    char name[64];
+    dict *d = NULL;
+
+    for (j = 0; j < size; j++) {
+        keys[j] = sdscatprintf(sdsempty(),"key:%ld",j);
+        missing[j] = sdscatprintf(sdsempty(),"missing:%ld",j);
+    }
+
+    snprintf(name,sizeof(name),"dictAdd %ld keys",size);
+    if (benchEnabled(name)) {
+        benchStart();
+        for (r = 0; r < rounds; r++) {
+            d = dictCreate(&benchDictType,NULL);
+            for (j = 0; j < size; j++) dictAdd(d,keys[j],NULL);
+            if (r != rounds-1) dictRelease(d);
+        }
+        benchEnd(name,ops);
+    } else {
+        d = dictCreate(&benchDictType,NULL);
+        for (j = 0; j < size; j++) dictAdd(d,keys[j],NULL);
+    }
+
+    snprintf(name,sizeof(name),"dictFind %ld keys (hit)",size);
+    if (benchEnabled(name)) {
+        benchStart();
+        for (r = 0; r < rounds; r++)
+            for (j = 0; j < size; j++) dictFind(d,keys[random() % size]);
+        benchEnd(name,ops);
+    }
+
+    snprintf(name,sizeof(name),"dictFind %ld keys (miss)",size);
+    if (benchEnabled(name)) {
+        benchStart();
+        for (r = 0; r < rounds; r++)
+            for (j = 0; j < size; j++) dictFind(d,missing[random() % size]);
+        benchEnd(name,ops);
+    }
+
+    snprintf(name,sizeof(name),"dictGetRandomKey %ld keys",size);
+    if (benchEnabled(name)) {
+        benchStart();
+        for (j = 0; j < ops; j++) dictGetRandomKey(d);
+        benchEnd(name,ops);
+    }
+
+    snprintf(name,sizeof(name),"dictDelete %ld keys",size);
+    if (benchEnabled(name)) {
+        long deleted = 0;
+
+        benchStart();
+        for (r = 0; r < rounds; r++) {
+            /* Refill out of the measure */
+            if (r) {
+                long long paused = ustime();
+                size_t allocs = zmalloc_total_allocs();
+
+                for (j = 0; j < size; j++) dictAdd(d,keys[j],NULL);
+                bench_start += ustime()-paused;
+                bench_allocs += zmalloc_total_allocs()-allocs;
+            }
+            for (j = 0; j < size; j++) deleted += dictDelete(d,keys[j]) == DICT_OK;
+        }
+        benchEnd(name,ops);
+        if (deleted != ops) printf("ERROR: %ld keys deleted, %ld expected\n", deleted, ops);
+    }
+
+    dictRelease(d);
+    for (j = 0; j < size; j++) {
+        sdsfree(keys[j]);
+        sdsfree(missing[j]);
+    }
+    zfree(keys);
+    zfree(missing);
+}
+
+/* ---------------------------------- sds ----------------------------------- */
+
+static void benchSds(void) {
+    long j;
+    sds s;
+
+    if (benchEnabled("sdscatlen 16 bytes")) {
+        s = sdsempty();
+        benchStart();
+        for (j = 0; j < MIN_OPS; j++) s = sdscatlen(s,"0123456789abcdef",16);
+        benchEnd("sdscatlen 16 bytes",MIN_OPS);
+        sdsfree(s);
+    }
+
+    if (benchEnabled("sdsrange 1KB string")) {
+        s = sdsempty();
+        for (j = 0; j < 1024; j++) s = sdscatlen(s,"x",1);
+        benchStart();
+        for (j = 0; j < MIN_OPS; j++) {
+            /* Drop the first byte and put it back, so the length is stable */
+            s = sdsrange(s,1,-1);
+            s = sdscatlen(s,"x",1);
+        }
+        benchEnd("sdsrange 1KB string",MIN_OPS);
+        sdsfree(s);
+    }
+
+    if (benchEnabled("sdssplitlen 5 arguments")) {
+        char *line = "SET key:1234567 value:abcdefgh EX 100";
+        int len = strlen(line), count, k;
+
+        benchStart();
+        for (j = 0; j < MIN_OPS; j++) {
+            sds *argv = sdssplitlen(line,len," ",1,&count);
+
+            for (k = 0; k < count; k++) sdsfree(argv[k]);
+            zfree(argv);
+        }
+        benchEnd("sdssplitlen 5 arguments",MIN_OPS);
+    }
+}
+
+/* --------------------------------- adlist --------------------------------- */
+
+static void benchList(void) {
+    list *l = listCreate();
+    long j;
+
+    if (benchEnabled("listAddNodeTail")) {
+        benchStart();
+        for (j = 0; j < MIN_OPS; j++) listAddNodeTail(l,(void*)j);
+        benchEnd("listAddNodeTail",MIN_OPS);
+    }
+
+    if (benchEnabled("listDelNode head (pop)")) {
+        while(listLength(l) < MIN_OPS) listAddNodeTail(l,NULL);
+        benchStart();
+        for (j = 0; j < MIN_OPS; j++) listDelNode(l,listFirst(l));
+        benchEnd("listDelNode head (pop)",MIN_OPS);
+    }
+
+    if (benchEnabled("listIndex 1000 elements")) {
+        long ops = MIN_OPS/10;
+
+        while(listLength(l)) listDelNode(l,listFirst(l));
+        for (j = 0; j < 1000; j++) listAddNodeTail(l,NULL);
+        benchStart();
+        for (j = 0; j < ops; j++) listIndex(l,random() % 1000);
+        benchEnd("listIndex 1000 elements",ops);
+    }
+    listRelease(l);
+}
+
+/* ---------------------------------- lzf ----------------------------------- */
+
+static void benchLzf(void) {
+    char in[LZF_BLOCK], out[LZF_BLOCK], back[LZF_BLOCK];
+    long ops = MIN_OPS/10, j;
+    unsigned int clen = 0, len = 0;
+
+    /* Values with the redundancy of real datasets: records made of a few
+     * repeated field names and random digits */
+    for (j = 0; j < LZF_BLOCK; j += 32) {
+        char record[64];
+
+        snprintf(record,sizeof(record),"{\"id\":%08ld,\"v\":%08ld}    ",
+            random() % 100000000, random() % 100000000);
+        memcpy(in+j,record,32);
+    }
+
+    if (benchEnabled("lzf_compress 4KB")) {
+        benchStart();
+        for (j = 0; j < ops; j++) clen = lzf_compress(in,LZF_BLOCK,out,LZF_BLOCK);
+        benchEnd("lzf_compress 4KB",ops);
+    } else {
+        clen = lzf_compress(in,LZF_BLOCK,out,LZF_BLOCK);
+    }
+
+    if (clen && benchEnabled("lzf_decompress 4KB")) {
+        benchStart();
+        for (j = 0; j < ops; j++) len = lzf_decompress(out,clen,back,LZF_BLOCK);
+        benchEnd("lzf_decompress 4KB",ops);
+        if (len != LZF_BLOCK || memcmp(in,back,LZF_BLOCK))
+            printf("ERROR: lzf_decompress() output differs from the input\n");
+    }
+}
+
+/* ------------------------------- stringmatch ------------------------------ */
+
+static void benchStringmatch(void) {
+    char *patterns[] = {"user:*", "*:profile", "user:?????:*", "*[0-9][0-9]:*", NULL};
+    char key[64], name[64];
+    int j;
+    long i;
+
+    for (j = 0; patterns[j]; j++) {
+        int plen = strlen(patterns[j]);
+
+        snprintf(name,sizeof(name),"stringmatchlen %s",patterns[j]);
+        if (!benchEnabled(name)) continue;
+        benchStart();
+        for (i = 0; i < MIN_OPS; i++) {
+            int klen = snprintf(key,sizeof(key),"user:%ld:profile",i);
+
+            stringmatchlen(patterns[j],plen,key,klen,0);
+        }
+        benchEnd(name,MIN_OPS);
+    }
+}
+
+/* ----------------------------- request parser ----------------------------- */
+
+/* Split the inline requests of the query buffer in arguments with the same
+ * steps of readQueryFromClient(): find the newline, move the rest of the
+ * buffer in a new one, trim the CRLF and sdssplitlen() the line. Returns
+ * the number of requests parsed. */
+/* Parse the queries the way readQueryFromClient() does. When 'bulk' is
+ * true every query is a REDIS_CMD_BULK one, its last argument being the
+ * length of the bulk that follows. */
+static int parseQueryBuffer(sds querybuf, int bulk) {
+    int requests = 0;
+    sds *argv, arg;
+    int argc, j;
+
+    while(protocolReadInlineQuery(&querybuf,&argv,&argc)) {
+        if (argc <= 0) continue;
+        if (bulk) {
+            int bulklen = atoi(argv[argc-1])+2;
+
+            if ((arg = protocolReadBulk(&querybuf,bulklen)) == NULL) {
+                for (j = 0; j < argc; j++) sdsfree(argv[j]);
+                zfree(argv);
+                break;
+            }
+            sdsfree(arg);
+        }
+        for (j = 0; j < argc; j++) sdsfree(argv[j]);
+        zfree(argv);
+        requests++;
+    }
+    sdsfree(querybuf);
+    return requests;
+}
+
+static void benchParser(void) {
+    char *names[] = {"parse inline GET", "parse inline pipeline of 100",
+                     "parse bulk SET pipeline of 100"};
+    int pipeline[] = {1, PIPELINE_LEN, PIPELINE_LEN};
+    int bulk[] = {0, 0, 1};
+    int k, j;
+
+    for (k = 0; k < 3; k++) {
+        long ops = 0, rounds = MIN_OPS/pipeline[k], r;
+        sds buf;
+
+        if (!benchEnabled(names[k])) continue;
+        buf = sdsempty();
+        for (j = 0; j < pipeline[k]; j++) {
+            if (bulk[k])
+                buf = sdscatprintf(buf,"SET key:%d 3\r\nbar\r\n",j);
+            else
+                buf = sdscatprintf(buf,"GET key:%d\r\n",j);
+        }
+        benchStart();
+        /* The copy stands for the read() of the query buffer */
+        for (r = 0; r < rounds; r++)
+            ops += parseQueryBuffer(sdsnewlen(buf,sdslen(buf)),bulk[k]);
+        benchEnd(names[k],ops);
+        sdsfree(buf);
+    }
+}
+
+int main(int argc, char **argv) {
+    long sizes[] = {1000, 100000, 1000000};
+    unsigned int j;
+
+    if (argc > 1) filter = argv[1];
+    srandom(1234);
+    for (j = 0; j < sizeof(sizes)/sizeof(sizes[0]); j++) benchDict(sizes[j]);
+    benchSds();
+    benchList();
+    benchLzf();
+    benchStringmatch();
+    benchParser();
+    return 0;
+}
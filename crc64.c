@@ -0,0 +1,84 @@
+/* CRC-64 with the Jones polynomial (reflected, 0xad93d23594c935a9).
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "crc64.h"
+
+#define CRC64_POLY 0x95ac9329ac4bc9b5ULL /* reflected Jones polynomial */
+
+/* Slicing-by-8: crc64_table[0] is the classic byte at a time table, the
+ * table k gives the CRC of a byte followed by k zero bytes, so that eight
+ * input bytes are processed with eight independent lookups. */
+static uint64_t crc64_table[8][256];
+
+void crc64Init(void) {
+    int j, k;
+
+    for (j = 0; j < 256; j++) {
+        uint64_t crc = j;
+
+        for (k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+        crc64_table[0][j] = crc;
+    }
+    for (j = 0; j < 256; j++) {
+        for (k = 1; k < 8; k++) {
+            uint64_t crc = crc64_table[k-1][j];
+
+            crc64_table[k][j] = crc64_table[0][crc & 0xff] ^ (crc >> 8);
+        }
+    }
+}
+
+uint64_t crc64(uint64_t crc, const void *p, size_t len) {
+    const unsigned char *s = p;
+
+    while (len >= 8) {
+        /* Little endian load done byte by byte, so that it works on every
+         * architecture: compilers turn it into a single load on x86. */
+        uint64_t w = crc ^ ((uint64_t)s[0] | (uint64_t)s[1] << 8 |
+                            (uint64_t)s[2] << 16 | (uint64_t)s[3] << 24 |
+                            (uint64_t)s[4] << 32 | (uint64_t)s[5] << 40 |
+                            (uint64_t)s[6] << 48 | (uint64_t)s[7] << 56);
+
+        crc = crc64_table[7][w & 0xff] ^
+              crc64_table[6][(w >> 8) & 0xff] ^
+              crc64_table[5][(w >> 16) & 0xff] ^
+              crc64_table[4][(w >> 24) & 0xff] ^
+              crc64_table[3][(w >> 32) & 0xff] ^
+              crc64_table[2][(w >> 40) & 0xff] ^
+              crc64_table[1][(w >> 48) & 0xff] ^
+              crc64_table[0][w >> 56];
+        s += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = crc64_table[0][(crc ^ *s++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
@@ -0,0 +1,20 @@
+/* CRC-64 (Jones polynomial) used as the checksum of the RDB file.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * See the COPYING file for the license (BSD). */
+
+#ifndef __CRC64_H
+#define __CRC64_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* crc64Init() must be called once before using crc64(). The checksum of
+ * data written in many chunks is obtained passing the result of the previous
+ * call as 'crc', starting from 0. */
+void crc64Init(void);
+uint64_t crc64(uint64_t crc, const void *p, size_t len);
+
+#endif
@@ -41,6 +41,7 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <limits.h>
+#include <sys/time.h>
 
 #include "dict.h"
 #include "zmalloc.h"
@@ -80,6 +81,21 @@ static void _dictFree(void *ptr) {
     zfree(ptr);
 }
 
+/* Using dictEnableResize() / dictDisableResize() we make possible to
+ * enable/disable resizing of the hash tables as needed. This is very
+ * important for Redis, as we use copy-on-write and don't want to move too
+ * much memory around when there is a child performing saving operations.
+ *
+ * Note that even when dict_can_resize is set to 0, not all resizes are
+ * prevented: a hash table is still allowed to grow if the ratio between
+ * the number of elements and the buckets > dict_force_resize_ratio, so that
+ * lookups don't degrade too much. */
+static int dict_can_resize = 1;
+static unsigned int dict_force_resize_ratio = 5;
+
+/* Called after every rehash of a non empty table, see dictSetRehashProc() */
+static dictRehashProc *dict_rehash_proc = NULL;
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
@@ -182,11 +198,33 @@ int dictResize(dict *ht)
 {
     int minimal = ht->used;
 
+    if (!dict_can_resize) return DICT_ERR;
     if (minimal < DICT_HT_INITIAL_SIZE)
         minimal = DICT_HT_INITIAL_SIZE;
     return dictExpand(ht, minimal);
 }
 
+void dictEnableResize(void) {
+    dict_can_resize = 1;
+}
+
+void dictDisableResize(void) {
+    dict_can_resize = 0;
+}
+
+/* Growing a table moves all its elements at once: the application can be
+ * notified of how long it took, for instance to track latency spikes. */
+void dictSetRehashProc(dictRehashProc *proc) {
+    dict_rehash_proc = proc;
+}
+
+static long long _dictUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
 /* Expand or create the hashtable */
 /**
  * 创建Hash表，Hash表的大小为size
@@ -194,6 +232,8 @@ int dictResize(dict *ht)
 int dictExpand(dict *ht, unsigned long size)
 {
     dict n; /* the new hashtable */
+    unsigned long i, elements = ht->used;
+    long long start = 0;
     //重设Hash表的大小，大小为2的指数
     unsigned long realsize = _dictNextPower(size);
 
@@ -217,6 +257,7 @@ int dictExpand(dict *ht, unsigned long size)
      * so dictExpand just creates an hash table. */
      //使用的内存记录数
     n.used = ht->used;
+    if (dict_rehash_proc && elements) start = _dictUstime();
     for (i = 0; i < ht->size && ht->used > 0; i++) {
         dictEntry *he, *nextHe;
 
@@ -248,6 +289,8 @@ int dictExpand(dict *ht, unsigned long size)
     /* Remap the new hashtable in the old */
     //将新Hash表作为值进行赋值
     *ht = n;
+    if (dict_rehash_proc && elements)
+        dict_rehash_proc(elements,_dictUstime()-start);
     //返回创建成功
     return DICT_OK;
 }
@@ -488,6 +531,55 @@ void dictReleaseIterator(dictIterator *iter)
     _dictFree(iter);
 }
 
+/* Reverse the bits of an unsigned long, used by dictScan() */
+static unsigned long rev(unsigned long v) {
+    unsigned long s = 8 * sizeof(v); /* bit size; must be power of 2 */
+    unsigned long mask = ~0UL;
+
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+/* dictScan() is used to iterate over the elements of a dictionary without
+ * holding any state between calls: the caller starts with a cursor of 0,
+ * and calls the function again with the returned cursor until 0 is
+ * returned. For every call all the entries of one bucket are passed to
+ * 'fn'.
+ *
+ * The cursor is incremented starting from the high order bits of the
+ * bucket index (reverse binary increment). Since the table size is always
+ * a power of two, when the table grows or shrinks between two calls the
+ * buckets already visited map to buckets that are again "before" the
+ * cursor, so every element present for the whole iteration is returned at
+ * least once. Elements may be returned multiple times if the table shrinks.
+ *
+ * The callback must not add or remove entries from the dictionary. */
+unsigned long dictScan(dict *ht, unsigned long v, dictScanFunction *fn,
+                       void *privdata)
+{
+    dictEntry *de;
+    unsigned long m0;
+
+    if (ht->used == 0) return 0;
+    m0 = ht->sizemask;
+    de = ht->table[v & m0];
+    while (de) {
+        fn(privdata, de);
+        de = de->next;
+    }
+
+    /* Set the unmasked bits so that incrementing the reversed cursor
+     * operates on the masked bits only */
+    v |= ~m0;
+    v = rev(v);
+    v++;
+    v = rev(v);
+    return v;
+}
+
 /* Return a random entry from the hash table. Useful to
  * implement randomized algorithms */
 /**
@@ -539,7 +631,9 @@ static int _dictExpandIfNeeded(dict *ht)
     if (ht->size == 0)
         return dictExpand(ht, DICT_HT_INITIAL_SIZE);
     //如果hash表里数据记录数已经与hashtable的大小相同的话，则将大小扩充为2倍
-    if (ht->used == ht->size)//里面的记录数已经达到了hashtable的大小时，则需要进行扩充空间
+    //（禁止调整大小时，只有记录数超过大小的dict_force_resize_ratio倍才扩充）
+    if (ht->used >= ht->size &&
+        (dict_can_resize || ht->used/ht->size > dict_force_resize_ratio))
         return dictExpand(ht, ht->size*2);
     return DICT_OK;
 }
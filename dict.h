@@ -79,6 +79,10 @@ typedef struct dict {
     void *privdata;
 } dict;
 
+//无状态游标遍历(dictScan)时对每个元素调用的回调函数
+typedef void dictScanFunction(void *privdata, const dictEntry *de);
+typedef void dictRehashProc(unsigned long elements, long long usec);
+
 //对Hash表进行迭代遍历时使用的迭代器
 typedef struct dictIterator {
     dict *ht;
@@ -191,6 +195,11 @@ void dictReleaseIterator(dictIterator *iter);
  * 从Hash表中随机获取一个键值 
  */
 dictEntry *dictGetRandomKey(dict *ht);
+/**
+ * 以反向二进制游标的方式无状态遍历Hash表,每次遍历一个slot
+ */
+unsigned long dictScan(dict *ht, unsigned long v, dictScanFunction *fn,
+                       void *privdata);
 /**
  * 打印出Hash表中的当前状态
  */
@@ -203,6 +212,15 @@ unsigned int dictGenHashFunction(const unsigned char *buf, int len);
  * 判断Hash表是否为空
  */
 void dictEmpty(dict *ht);
+/**
+ * 允许/禁止调整Hash表的大小（有子进程在保存数据时禁止，以减少写时复制）
+ */
+void dictEnableResize(void);
+void dictDisableResize(void);
+/**
+ * 设置每次扩充非空Hash表后调用的函数，参数为迁移的记录数及耗时(微秒)
+ */
+void dictSetRehashProc(dictRehashProc *proc);
 
 /* Hash table types */
 
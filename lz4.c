@@ -0,0 +1,189 @@
+/* A small LZ4 block format compressor, used as a fast alternative to LZF
+ * to compress big values in the RDB file.
+ *
+ * The output is a standard LZ4 block: a sequence of
+ *
+ *   [token][literal len bytes][literals][offset 16 bit LE][match len bytes]
+ *
+ * where the high 4 bits of the token are the number of literals and the low
+ * 4 bits are the match length minus 4. A nibble of 15 means more length
+ * bytes follow, each adding up to 255. The last sequence has only literals.
+ *
+ * The compressor is greedy with a single probe hash table, so it is faster
+ * than LZF and compresses a bit less.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * See the COPYING file for the license (BSD). */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "lz4.h"
+
+#define LZ4_HASHLOG 12          /* max hash table size, 4096 entries */
+#define LZ4_MIN_HASHLOG 8       /* smaller tables are used for small inputs */
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5      /* the last 5 bytes are always literals */
+#define LZ4_MFLIMIT 12          /* no match can start in the last 12 bytes */
+#define LZ4_MAXOFFSET 65535
+#define LZ4_SKIPSTRENGTH 6      /* go faster on data that doesn't compress */
+
+static uint32_t lz4Read32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static unsigned int lz4Hash(uint32_t v, int hashlog) {
+    return (v * 2654435761U) >> (32-hashlog);
+}
+
+/* Write a length continuation (the part exceeding the 15 of the token) */
+static unsigned char *lz4WriteLen(unsigned char *op, unsigned char *oend,
+        unsigned int len)
+{
+    while(len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = len;
+    return op;
+}
+
+/* Write a sequence of 'litlen' literals starting at 'lit', followed by a
+ * match of 'mlen' bytes at 'offset', or by nothing if mlen is zero. */
+static unsigned char *lz4WriteSequence(unsigned char *op, unsigned char *oend,
+        const unsigned char *lit, unsigned int litlen,
+        unsigned int offset, unsigned int mlen)
+{
+    unsigned char *token;
+
+    if (op >= oend) return NULL;
+    token = op++;
+    *token = (litlen < 15 ? litlen : 15) << 4;
+    if (litlen >= 15 && (op = lz4WriteLen(op,oend,litlen-15)) == NULL)
+        return NULL;
+    if ((unsigned int)(oend-op) < litlen) return NULL;
+    memcpy(op,lit,litlen);
+    op += litlen;
+    if (mlen == 0) return op;
+
+    if (oend-op < 2) return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= LZ4_MINMATCH;
+    *token |= (mlen < 15 ? mlen : 15);
+    if (mlen >= 15 && (op = lz4WriteLen(op,oend,mlen-15)) == NULL)
+        return NULL;
+    return op;
+}
+
+unsigned int lz4_compress(const void *const in, unsigned int inlen,
+        void *out, unsigned int outlen)
+{
+    const unsigned char *ip = in, *istart = in, *anchor = in;
+    const unsigned char *iend = istart+inlen;
+    unsigned char *op = out, *oend = op+outlen;
+    uint32_t table[1<<LZ4_HASHLOG];
+    unsigned int searches = 1<<LZ4_SKIPSTRENGTH;
+    int hashlog = LZ4_MIN_HASHLOG;
+
+    if (inlen > LZ4_MFLIMIT) {
+        const unsigned char *mflimit = iend-LZ4_MFLIMIT;
+        const unsigned char *matchlimit = iend-LZ4_LASTLITERALS;
+
+        /* Don't clear a big table to compress a few bytes */
+        while(hashlog < LZ4_HASHLOG && (1U<<hashlog) < inlen) hashlog++;
+        memset(table,0,sizeof(uint32_t)<<hashlog);
+        ip++; /* the first byte can't be a match */
+        while(ip < mflimit) {
+            uint32_t seq = lz4Read32(ip);
+            unsigned int h = lz4Hash(seq,hashlog);
+            const unsigned char *ref = istart+table[h];
+            unsigned int mlen;
+
+            table[h] = ip-istart;
+            if (ref >= ip || ip-ref > LZ4_MAXOFFSET || lz4Read32(ref) != seq) {
+                /* Take bigger steps the longer we don't find a match */
+                ip += searches++ >> LZ4_SKIPSTRENGTH;
+                continue;
+            }
+            searches = 1<<LZ4_SKIPSTRENGTH;
+
+            /* Extend the match backward and forward */
+            while(ip > anchor && ref > istart && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            mlen = LZ4_MINMATCH;
+            while(ip+mlen < matchlimit && ip[mlen] == ref[mlen]) mlen++;
+
+            op = lz4WriteSequence(op,oend,anchor,ip-anchor,ip-ref,mlen);
+            if (op == NULL) return 0;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    /* Emit the remaining bytes as literals */
+    op = lz4WriteSequence(op,oend,anchor,iend-anchor,0,0);
+    if (op == NULL) return 0;
+    return op-(unsigned char*)out;
+}
+
+/* Read a length continuation. Returns 0 if the input ends first. */
+static int lz4ReadLen(const unsigned char **ip, const unsigned char *iend,
+        unsigned int *len)
+{
+    unsigned char b;
+
+    do {
+        if (*ip >= iend) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while(b == 255);
+    return 1;
+}
+
+unsigned int lz4_decompress(const void *const in, unsigned int inlen,
+        void *out, unsigned int outlen)
+{
+    const unsigned char *ip = in, *iend = ip+inlen;
+    unsigned char *op = out, *ostart = out, *oend = op+outlen;
+
+    while(ip < iend) {
+        unsigned int token = *ip++, litlen, mlen, offset;
+        const unsigned char *ref;
+
+        litlen = token >> 4;
+        if (litlen == 15 && !lz4ReadLen(&ip,iend,&litlen)) return 0;
+        if ((unsigned int)(iend-ip) < litlen ||
+            (unsigned int)(oend-op) < litlen) return 0;
+        memcpy(op,ip,litlen);
+        ip += litlen;
+        op += litlen;
+        if (ip == iend) break; /* the last sequence has no match */
+
+        if (iend-ip < 2) return 0;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (unsigned int)(op-ostart)) return 0;
+        mlen = token & 15;
+        if (mlen == 15 && !lz4ReadLen(&ip,iend,&mlen)) return 0;
+        mlen += LZ4_MINMATCH;
+        if ((unsigned int)(oend-op) < mlen) return 0;
+        ref = op-offset;
+        if (offset >= mlen) {
+            memcpy(op,ref,mlen);
+            op += mlen;
+        } else {
+            /* Overlapping match, e.g. a run of the same byte */
+            while(mlen--) *op++ = *ref++;
+        }
+    }
+    return op-ostart;
+}
@@ -0,0 +1,20 @@
+/* A small LZ4 block format compressor, used as a fast alternative to LZF
+ * to compress big values in the RDB file.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * See the COPYING file for the license (BSD). */
+
+#ifndef __LZ4_H
+#define __LZ4_H
+
+/* Same interface of lzf_compress() and lzf_decompress(): both return the
+ * number of bytes written to 'out', or 0 if the output buffer is too small
+ * (or the compressed data is corrupted). */
+unsigned int lz4_compress(const void *const in, unsigned int inlen,
+        void *out, unsigned int outlen);
+unsigned int lz4_decompress(const void *const in, unsigned int inlen,
+        void *out, unsigned int outlen);
+
+#endif
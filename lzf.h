@@ -77,6 +77,15 @@ unsigned int
 lzf_compress (const void *const in_data,  unsigned int in_len,
               void             *out_data, unsigned int out_len);
 
+/*
+ * Like lzf_compress, but faster and with a slightly worse compression
+ * ratio: it uses a smaller hash table and does not hash the bytes inside
+ * the matches. The output is decompressed with lzf_decompress as well.
+ */
+unsigned int
+lzf_compress_fast (const void *const in_data,  unsigned int in_len,
+                   void             *out_data, unsigned int out_len);
+
 /*
  * Decompress data compressed with some version of the lzf_compress
  * function and stored at location in_data and length in_len. The result
@@ -36,8 +36,21 @@
 
 #include "lzfP.h"
 
+#include <string.h>
+
 #define HSIZE (1 << (HLOG))
 
+/*
+ * small inputs use only the first 1 << hlog entries of the hash table, so
+ * that compressing a few bytes doesn't require to clear the whole table.
+ * the output format does not depend on the hash table size.
+ */
+#define MIN_HLOG 8
+
+/* the hash table size used by fast mode, that also skips the hashing of
+ * the bytes inside a match, like ULTRA_FAST does */
+#define FAST_HLOG 13
+
 /*
  * don't play with this unless you benchmark!
  * decompression is not dependent on the hash function
@@ -48,11 +61,11 @@
 # define FRST(p) (((p[0]) << 8) | p[1])
 # define NEXT(v,p) (((v) << 8) | p[2])
 # if ULTRA_FAST
-#  define IDX(h) ((( h             >> (3*8 - HLOG)) - h  ) & (HSIZE - 1))
+#  define IDX(h) ((( h             >> (3*8 - hlog)) - h  ) & (hsize - 1))
 # elif VERY_FAST
-#  define IDX(h) ((( h             >> (3*8 - HLOG)) - h*5) & (HSIZE - 1))
+#  define IDX(h) ((( h             >> (3*8 - hlog)) - h*5) & (hsize - 1))
 # else
-#  define IDX(h) ((((h ^ (h << 5)) >> (3*8 - HLOG)) - h*5) & (HSIZE - 1))
+#  define IDX(h) ((((h ^ (h << 5)) >> (3*8 - hlog)) - h*5) & (hsize - 1))
 # endif
 #endif
 /*
@@ -86,6 +99,19 @@
 #define expect_false(expr) expect ((expr) != 0, 0)
 #define expect_true(expr)  expect ((expr) != 0, 1)
 
+#if !STRICT_ALIGN
+/* unaligned 64 bit load, memcpy compiles to a single instruction */
+static unsigned long long
+load64 (const u8 *p)
+{
+  unsigned long long v;
+
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+# define LOAD64(p) load64 (p)
+#endif
+
 /*
  * compressed format
  *
@@ -95,17 +121,11 @@
  *
  */
 
-unsigned int
-lzf_compress (const void *const in_data, unsigned int in_len,
-	      void *out_data, unsigned int out_len
-#if LZF_STATE_ARG
-              , LZF_STATE htab
-#endif
-              )
+static unsigned int
+lzf_compress_internal (const void *const in_data, unsigned int in_len,
+                       void *out_data, unsigned int out_len,
+                       const u8 **htab, int fast)
 {
-#if !LZF_STATE_ARG
-  LZF_STATE htab;
-#endif
   const u8 **hslot;
   const u8 *ip = (const u8 *)in_data;
         u8 *op = (u8 *)out_data;
@@ -127,12 +147,18 @@ lzf_compress (const void *const in_data, unsigned int in_len,
 #endif
   unsigned int hval;
   int lit;
+  unsigned int hlog = MIN_HLOG, hsize;
+  unsigned int maxhlog = fast ? FAST_HLOG : HLOG;
 
   if (!in_len || !out_len)
     return 0;
 
+  while (hlog < maxhlog && (1U << hlog) < in_len)
+    hlog++;
+  hsize = 1 << hlog;
+
 #if INIT_HTAB
-  memset (htab, 0, sizeof (htab));
+  memset (htab, 0, hsize * sizeof (htab[0]));
 # if 0
   for (hslot = htab; hslot < htab + HSIZE; hslot++)
     *hslot++ = ip;
@@ -166,47 +192,29 @@ lzf_compress (const void *const in_data, unsigned int in_len,
         )
         {
           /* match found at *ref++ */
-          unsigned int len = 2;
-          unsigned int maxlen = in_end - ip - len;
+          unsigned int len = 3;
+          unsigned int maxlen = in_end - ip - 2;
           maxlen = maxlen > MAX_REF ? MAX_REF : maxlen;
 
+          /* the original unrolled loop always compared at least 19 bytes
+           * when maxlen > 16: keep the same limit, so that the output is
+           * the same */
+          if (maxlen == 17 || maxlen == 18)
+            maxlen = 19;
+
           op [- lit - 1] = lit - 1; /* stop run */
           op -= !lit; /* undo run if length is zero */
 
           if (expect_false (op + 3 + 1 >= out_end))
             return 0;
 
-          for (;;)
-            {
-              if (expect_true (maxlen > 16))
-                {
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                  len++; if (ref [len] != ip [len]) break;
-                }
-
-              do
-                len++;
-              while (len < maxlen && ref[len] == ip[len]);
-
-              break;
-            }
+#if !STRICT_ALIGN
+          /* compare eight bytes at a time, then find the mismatch */
+          while (len + 8 <= maxlen && LOAD64 (ref + len) == LOAD64 (ip + len))
+            len += 8;
+#endif
+          while (len < maxlen && ref[len] == ip[len])
+            len++;
 
           len -= 2; /* len is now #octets - 1 */
           ip++;
@@ -232,7 +240,8 @@ lzf_compress (const void *const in_data, unsigned int in_len,
 #if ULTRA_FAST || VERY_FAST
           --ip;
 # if VERY_FAST && !ULTRA_FAST
-          --ip;
+          if (!fast)
+            --ip;
 # endif
           hval = FRST (ip);
 
@@ -241,9 +250,12 @@ lzf_compress (const void *const in_data, unsigned int in_len,
           ip++;
 
 # if VERY_FAST && !ULTRA_FAST
-          hval = NEXT (hval, ip);
-          htab[IDX (hval)] = ip;
-          ip++;
+          if (!fast)
+            {
+              hval = NEXT (hval, ip);
+              htab[IDX (hval)] = ip;
+              ip++;
+            }
 # endif
 #else
           ip -= len + 1;
@@ -293,3 +305,26 @@ lzf_compress (const void *const in_data, unsigned int in_len,
   return op - (u8 *)out_data;
 }
 
+unsigned int
+lzf_compress (const void *const in_data, unsigned int in_len,
+	      void *out_data, unsigned int out_len
+#if LZF_STATE_ARG
+              , LZF_STATE htab
+#endif
+              )
+{
+#if !LZF_STATE_ARG
+  LZF_STATE htab;
+#endif
+
+  return lzf_compress_internal (in_data, in_len, out_data, out_len, htab, 0);
+}
+
+unsigned int
+lzf_compress_fast (const void *const in_data, unsigned int in_len,
+                   void *out_data, unsigned int out_len)
+{
+  const u8 *htab[1 << FAST_HLOG];
+
+  return lzf_compress_internal (in_data, in_len, out_data, out_len, htab, 1);
+}
@@ -36,6 +36,15 @@
 
 #include "lzfP.h"
 
+#include <string.h>
+
+#if !STRICT_ALIGN
+/* Copy 8 bytes at a time: memcpy of a constant size compiles to a single
+ * unaligned load and store. The caller makes sure there are at least 8
+ * bytes of slack after the copy, since up to 7 extra bytes are written. */
+# define COPY8(d,s) memcpy ((d), (s), 8)
+#endif
+
 #if AVOID_ERRNO
 # define SET_ERRNO(n)
 #else
@@ -86,9 +95,28 @@ lzf_decompress (const void *const in_data,  unsigned int in_len,
 #ifdef lzf_movsb
           lzf_movsb (op, ip, ctrl);
 #else
-          do
-            *op++ = *ip++;
-          while (--ctrl);
+#if !STRICT_ALIGN
+          if (op + ctrl + 8 <= out_end && ip + ctrl + 8 <= in_end)
+            {
+              /* input and output never overlap */
+              u8 *end = op + ctrl;
+
+              do
+                {
+                  COPY8 (op, ip);
+                  op += 8;
+                  ip += 8;
+                }
+              while (op < end);
+
+              ip -= op - end;
+              op = end;
+            }
+          else
+#endif
+            do
+              *op++ = *ip++;
+            while (--ctrl);
 #endif
         }
       else /* back reference */
@@ -134,12 +162,29 @@ lzf_decompress (const void *const in_data,  unsigned int in_len,
           len += 2;
           lzf_movsb (op, ref, len);
 #else
-          *op++ = *ref++;
-          *op++ = *ref++;
+          len += 2;
+#if !STRICT_ALIGN
+          if (op - ref >= 8 && op + len + 8 <= out_end)
+            {
+              /* every 8 bytes chunk is read before it is overwritten
+               * as long as the reference is at least 8 bytes back */
+              u8 *end = op + len;
+
+              do
+                {
+                  COPY8 (op, ref);
+                  op += 8;
+                  ref += 8;
+                }
+              while (op < end);
 
-          do
-            *op++ = *ref++;
-          while (--len);
+              op = end;
+            }
+          else
+#endif
+            do
+              *op++ = *ref++;
+            while (--len);
 #endif
         }
     }
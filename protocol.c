@@ -0,0 +1,111 @@
+/* Parsing of the Redis protocol shared by the server and the tools.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "protocol.h"
+#include "sds.h"
+#include "zmalloc.h"
+
+size_t protocolReadInlineQuery(sds *querybuf, sds **argv, int *argc) {
+    char *p = strchr(*querybuf,'\n');
+    size_t querylen;
+    sds query;
+    int count, j;
+
+    if (p == NULL) return 0;
+    query = *querybuf;
+    querylen = 1+(p-query);
+    *querybuf = sdsempty();
+    if (sdslen(query) > querylen) {
+        /* leave data after the first line of the query in the buffer */
+        *querybuf = sdscatlen(*querybuf,query+querylen,sdslen(query)-querylen);
+    }
+    *p = '\0'; /* remove "\n" */
+    if (p != query && *(p-1) == '\r') *(p-1) = '\0'; /* and "\r" if any */
+    sdsupdatelen(query);
+
+    /* Now we can split the query in arguments */
+    *argv = NULL;
+    *argc = 0;
+    if (sdslen(query)) {
+        sds *v = sdssplitlen(query,sdslen(query)," ",1,&count);
+
+        if (v == NULL) {
+            *argc = -1;
+        } else {
+            for (j = 0; j < count; j++) {
+                if (sdslen(v[j]))
+                    v[(*argc)++] = v[j];
+                else
+                    sdsfree(v[j]);
+            }
+            if (*argc) *argv = v; else zfree(v);
+        }
+    }
+    sdsfree(query);
+    return querylen;
+}
+
+sds protocolReadBulk(sds *querybuf, int bulklen) {
+    sds arg;
+
+    if ((signed)sdslen(*querybuf) < bulklen) return NULL;
+    /* Copy everything but the final CRLF */
+    arg = sdsnewlen(*querybuf,bulklen-2);
+    *querybuf = sdsrange(*querybuf,bulklen,-1);
+    return arg;
+}
+
+long protocolReplyLength(char *p, size_t len) {
+    char *nl = memchr(p,'\n',len);
+    long hdr, n, j, total;
+
+    if (nl == NULL) return 0;
+    hdr = nl-p+1;
+    switch(p[0]) {
+    case '$':
+        n = strtol(p+1,NULL,10);
+        if (n < 0) return hdr;
+        return (len >= (size_t)(hdr+n+2)) ? hdr+n+2 : 0;
+    case '*':
+        n = strtol(p+1,NULL,10);
+        for (j = 0, total = hdr; j < n; j++) {
+            long l = protocolReplyLength(p+total,len-total);
+
+            if (l == 0) return 0;
+            total += l;
+        }
+        return total;
+    default:
+        return hdr;
+    }
+}
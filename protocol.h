@@ -0,0 +1,36 @@
+/* Parsing of the Redis protocol shared by the server and the tools.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * See the COPYING file for the license (BSD). */
+
+#ifndef __PROTOCOL_H
+#define __PROTOCOL_H
+
+#include <stddef.h>
+
+#include "sds.h"
+
+/* Requests are made of an inline line of arguments separated by spaces,
+ * for REDIS_CMD_BULK commands followed by a bulk whose length is the last
+ * argument of the line. */
+
+/* Remove the first line from *querybuf, the rest of the buffer is moved in
+ * a new sds. Returns the bytes of the line, CRLF included, or 0 if it was
+ * not yet fully received. The arguments of the line, empty ones skipped,
+ * are returned in *argv (to free with sdsfree() and zfree()) and *argc,
+ * that is 0 for an empty line and -1 if out of memory. */
+size_t protocolReadInlineQuery(sds *querybuf, sds **argv, int *argc);
+
+/* Remove a bulk of 'bulklen' bytes, the final CRLF included, from the
+ * start of *querybuf and return it without the CRLF. NULL if it was not
+ * yet fully received. */
+sds protocolReadBulk(sds *querybuf, int bulklen);
+
+/* Length of the reply at the start of 'p', status, error, integer, bulk or
+ * multi bulk, 0 if it was not yet fully received. Used by the clients that
+ * pipeline requests to split the replies without decoding them. */
+long protocolReplyLength(char *p, size_t len);
+
+#endif
@@ -34,11 +34,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/select.h>
 
 #include "anet.h"
 #include "sds.h"
 #include "adlist.h"
 #include "zmalloc.h"
+#include "protocol.h"
 
 #define REDIS_CMD_INLINE 1
 #define REDIS_CMD_BULK 2
@@ -48,6 +53,10 @@
 static struct config {
     char *hostip;
     int hostport;
+    int bigkeys;
+    char *capture;          /* --capture output file */
+    int captureseconds;
+    int pipe;
 } config;
 
 struct redisCommand {
@@ -61,6 +70,7 @@ static struct redisCommand cmdTable[] = {
     {"set",3,REDIS_CMD_BULK},
     {"setnx",3,REDIS_CMD_BULK},
     {"del",-2,REDIS_CMD_INLINE},
+    {"unlink",-2,REDIS_CMD_INLINE},
     {"exists",2,REDIS_CMD_INLINE},
     {"incr",2,REDIS_CMD_INLINE},
     {"decr",2,REDIS_CMD_INLINE},
@@ -96,6 +106,8 @@ static struct redisCommand cmdTable[] = {
     {"rename",3,REDIS_CMD_INLINE},
     {"renamenx",3,REDIS_CMD_INLINE},
     {"keys",2,REDIS_CMD_INLINE},
+    {"scan",-2,REDIS_CMD_INLINE},
+    {"sscan",-3,REDIS_CMD_INLINE},
     {"dbsize",1,REDIS_CMD_INLINE},
     {"ping",1,REDIS_CMD_INLINE},
     {"echo",2,REDIS_CMD_BULK},
@@ -104,10 +116,14 @@ static struct redisCommand cmdTable[] = {
     {"shutdown",1,REDIS_CMD_INLINE},
     {"lastsave",1,REDIS_CMD_INLINE},
     {"type",2,REDIS_CMD_INLINE},
-    {"flushdb",1,REDIS_CMD_INLINE},
-    {"flushall",1,REDIS_CMD_INLINE},
+    {"flushdb",-1,REDIS_CMD_INLINE},
+    {"flushall",-1,REDIS_CMD_INLINE},
     {"sort",-2,REDIS_CMD_INLINE},
-    {"info",1,REDIS_CMD_INLINE},
+    {"info",-1,REDIS_CMD_INLINE},
+    {"config",-2,REDIS_CMD_INLINE},
+    {"slowlog",-2,REDIS_CMD_INLINE},
+    {"latency",-2,REDIS_CMD_INLINE},
+    {"memory",-3,REDIS_CMD_INLINE},
     {"mget",-2,REDIS_CMD_INLINE},
     {"expire",3,REDIS_CMD_INLINE},
     {"ttl",2,REDIS_CMD_INLINE},
@@ -295,6 +311,16 @@ static int parseOptions(int argc, char **argv) {
         } else if (!strcmp(argv[i],"-p") && !lastarg) {
             config.hostport = atoi(argv[i+1]);
             i++;
+        } else if (!strcmp(argv[i],"--bigkeys")) {
+            config.bigkeys = 1;
+        } else if (!strcmp(argv[i],"--capture") && !lastarg) {
+            config.capture = argv[i+1];
+            i++;
+        } else if (!strcmp(argv[i],"--pipe")) {
+            config.pipe = 1;
+        } else if (!strcmp(argv[i],"--capture-seconds") && !lastarg) {
+            config.captureseconds = atoi(argv[i+1]);
+            i++;
         } else {
             break;
         }
@@ -302,6 +328,378 @@ static int parseOptions(int argc, char **argv) {
     return i;
 }
 
+/*------------------------------------------------------------------------------
+ * Big keys: scan the keyspace and report the biggest key of every type
+ *----------------------------------------------------------------------------*/
+
+#define BIGKEYS_SCAN_COUNT 100
+
+/* Read a reply without printing it. Returns the line of status, error,
+ * integer and multi bulk (the count) replies or the bulk payload, NULL for
+ * a nil bulk. The reply type byte is stored in *type. */
+static sds cliReadRawReply(int fd, char *type) {
+    sds line;
+    char crlf[2];
+    int bulklen;
+
+    if (anetRead(fd,type,1) <= 0) exit(1);
+    if ((line = cliReadLine(fd)) == NULL) exit(1);
+    if (*type != '$') return line;
+    bulklen = atoi(line);
+    sdsfree(line);
+    if (bulklen == -1) return NULL;
+    line = sdsnewlen(NULL,bulklen);
+    if (anetRead(fd,line,bulklen) != bulklen || anetRead(fd,crlf,2) != 2)
+        exit(1);
+    return line;
+}
+
+static void cliExpectReply(char type, char expected, sds reply) {
+    if (type == expected) return;
+    fprintf(stderr,"Unexpected reply: %s\n", reply ? reply : "(nil)");
+    exit(1);
+}
+
+struct bigkeysType {
+    char *name;
+    char *sizecmd;          /* command returning the elements, if any */
+    long long keys, elements, bytes;
+    sds biggest;            /* by elements, by bytes for strings */
+    long long biggest_elements, biggest_bytes;
+};
+
+/* Key names are sent with the inline protocol: skip the ones it can't carry */
+static int bigkeysValidKey(sds key) {
+    size_t j;
+
+    if (sdslen(key) == 0) return 0;
+    for (j = 0; j < sdslen(key); j++)
+        if ((unsigned char)key[j] <= ' ') return 0;
+    return 1;
+}
+
+static int bigkeysMode(void) {
+    struct bigkeysType types[] = {
+        {"string",NULL,0,0,0,NULL,0,0},
+        {"list","LLEN",0,0,0,NULL,0,0},
+        {"set","SCARD",0,0,0,NULL,0,0}
+    };
+    int ntypes = sizeof(types)/sizeof(types[0]);
+    long long sampled = 0, skipped = 0;
+    sds cursor = sdsnew("0");
+    int fd, j, t;
+
+    if ((fd = cliConnect()) == -1) return 1;
+    printf("# Scanning the entire keyspace to find the biggest keys of every type\n\n");
+    do {
+        sds cmd = sdscatprintf(sdsempty(),"SCAN %s COUNT %d\r\n",
+            cursor,BIGKEYS_SCAN_COUNT);
+        sds reply, *keys;
+        struct bigkeysType **kt;
+        int nkeys, n = 0;
+        char type;
+
+        /* Fetch the next batch of keys */
+        anetWrite(fd,cmd,sdslen(cmd));
+        sdsfree(cmd);
+        reply = cliReadRawReply(fd,&type);
+        cliExpectReply(type,'*',reply);
+        sdsfree(reply);
+        sdsfree(cursor);
+        cursor = cliReadRawReply(fd,&type);
+        cliExpectReply(type,'$',cursor);
+        reply = cliReadRawReply(fd,&type);
+        cliExpectReply(type,'*',reply);
+        nkeys = atoi(reply);
+        sdsfree(reply);
+        keys = zmalloc(sizeof(sds)*(nkeys+1));
+        kt = zmalloc(sizeof(struct bigkeysType*)*(nkeys+1));
+        for (j = 0; j < nkeys; j++) {
+            sds key = cliReadRawReply(fd,&type);
+
+            cliExpectReply(type,'$',key);
+            if (bigkeysValidKey(key)) {
+                keys[n++] = key;
+            } else {
+                skipped++;
+                sdsfree(key);
+            }
+        }
+
+        /* Pipeline the TYPE of all the keys, then their sizes */
+        cmd = sdsempty();
+        for (j = 0; j < n; j++)
+            cmd = sdscatprintf(cmd,"TYPE %s\r\n",keys[j]);
+        anetWrite(fd,cmd,sdslen(cmd));
+        sdsfree(cmd);
+        for (j = 0; j < n; j++) {
+            reply = cliReadRawReply(fd,&type);
+            kt[j] = NULL;
+            for (t = 0; t < ntypes; t++)
+                if (!strcmp(reply,types[t].name)) kt[j] = types+t;
+            sdsfree(reply);
+        }
+        cmd = sdsempty();
+        for (j = 0; j < n; j++) {
+            if (!kt[j]) continue;
+            cmd = sdscatprintf(cmd,"MEMORY USAGE %s\r\n",keys[j]);
+            if (kt[j]->sizecmd)
+                cmd = sdscatprintf(cmd,"%s %s\r\n",kt[j]->sizecmd,keys[j]);
+        }
+        anetWrite(fd,cmd,sdslen(cmd));
+        sdsfree(cmd);
+        for (j = 0; j < n; j++) {
+            long long bytes = 0, elements = 1;
+
+            if (!kt[j]) {
+                sdsfree(keys[j]);
+                continue;
+            }
+            /* The key may be deleted meanwhile: MEMORY USAGE returns nil */
+            reply = cliReadRawReply(fd,&type);
+            if (reply) bytes = strtoll(reply,NULL,10);
+            sdsfree(reply);
+            if (kt[j]->sizecmd) {
+                reply = cliReadRawReply(fd,&type);
+                elements = strtoll(reply,NULL,10);
+                sdsfree(reply);
+            }
+            sampled++;
+            kt[j]->keys++;
+            kt[j]->elements += elements;
+            kt[j]->bytes += bytes;
+            if (kt[j]->biggest == NULL ||
+                (kt[j]->sizecmd && elements > kt[j]->biggest_elements) ||
+                (!kt[j]->sizecmd && bytes > kt[j]->biggest_bytes))
+            {
+                sdsfree(kt[j]->biggest);
+                kt[j]->biggest = keys[j];
+                kt[j]->biggest_elements = elements;
+                kt[j]->biggest_bytes = bytes;
+            } else {
+                sdsfree(keys[j]);
+            }
+        }
+        zfree(keys);
+        zfree(kt);
+    } while(strcmp(cursor,"0"));
+    sdsfree(cursor);
+    close(fd);
+
+    printf("Sampled %lld keys", sampled);
+    if (skipped) printf(", %lld skipped (names not valid as inline arguments)", skipped);
+    printf("\n\n");
+    for (t = 0; t < ntypes; t++) {
+        struct bigkeysType *bt = types+t;
+
+        if (bt->biggest == NULL) continue;
+        if (bt->sizecmd)
+            printf("Biggest %6s found '%s' has %lld elements (%lld bytes)\n",
+                bt->name, bt->biggest, bt->biggest_elements, bt->biggest_bytes);
+        else
+            printf("Biggest %6s found '%s' has %lld bytes\n",
+                bt->name, bt->biggest, bt->biggest_bytes);
+    }
+    printf("\n");
+    for (t = 0; t < ntypes; t++) {
+        struct bigkeysType *bt = types+t;
+
+        printf("%lld %ss with %lld elements and %lld bytes (%.2f%% of keys, avg size %.2f bytes)\n",
+            bt->keys, bt->name, bt->elements, bt->bytes,
+            sampled ? (double)bt->keys*100/sampled : 0,
+            bt->keys ? (double)bt->bytes/bt->keys : 0);
+        sdsfree(bt->biggest);
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Capture: save the MONITOR CAPTURE stream, to be replayed by redis-benchmark
+ *----------------------------------------------------------------------------*/
+
+#define CAPTURE_HEADER "REDISCAP"
+#define CAPTURE_VERSION 1
+
+static volatile sig_atomic_t capture_stop = 0;
+
+static void captureSignalHandler(int sig) {
+    REDIS_NOTUSED(sig);
+    capture_stop = 1;
+}
+
+/* The file is the header and the version byte followed by the records as
+ * sent by the server, see captureFeedMonitors() in redis.c. The capture
+ * ends on SIGINT/SIGTERM, after --capture-seconds or when the server closes
+ * the connection. */
+static int captureMode(void) {
+    char buf[16*1024], type;
+    time_t deadline = 0;
+    long long bytes = 0;
+    FILE *fp;
+    sds reply;
+    int fd;
+
+    if ((fp = fopen(config.capture,"wb")) == NULL) {
+        fprintf(stderr,"Opening %s: %s\n", config.capture, strerror(errno));
+        return 1;
+    }
+    if (fwrite(CAPTURE_HEADER,strlen(CAPTURE_HEADER),1,fp) != 1 ||
+        fputc(CAPTURE_VERSION,fp) == EOF) goto werr;
+    if ((fd = cliConnect()) == -1) {
+        fclose(fp);
+        return 1;
+    }
+    anetWrite(fd,"MONITOR CAPTURE\r\n",17);
+    reply = cliReadRawReply(fd,&type);
+    cliExpectReply(type,'+',reply);
+    sdsfree(reply);
+
+    signal(SIGINT,captureSignalHandler);
+    signal(SIGTERM,captureSignalHandler);
+    if (config.captureseconds > 0) deadline = time(NULL)+config.captureseconds;
+    fprintf(stderr,"Capturing to %s, press Ctrl-C to stop\n", config.capture);
+    while(!capture_stop && (!deadline || time(NULL) < deadline)) {
+        struct timeval tv = {0, 100000};
+        fd_set rfds;
+        ssize_t nread;
+
+        FD_ZERO(&rfds);
+        FD_SET(fd,&rfds);
+        if (select(fd+1,&rfds,NULL,NULL,&tv) <= 0) continue;
+        nread = read(fd,buf,sizeof(buf));
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread <= 0) break;
+        if (fwrite(buf,nread,1,fp) != 1) goto werr;
+        bytes += nread;
+    }
+    close(fd);
+    if (fclose(fp) == EOF) {
+        fp = NULL;
+        goto werr;
+    }
+    fprintf(stderr,"%lld bytes captured\n", bytes);
+    return 0;
+
+werr:
+    fprintf(stderr,"Writing %s: %s\n", config.capture, strerror(errno));
+    if (fp) fclose(fp);
+    return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * Pipe: send the protocol read from standard input as fast as possible
+ *----------------------------------------------------------------------------*/
+
+#define PIPE_MARKER_LEN 20
+#define PIPE_SHOWN_ERRORS 10    /* errors printed, the others only counted */
+
+/* Write the commands read from standard input and read the replies at the
+ * same time, so neither the server nor redis-cli ever waits for the other
+ * one. Once the input is over an ECHO of a random marker is sent: its reply
+ * is the last one. */
+static int pipeMode(void) {
+    char buf[16*1024], marker[PIPE_MARKER_LEN+1];
+    sds obuf = sdsempty(), ibuf = sdsempty();
+    long long replies = 0, errors = 0;
+    size_t written = 0;
+    int fd, eof = 0, done = 0, j;
+
+    if ((fd = cliConnect()) == -1) return 1;
+    anetNonBlock(NULL,fd);
+    /* A server closing the connection must be reported, not kill us */
+    signal(SIGPIPE,SIG_IGN);
+    srandom(time(NULL)^getpid());
+    for (j = 0; j < PIPE_MARKER_LEN; j++)
+        marker[j] = "0123456789abcdef"[random() % 16];
+    marker[PIPE_MARKER_LEN] = '\0';
+
+    while(!done) {
+        fd_set rfds, wfds;
+        int maxfd = fd;
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(fd,&rfds);
+        if (written < sdslen(obuf)) {
+            FD_SET(fd,&wfds);
+        } else if (!eof) {
+            FD_SET(fileno(stdin),&rfds);
+            if (fileno(stdin) > maxfd) maxfd = fileno(stdin);
+        }
+        if (select(maxfd+1,&rfds,&wfds,NULL,NULL) == -1) {
+            if (errno == EINTR) continue;
+            perror("select");
+            return 1;
+        }
+
+        /* Input: refill the output buffer once it was all written */
+        if (!eof && written == sdslen(obuf) && FD_ISSET(fileno(stdin),&rfds)) {
+            ssize_t nread = read(fileno(stdin),buf,sizeof(buf));
+
+            sdsfree(obuf);
+            written = 0;
+            if (nread > 0) {
+                obuf = sdsnewlen(buf,nread);
+            } else if (nread == 0) {
+                obuf = sdscatprintf(sdsempty(),"ECHO %d\r\n%s\r\n",
+                    PIPE_MARKER_LEN,marker);
+                eof = 1;
+                fprintf(stderr,"All data transferred. Waiting for the last reply...\n");
+            } else {
+                perror("Reading from standard input");
+                return 1;
+            }
+        }
+
+        if (FD_ISSET(fd,&wfds)) {
+            ssize_t nwritten = write(fd,obuf+written,sdslen(obuf)-written);
+
+            if (nwritten == -1 && errno == EPIPE) {
+                fprintf(stderr,"Connection lost writing to the server\n");
+                return 1;
+            } else if (nwritten == -1 && errno != EAGAIN) {
+                fprintf(stderr,"Writing to the server: %s\n",strerror(errno));
+                return 1;
+            }
+            if (nwritten > 0) written += nwritten;
+        }
+
+        if (FD_ISSET(fd,&rfds)) {
+            ssize_t nread = read(fd,buf,sizeof(buf));
+            size_t pos = 0;
+            long len;
+
+            if (nread == 0 || (nread == -1 && errno != EAGAIN)) {
+                fprintf(stderr,"Connection lost reading from the server\n");
+                return 1;
+            }
+            if (nread > 0) ibuf = sdscatlen(ibuf,buf,nread);
+            while((len = protocolReplyLength(ibuf+pos,sdslen(ibuf)-pos)) != 0) {
+                char *reply = ibuf+pos;
+
+                pos += len;
+                if (eof && pos == sdslen(ibuf) && reply[0] == '$' &&
+                    len >= PIPE_MARKER_LEN+2 &&
+                    !memcmp(reply+len-PIPE_MARKER_LEN-2,marker,PIPE_MARKER_LEN))
+                {
+                    done = 1;
+                    break;
+                }
+                if (reply[0] == '-' && errors++ < PIPE_SHOWN_ERRORS)
+                    fprintf(stderr,"%.*s",(int)len,reply);
+                replies++;
+            }
+            ibuf = sdsrange(ibuf,pos,-1);
+        }
+    }
+    fprintf(stderr,"Last reply received from server.\n");
+    printf("errors: %lld, replies: %lld\n", errors, replies);
+    close(fd);
+    sdsfree(obuf);
+    sdsfree(ibuf);
+    return errors ? 1 : 0;
+}
+
 static sds readArgFromStdin(void) {
     char buf[1024];
     sds arg = sdsempty();
@@ -326,10 +724,18 @@ int main(int argc, char **argv) {
 
     config.hostip = "127.0.0.1";
     config.hostport = 6379;
+    config.bigkeys = 0;
+    config.capture = NULL;
+    config.captureseconds = 0;
+    config.pipe = 0;
 
     firstarg = parseOptions(argc,argv);
     argc -= firstarg;
     argv += firstarg;
+
+    if (config.bigkeys) return bigkeysMode();
+    if (config.capture) return captureMode();
+    if (config.pipe) return pipeMode();
     
     /* Turn the plain C strings into Sds strings */
     argvcopy = zmalloc(sizeof(char*)*argc+1);
@@ -339,6 +745,9 @@ int main(int argc, char **argv) {
     if (argc < 1) {
         fprintf(stderr, "usage: redis-cli [-h host] [-p port] cmd arg1 arg2 arg3 ... argN\n");
         fprintf(stderr, "usage: echo \"argN\" | redis-cli [-h host] [-p port] cmd arg1 arg2 ... arg(N-1)\n");
+        fprintf(stderr, "usage: redis-cli [-h host] [-p port] --bigkeys\n");
+        fprintf(stderr, "usage: redis-cli [-h host] [-p port] --capture file [--capture-seconds n]\n");
+        fprintf(stderr, "usage: cat commands.txt | redis-cli [-h host] [-p port] --pipe\n");
         fprintf(stderr, "\nIf a pipe from standard input is detected this data is used as last argument.\n\n");
         fprintf(stderr, "example: cat /etc/passwd | redis-cli set my_passwd\n");
         fprintf(stderr, "example: redis-cli get my_passwd\n");
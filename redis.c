@@ -57,6 +57,7 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "redis.h"
 #include "ae.h"     /* Event driven programming library */
@@ -66,7 +67,12 @@
 #include "adlist.h" /* Linked lists */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "lzf.h"    /* LZF compression library */
+#include "lz4.h"    /* LZ4 block format compression */
 #include "pqsort.h" /* Partial qsort for SORT+LIMIT */
+#include "stringmatch.h" /* Glob-style pattern matching */
+#include "protocol.h" /* query parsing shared with core-benchmark */
+#include "crc64.h"  /* RDB file checksum */
+#include "bio.h"    /* Background jobs */
 
 /* Error codes */
 #define REDIS_OK                0
@@ -85,6 +91,36 @@
 #define REDIS_EXPIRELOOKUPS_PER_CRON    100 /* try to expire 100 keys/second */
 #define REDIS_MAX_WRITE_PER_EVENT (1024*64)
 #define REDIS_REQUEST_MAX_SIZE  (1024*1024*256) /* max bytes in inline command */
+#define REDIS_REPLID_LEN        40      /* hex chars of a replication ID */
+#define REDIS_REPL_BACKLOG_SIZE (1024*1024) /* default replication backlog */
+#define REDIS_REPL_TRANSFER_BUFLEN (1024*64) /* read size of the sync payload */
+#define REDIS_REPL_WAIT_TIMEOUT 3600    /* max wait for the master BGSAVE */
+#define REDIS_LOADING_PROCESS_EVENTS_KEYS 1024 /* serve clients every N keys */
+#define REDIS_RDB_READBUF_LEN   (1024*1024) /* read size loading the DB */
+#define REDIS_LOADING_REPORT_PERIOD 5   /* log loading progress every N secs */
+#define REDIS_RDB_WRITEBUF_LEN  (1024*1024) /* write buffer saving the DB */
+#define REDIS_RDB_JOB_KEYS      1024    /* keys serialized by a save job */
+#define REDIS_RDB_MAX_THREADS   64      /* max value of rdb-save-threads */
+#define REDIS_COW_COPY_MAXLEN   4096    /* see addReplyDbObject() */
+#define REDIS_LAZYFREE_THRESHOLD 64     /* min elements to free in background */
+#define REDIS_CMDSTAT_BUCKETS   24      /* latency histogram, see below */
+#define REDIS_SLOWLOG_LOG_SLOWER_THAN 10000 /* default slow log threshold (usec) */
+#define REDIS_SLOWLOG_MAX_LEN   128     /* default slow log length */
+#define REDIS_SLOWLOG_MAX_ARGC  32      /* arguments stored in a slow log entry */
+#define REDIS_SLOWLOG_MAX_STRING 128    /* bytes stored for every argument */
+
+/* Latency monitor events, see latencyAddSampleIfNeeded() */
+#define REDIS_LATENCY_COMMAND   0       /* execution of a command */
+#define REDIS_LATENCY_EVENT_LOOP 1      /* a whole event loop iteration */
+#define REDIS_LATENCY_EXPIRE_CYCLE 2    /* serverCron() expired keys sampling */
+#define REDIS_LATENCY_HASH_RESIZE 3     /* tryResizeHashTables() */
+#define REDIS_LATENCY_REHASH    4       /* a table grown by dictExpand() */
+#define REDIS_LATENCY_CLIENTS_TIMEOUT 5 /* closeTimedoutClients() */
+#define REDIS_LATENCY_FORK      6       /* fork() of a BGSAVE */
+#define REDIS_LATENCY_FREE_OBJECT 7     /* release of a list or set value */
+#define REDIS_LATENCY_EVENTS    8
+#define REDIS_LATENCY_TS_LEN    160     /* samples kept for every event */
+#define REDIS_MEMORY_USAGE_SAMPLES 5    /* default of MEMORY USAGE SAMPLES */
 
 /* Hash table parameters */
 #define REDIS_HT_MINFILL        10      /* Minimal hash table fill 10% */
@@ -97,18 +133,30 @@
    config file and the server is using more than maxmemory bytes of memory.
    In short this commands are denied on low memory conditions. */
 #define REDIS_CMD_DENYOOM       4
+#define REDIS_CMD_LOADING       8       /* Allowed while loading the DB */
+#define REDIS_CMD_READONLY      16      /* Only reads the dataset, allowed
+                                           while loading with the option
+                                           loading-serve-reads */
 
 /* Object types */
 #define REDIS_STRING 0
 #define REDIS_LIST 1
 #define REDIS_SET 2
 #define REDIS_HASH 3
+#define REDIS_NUM_TYPES 4
 
 /* Object types only used for dumping to disk */
+#define REDIS_RESIZEDB 252      /* number of keys and expires of the DB */
 #define REDIS_EXPIRETIME 253
 #define REDIS_SELECTDB 254
 #define REDIS_EOF 255
 
+/* Version of the RDB file written. Starting from version 3 the EOF opcode
+ * is followed by the 8 bytes CRC64 of all the file, in little endian. A zero
+ * checksum means it was not computed when saving. */
+#define REDIS_RDB_VERSION 3
+#define REDIS_RDB_CRC_LEN 8
+
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
  * the first byte to interpreter the length:
@@ -135,17 +183,37 @@
 #define REDIS_RDB_ENC_INT16 1       /* 16 bit signed integer */
 #define REDIS_RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define REDIS_RDB_ENC_LZF 3         /* string compressed with FASTLZ */
+#define REDIS_RDB_ENC_CODEC 4       /* codec ID byte + compressed string */
+
+/* Codecs used to compress the values in the dump file. LZF values are saved
+ * with the REDIS_RDB_ENC_LZF encoding for backward compatibility, the other
+ * codecs with REDIS_RDB_ENC_CODEC followed by the codec ID. */
+#define REDIS_RDB_CODEC_NONE -1     /* store the values verbatim */
+#define REDIS_RDB_CODEC_LZF 0       /* best ratio */
+#define REDIS_RDB_CODEC_LZ4 1       /* faster, a bit bigger files */
+#define REDIS_RDB_CODEC_LZF_FAST 2  /* LZF format, faster compression */
+
+/* Before compressing big values a sample of the value is compressed: if the
+ * sample does not shrink at least by 1/8 the value is saved verbatim, as it
+ * is probably already compressed or random data. */
+#define REDIS_RDB_SAMPLE_MINLEN (1024*8)
+#define REDIS_RDB_SAMPLE_LEN    1024
 
 /* Client flags */
 #define REDIS_CLOSE 1       /* This client connection should be closed ASAP */
 #define REDIS_SLAVE 2       /* This client is a slave server */
 #define REDIS_MASTER 4      /* This client is a master server */
 #define REDIS_MONITOR 8      /* This client is a slave monitor, see MONITOR */
+#define REDIS_PRE_PSYNC 16  /* This slave used SYNC, it can't handle PSYNC */
+#define REDIS_CAPTURE 32    /* This monitor gets binary records, see MONITOR CAPTURE */
 
 /* Slave replication state - slave side */
 #define REDIS_REPL_NONE 0   /* No active replication */
 #define REDIS_REPL_CONNECT 1    /* Must connect to master */
 #define REDIS_REPL_CONNECTED 2  /* Connected to master */
+#define REDIS_REPL_CONNECTING 7 /* Non blocking connect in progress */
+#define REDIS_REPL_RECEIVE_PSYNC 8  /* Waiting the reply to PSYNC */
+#define REDIS_REPL_TRANSFER 9   /* Receiving the DB from the master */
 
 /* Slave replication state - from the point of view of master
  * Note that in SEND_BULK and ONLINE state the slave receives new updates
@@ -187,10 +255,19 @@ typedef struct redisObject {
     int refcount;
 } robj;
 
+/* Keys and elements of the values of a type in a DB, updated as the
+ * keyspace changes, see INFO datatypes */
+typedef struct dbTypeStats {
+    long long keys;
+    long long elements;     /* list and set elements, 1 for strings */
+    long long bytes;        /* string values only, see stringObjectSize() */
+} dbTypeStats;
+
 typedef struct redisDb {
     dict *dict;
     dict *expires;
     int id;
+    dbTypeStats stats[REDIS_NUM_TYPES];
 } redisDb;
 
 /* With multiplexing we need to take per-clinet state.
@@ -206,6 +283,7 @@ typedef struct redisClient {
     list *reply;
     int sentlen;
     time_t lastinteraction; /* time of the last interaction, used for timeout */
+    long long id;           /* unique and increasing client id */
     int flags;              /* REDIS_CLOSE | REDIS_SLAVE | REDIS_MONITOR */
     int slaveseldb;         /* slave selected db, if this client is a slave */
     int authenticated;      /* when requirepass is non-NULL */
@@ -213,6 +291,8 @@ typedef struct redisClient {
     int repldbfd;           /* replication DB file descriptor */
     long repldboff;          /* replication DB file offset */
     off_t repldbsize;       /* replication DB file size */
+    long long replinitoff;  /* replication offset the slave started from */
+    int cmdlen;             /* bytes of the command line being processed */
 } redisClient;
 
 struct saveparam {
@@ -230,6 +310,8 @@ struct redisServer {
     long long dirty;            /* changes to DB from the last save */
     list *clients;
     list *slaves, *monitors;
+    list *capturemonitors;      /* MONITOR CAPTURE clients */
+    long long nextclientid;     /* id of the next connected client */
     char neterr[ANET_ERR_LEN];
     aeEventLoop *el;
     int cronloops;              /* number of times the cron function run */
@@ -240,6 +322,11 @@ struct redisServer {
     time_t stat_starttime;         /* server start time */
     long long stat_numcommands;    /* number of processed commands */
     long long stat_numconnections; /* number of connections received */
+    long long stat_keyspace_hits;  /* lookups of existing keys */
+    long long stat_keyspace_misses; /* lookups of missing keys */
+    long long stat_expired_lazy;   /* keys expired when accessed */
+    long long stat_expired_active; /* keys expired by serverCron() */
+    long long stat_evictedkeys;    /* keys evicted because of maxmemory */
     /* Configuration */
     int verbosity;
     int glueoutputbuf;
@@ -249,6 +336,33 @@ struct redisServer {
     char *pidfile;
     int bgsaveinprogress;
     pid_t bgsavechildpid;
+    int childinfopipe[2];       /* the BGSAVE child reports its COW size */
+    long long stat_fork_time;   /* microseconds spent in the last fork() */
+    size_t stat_rdb_cow_bytes;  /* memory copied on write by the last BGSAVE */
+    int isbgsavechild;          /* true in the process doing the BGSAVE */
+    int rdbsavethreads;         /* threads serializing the DB in BGSAVE */
+    int rdbcompression;         /* REDIS_RDB_CODEC_* used to save values */
+    int rdbchecksum;            /* write the CRC64 trailer when saving */
+    FILE *rdbsavefp;            /* DB file being written by rdbSave() */
+    char *rdbsavebuf;           /* its write buffer */
+    size_t rdbsavebufpos;
+    uint64_t rdbsavecrc;        /* checksum of what was flushed to it */
+    /* Lazy free: big values are released by a background job */
+    pthread_mutex_t lazyfree_mutex; /* protects lazyfree_decrs */
+    list *lazyfree_decrs;       /* objects to decrRefCount() in the main thread */
+    /* Slow log, newest entries first */
+    list *slowlog;
+    long long slowlog_entry_id;     /* id of the next entry */
+    long long slowlog_log_slower_than; /* usec, negative disables the log */
+    unsigned long slowlog_max_len;
+    /* Latency monitor and watchdog */
+    long long latency_monitor_threshold; /* ms, 0 disables the monitor */
+    long long el_iteration_start;   /* usec, start of the current iteration */
+    int watchdog_period;            /* ms, 0 disables the watchdog */
+    /* Size of the list and set elements added to the keyspace, used to
+     * estimate the memory of these types */
+    long long elesize_sum[REDIS_NUM_TYPES];
+    long long elesize_count[REDIS_NUM_TYPES];
     struct saveparam *saveparams;
     int saveparamslen;
     char *logfile;
@@ -262,6 +376,38 @@ struct redisServer {
     int masterport;
     redisClient *master;    /* client that is master for this slave */
     int replstate;
+    /* Replication backlog, used to serve partial resynchronizations */
+    char replid[REDIS_REPLID_LEN+1]; /* ID of our replication stream */
+    long long master_repl_offset; /* bytes produced in our replication stream */
+    char *repl_backlog;         /* circular buffer, NULL if not created yet */
+    long long repl_backlog_size;    /* size of the circular buffer */
+    long long repl_backlog_histlen; /* bytes of actual data in the backlog */
+    long long repl_backlog_idx;     /* next write position in the backlog */
+    long long repl_backlog_off;     /* offset of the first byte in the backlog */
+    int slaveseldb;             /* last DB selected in the replication stream */
+    /* State of the stream received from our master (slave side) */
+    char repl_master_replid[REDIS_REPLID_LEN+1]; /* "?" if unknown */
+    long long repl_master_offset;   /* offset of the last processed byte */
+    int repl_master_seldb;          /* DB selected by the master at disconnection */
+    /* Non blocking synchronization with the master (slave side) */
+    int repl_timeout;           /* max seconds without data from the master */
+    int repl_diskless_load;     /* load the DB from the socket, no temp file */
+    int repl_transfer_s;        /* socket connected to the master */
+    int repl_transfer_fd;       /* temp file receiving the DB, or -1 */
+    char repl_transfer_tmpfile[256];
+    long long repl_transfer_size;   /* DB size, -1 until the bulk count */
+    long long repl_transfer_read;   /* DB bytes received so far */
+    char repl_transfer_replid[REDIS_REPLID_LEN+1]; /* from +FULLRESYNC */
+    long long repl_transfer_offset; /* from +FULLRESYNC */
+    time_t repl_transfer_lastio;    /* time of the last data from the master */
+    char repl_transfer_line[1024];  /* line from the master being read */
+    int repl_transfer_linelen;
+    /* Loading the dataset while serving clients */
+    int loading;
+    int loadingservereads;      /* serve reads of the keys already loaded */
+    time_t loading_start_time;
+    long long loading_total_bytes;
+    long long loading_loaded_bytes;
     unsigned int maxclients;
     unsigned int maxmemory;
     /* Sort parameters - qsort_r() is only available under BSD so we
@@ -271,6 +417,32 @@ struct redisServer {
     int sort_bypattern;
 };
 
+/* Source of the RDB data for rdbLoadInput(): a file, or the socket of our
+ * master when loading the DB without using a temp file. */
+typedef struct rdbInput {
+    FILE *fp;               /* file to read, NULL to read from the socket */
+    int fd;                 /* master socket */
+    long long left;         /* payload bytes still to read from the socket */
+    char *buf;              /* read buffer */
+    size_t bufpos, buflen;
+    long long size;         /* total bytes of the DB, 0 if unknown */
+    long long processed;    /* bytes consumed so far */
+    long long keys;         /* keys loaded so far */
+    long long start;        /* loading start time in microseconds */
+    time_t lastreport;      /* last time the progress was logged */
+    int badheader;          /* not an RDB file or unsupported version */
+    int badchecksum;        /* the CRC64 trailer doesn't match */
+    uint64_t crc;           /* checksum of the bytes consumed so far */
+} rdbInput;
+
+typedef unsigned int rdbCodecProc(const void *const in, unsigned int inlen,
+        void *out, unsigned int outlen);
+struct rdbCodec {
+    char *name;
+    rdbCodecProc *compress;
+    rdbCodecProc *decompress;
+};
+
 typedef void redisCommandProc(redisClient *c);
 struct redisCommand {
     char *name;
@@ -279,6 +451,39 @@ struct redisCommand {
     int flags;
 };
 
+/* An entry of the slow log. Only the first REDIS_SLOWLOG_MAX_ARGC arguments,
+ * truncated to REDIS_SLOWLOG_MAX_STRING bytes, are copied: the memory used
+ * by the log is bounded whatever the size of the logged commands. */
+typedef struct slowlogEntry {
+    long long id;           /* unique and increasing */
+    time_t time;            /* unix time the command was executed */
+    long long duration;     /* execution time in microseconds */
+    char addr[32];          /* ip:port of the client */
+    int argc;
+    sds *argv;
+} slowlogEntry;
+
+/* Latency spikes of an event, in a circular buffer. Samples taken in the
+ * same second are merged keeping the worst one. */
+struct latencySample {
+    int32_t time;           /* unix time of the sample */
+    uint32_t latency;       /* milliseconds */
+};
+
+struct latencyTimeSeries {
+    int idx;                /* next sample to write */
+    uint32_t max;           /* max latency since the last reset */
+    struct latencySample samples[REDIS_LATENCY_TS_LEN];
+};
+
+/* Stats of a command, see INFO commandstats. Bucket b of the latency
+ * histogram counts the calls that took up to 2^b microseconds, the last
+ * bucket also the slower ones. */
+struct redisCommandStats {
+    long long calls, microseconds, maxmicroseconds;
+    long long latency[REDIS_CMDSTAT_BUCKETS];
+};
+
 struct redisFunctionSym {
     char *name;
     unsigned long pointer;
@@ -314,26 +519,53 @@ static void freeSetObject(robj *o);
 static void decrRefCount(void *o);
 static robj *createObject(int type, void *ptr);
 static void freeClient(redisClient *c);
+static int rdbLoadFile(char *filename, rdbInput *rdb);
 static int rdbLoad(char *filename);
+static int rdbCheckFile(char *filename);
 static void addReply(redisClient *c, robj *obj);
+static void addReplyDbObject(redisClient *c, robj *obj);
 static void addReplySds(redisClient *c, sds s);
 static void incrRefCount(robj *o);
 static int rdbSaveBackground(char *filename);
 static robj *createStringObject(char *ptr, size_t len);
 static void replicationFeedSlaves(list *slaves, struct redisCommand *cmd, int dictid, robj **argv, int argc);
-static int syncWithMaster(void);
+static void captureFeedMonitors(redisClient *c, struct redisCommand *cmd, long long start);
+static void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask);
+static int connectWithMaster(void);
+static void cancelReplicationHandshake(void);
+static int rdbFillBuffer(rdbInput *rdb);
+static void processEventsWhileLoading(void);
+static void loadDataFromDisk(void);
 static robj *tryObjectSharing(robj *o);
 static int removeExpire(redisDb *db, robj *key);
 static int expireIfNeeded(redisDb *db, robj *key);
 static int deleteIfVolatile(redisDb *db, robj *key);
 static int deleteKey(redisDb *db, robj *key);
+static int dbAsyncDelete(redisDb *db, robj *key);
+static void lazyfreeInit(void);
+static void lazyfreeSubmit(robj *o, dict *d, dict *expires);
+static void lazyfreeProcessDecrs(void);
+static void slowlogFreeEntry(void *ptr);
+static void dbStatsUpdateValue(redisDb *db, robj *o, int sign);
+static void dbStatsUpdateElements(redisDb *db, int type, long long delta, robj *added);
+static void latencyAddSampleIfNeeded(int event, long long usec);
+static void latencyRehashProc(unsigned long elements, long long usec);
+static void watchdogScheduleSignal(int period);
+static void setupWatchdogAction(void);
+static void beforeSleep(struct aeEventLoop *eventLoop);
+static void afterSleep(struct aeEventLoop *eventLoop);
 static time_t getExpire(redisDb *db, robj *key);
 static int setExpire(redisDb *db, robj *key, time_t when);
 static void updateSlavesWaitingBgsave(int bgsaveerr);
 static void freeMemoryIfNeeded(void);
+static void resetKeyspaceStats(void);
 static int processCommand(redisClient *c);
 static void setupSigSegvAction(void);
 static void rdbRemoveTempFile(pid_t childpid);
+static void rdbReceiveChildInfo(void);
+static void updateDictResizePolicy(void);
+static void resetReplicationMasterState(void);
+static void feedReplicationBacklog(void *ptr, size_t len);
 
 static void authCommand(redisClient *c);
 static void pingCommand(redisClient *c);
@@ -342,6 +574,7 @@ static void setCommand(redisClient *c);
 static void setnxCommand(redisClient *c);
 static void getCommand(redisClient *c);
 static void delCommand(redisClient *c);
+static void unlinkCommand(redisClient *c);
 static void existsCommand(redisClient *c);
 static void incrCommand(redisClient *c);
 static void decrCommand(redisClient *c);
@@ -350,6 +583,8 @@ static void decrbyCommand(redisClient *c);
 static void selectCommand(redisClient *c);
 static void randomkeyCommand(redisClient *c);
 static void keysCommand(redisClient *c);
+static void scanCommand(redisClient *c);
+static void sscanCommand(redisClient *c);
 static void dbsizeCommand(redisClient *c);
 static void lastsaveCommand(redisClient *c);
 static void saveCommand(redisClient *c);
@@ -383,6 +618,9 @@ static void sdiffstoreCommand(redisClient *c);
 static void syncCommand(redisClient *c);
 static void flushdbCommand(redisClient *c);
 static void flushallCommand(redisClient *c);
+static void configCommand(redisClient *c);
+static void slowlogCommand(redisClient *c);
+static void latencyCommand(redisClient *c);
 static void sortCommand(redisClient *c);
 static void lremCommand(redisClient *c);
 static void infoCommand(redisClient *c);
@@ -393,197 +631,132 @@ static void getSetCommand(redisClient *c);
 static void ttlCommand(redisClient *c);
 static void slaveofCommand(redisClient *c);
 static void debugCommand(redisClient *c);
+static void memoryCommand(redisClient *c);
 /*================================= Globals ================================= */
 
 /* Global vars */
 static struct redisServer server; /* server global state */
 static struct redisCommand cmdTable[] = {
-    {"get",getCommand,2,REDIS_CMD_INLINE},
+    {"get",getCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"set",setCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"setnx",setnxCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"del",delCommand,-2,REDIS_CMD_INLINE},
-    {"exists",existsCommand,2,REDIS_CMD_INLINE},
+    {"unlink",unlinkCommand,-2,REDIS_CMD_INLINE},
+    {"exists",existsCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"incr",incrCommand,2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
     {"decr",decrCommand,2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
-    {"mget",mgetCommand,-2,REDIS_CMD_INLINE},
+    {"mget",mgetCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"rpush",rpushCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"lpush",lpushCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"rpop",rpopCommand,2,REDIS_CMD_INLINE},
     {"lpop",lpopCommand,2,REDIS_CMD_INLINE},
-    {"llen",llenCommand,2,REDIS_CMD_INLINE},
-    {"lindex",lindexCommand,3,REDIS_CMD_INLINE},
+    {"llen",llenCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
+    {"lindex",lindexCommand,3,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"lset",lsetCommand,4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
-    {"lrange",lrangeCommand,4,REDIS_CMD_INLINE},
+    {"lrange",lrangeCommand,4,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"ltrim",ltrimCommand,4,REDIS_CMD_INLINE},
     {"lrem",lremCommand,4,REDIS_CMD_BULK},
     {"sadd",saddCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"srem",sremCommand,3,REDIS_CMD_BULK},
     {"smove",smoveCommand,4,REDIS_CMD_BULK},
-    {"sismember",sismemberCommand,3,REDIS_CMD_BULK},
-    {"scard",scardCommand,2,REDIS_CMD_INLINE},
+    {"sismember",sismemberCommand,3,REDIS_CMD_BULK|REDIS_CMD_READONLY},
+    {"scard",scardCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"spop",spopCommand,2,REDIS_CMD_INLINE},
-    {"sinter",sinterCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"sinter",sinterCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM|REDIS_CMD_READONLY},
     {"sinterstore",sinterstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
-    {"sunion",sunionCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"sunion",sunionCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM|REDIS_CMD_READONLY},
     {"sunionstore",sunionstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
-    {"sdiff",sdiffCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"sdiff",sdiffCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM|REDIS_CMD_READONLY},
     {"sdiffstore",sdiffstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
-    {"smembers",sinterCommand,2,REDIS_CMD_INLINE},
+    {"smembers",sinterCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"incrby",incrbyCommand,3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
     {"decrby",decrbyCommand,3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
     {"getset",getSetCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
-    {"randomkey",randomkeyCommand,1,REDIS_CMD_INLINE},
-    {"select",selectCommand,2,REDIS_CMD_INLINE},
+    {"randomkey",randomkeyCommand,1,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
+    {"select",selectCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"move",moveCommand,3,REDIS_CMD_INLINE},
     {"rename",renameCommand,3,REDIS_CMD_INLINE},
     {"renamenx",renamenxCommand,3,REDIS_CMD_INLINE},
     {"expire",expireCommand,3,REDIS_CMD_INLINE},
-    {"keys",keysCommand,2,REDIS_CMD_INLINE},
-    {"dbsize",dbsizeCommand,1,REDIS_CMD_INLINE},
-    {"auth",authCommand,2,REDIS_CMD_INLINE},
-    {"ping",pingCommand,1,REDIS_CMD_INLINE},
-    {"echo",echoCommand,2,REDIS_CMD_BULK},
+    {"keys",keysCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
+    {"scan",scanCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
+    {"sscan",sscanCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
+    {"dbsize",dbsizeCommand,1,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
+    {"auth",authCommand,2,REDIS_CMD_INLINE|REDIS_CMD_LOADING},
+    {"ping",pingCommand,1,REDIS_CMD_INLINE|REDIS_CMD_LOADING},
+    {"echo",echoCommand,2,REDIS_CMD_BULK|REDIS_CMD_READONLY},
     {"save",saveCommand,1,REDIS_CMD_INLINE},
     {"bgsave",bgsaveCommand,1,REDIS_CMD_INLINE},
     {"shutdown",shutdownCommand,1,REDIS_CMD_INLINE},
-    {"lastsave",lastsaveCommand,1,REDIS_CMD_INLINE},
-    {"type",typeCommand,2,REDIS_CMD_INLINE},
+    {"lastsave",lastsaveCommand,1,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
+    {"type",typeCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"sync",syncCommand,1,REDIS_CMD_INLINE},
-    {"flushdb",flushdbCommand,1,REDIS_CMD_INLINE},
-    {"flushall",flushallCommand,1,REDIS_CMD_INLINE},
+    {"psync",syncCommand,3,REDIS_CMD_INLINE},
+    {"flushdb",flushdbCommand,-1,REDIS_CMD_INLINE},
+    {"flushall",flushallCommand,-1,REDIS_CMD_INLINE},
     {"sort",sortCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
-    {"info",infoCommand,1,REDIS_CMD_INLINE},
-    {"monitor",monitorCommand,1,REDIS_CMD_INLINE},
-    {"ttl",ttlCommand,2,REDIS_CMD_INLINE},
+    {"info",infoCommand,-1,REDIS_CMD_INLINE|REDIS_CMD_LOADING},
+    {"config",configCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_LOADING},
+    {"slowlog",slowlogCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_LOADING},
+    {"latency",latencyCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_LOADING},
+    {"monitor",monitorCommand,-1,REDIS_CMD_INLINE},
+    {"ttl",ttlCommand,2,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {"slaveof",slaveofCommand,3,REDIS_CMD_INLINE},
     {"debug",debugCommand,-2,REDIS_CMD_INLINE},
+    {"memory",memoryCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_READONLY},
     {NULL,NULL,0,0}
 };
+
+/* cmdStats[j] holds the stats of cmdTable[j] */
+static struct redisCommandStats cmdStats[sizeof(cmdTable)/sizeof(cmdTable[0])];
+static char *latencyEventNames[REDIS_LATENCY_EVENTS] = {
+    "command", "event-loop", "expire-cycle", "hash-resize", "rehash",
+    "clients-timeout", "fork", "free-object"
+};
+static struct latencyTimeSeries latencyEvents[REDIS_LATENCY_EVENTS];
+
+/* Indexed by REDIS_RDB_CODEC_* */
+static struct rdbCodec rdbCodecs[] = {
+    {"lzf",lzf_compress,lzf_decompress},
+    {"lz4",lz4_compress,lz4_decompress},
+    {"lzf-fast",lzf_compress_fast,lzf_decompress},
+    {NULL,NULL,NULL}
+};
 /*============================ Utility functions ============================ */
 
-/* Glob-style pattern matching. */
-int stringmatchlen(const char *pattern, int patternLen,
-        const char *string, int stringLen, int nocase)
-{
-    while(patternLen) {
-        switch(pattern[0]) {
-        case '*':
-            while (pattern[1] == '*') {
-                pattern++;
-                patternLen--;
-            }
-            if (patternLen == 1)
-                return 1; /* match */
-            while(stringLen) {
-                if (stringmatchlen(pattern+1, patternLen-1,
-                            string, stringLen, nocase))
-                    return 1; /* match */
-                string++;
-                stringLen--;
-            }
-            return 0; /* no match */
-            break;
-        case '?':
-            if (stringLen == 0)
-                return 0; /* no match */
-            string++;
-            stringLen--;
-            break;
-        case '[':
-        {
-            int not, match;
-
-            pattern++;
-            patternLen--;
-            not = pattern[0] == '^';
-            if (not) {
-                pattern++;
-                patternLen--;
-            }
-            match = 0;
-            while(1) {
-                if (pattern[0] == '\\') {
-                    pattern++;
-                    patternLen--;
-                    if (pattern[0] == string[0])
-                        match = 1;
-                } else if (pattern[0] == ']') {
-                    break;
-                } else if (patternLen == 0) {
-                    pattern--;
-                    patternLen++;
-                    break;
-                } else if (pattern[1] == '-' && patternLen >= 3) {
-                    int start = pattern[0];
-                    int end = pattern[2];
-                    int c = string[0];
-                    if (start > end) {
-                        int t = start;
-                        start = end;
-                        end = t;
-                    }
-                    if (nocase) {
-                        start = tolower(start);
-                        end = tolower(end);
-                        c = tolower(c);
-                    }
-                    pattern += 2;
-                    patternLen -= 2;
-                    if (c >= start && c <= end)
-                        match = 1;
-                } else {
-                    if (!nocase) {
-                        if (pattern[0] == string[0])
-                            match = 1;
-                    } else {
-                        if (tolower((int)pattern[0]) == tolower((int)string[0]))
-                            match = 1;
-                    }
-                }
-                pattern++;
-                patternLen--;
-            }
-            if (not)
-                match = !match;
-            if (!match)
-                return 0; /* no match */
-            string++;
-            stringLen--;
-            break;
-        }
-        case '\\':
-            if (patternLen >= 2) {
-                pattern++;
-                patternLen--;
-            }
-            /* fall through */
-        default:
-            if (!nocase) {
-                if (pattern[0] != string[0])
-                    return 0; /* no match */
-            } else {
-                if (tolower((int)pattern[0]) != tolower((int)string[0]))
-                    return 0; /* no match */
-            }
-            string++;
-            stringLen--;
-            break;
-        }
-        pattern++;
-        patternLen--;
-        if (stringLen == 0) {
-            while(*pattern == '*') {
-                pattern++;
-                patternLen--;
-            }
-            break;
-        }
+/* Fill 'p' with 'len' random hex chars, reading from /dev/urandom and using
+ * random() as a fallback if it can't be opened. */
+static void getRandomHexChars(char *p, unsigned int len) {
+    char *charset = "0123456789abcdef";
+    FILE *fp = fopen("/dev/urandom","r");
+    unsigned int j;
+
+    if (fp == NULL || fread(p,len,1,fp) == 0) {
+        for (j = 0; j < len; j++) p[j] = random();
     }
-    if (patternLen == 0 && stringLen == 0)
-        return 1;
-    return 0;
+    if (fp) fclose(fp);
+    for (j = 0; j < len; j++) p[j] = charset[p[j] & 0x0F];
+}
+
+/* Return the UNIX time in microseconds */
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
 }
 
+/* Time an internal event for the latency monitor. The clock is not read at
+ * all when the monitor is disabled. */
+#define latencyStartMonitor(var) do { \
+    var = server.latency_monitor_threshold ? ustime() : 0; \
+} while(0)
+
+#define latencyEndMonitor(event,var) do { \
+    if (server.latency_monitor_threshold && (var)) \
+        latencyAddSampleIfNeeded(event,ustime()-(var)); \
+} while(0)
+
 static void redisLog(int level, const char *fmt, ...) {
     va_list ap;
     FILE *fp;
@@ -631,6 +804,7 @@ static void dictRedisObjectDestructor(void *privdata, void *val)
 {
     DICT_NOTUSED(privdata);
 
+    if (val == NULL) return; /* value detached by dbAsyncDelete() */
     decrRefCount(val);
 }
 
@@ -655,13 +829,28 @@ static dictType setDictType = {
     NULL                       /* val destructor */
 };
 
+/* Values entering and leaving a DB update its dbTypeStats: the DB tables
+ * have the redisDb as private data. Values detached by dbAsyncDelete() are
+ * accounted there. */
+static void *dictDbValDup(void *privdata, const void *obj) {
+    dbStatsUpdateValue(privdata,(robj*)obj,1);
+    return (void*)obj;
+}
+
+static void dictDbValDestructor(void *privdata, void *val)
+{
+    if (val == NULL) return; /* value detached by dbAsyncDelete() */
+    dbStatsUpdateValue(privdata,val,-1);
+    decrRefCount(val);
+}
+
 static dictType hashDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
-    NULL,                       /* val dup */
+    dictDbValDup,               /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictRedisObjectDestructor,  /* key destructor */
-    dictRedisObjectDestructor   /* val destructor */
+    dictDbValDestructor         /* val destructor */
 };
 
 /* ========================= Random utility functions ======================= */
@@ -723,10 +912,14 @@ static void tryResizeHashTables(void) {
 
 static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     int j, loops = server.cronloops++;
+    long long start;
     REDIS_NOTUSED(eventLoop);
     REDIS_NOTUSED(id);
     REDIS_NOTUSED(clientData);
 
+    /* Drop the references the lazy free thread handed back to us */
+    lazyfreeProcessDecrs();
+
     /* Update the global state with the amount of used memory */
     server.usedmemory = zmalloc_used_memory();
 
@@ -749,7 +942,11 @@ static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientD
      * if we resize the HT while there is the saving child at work actually
      * a lot of memory movements in the parent will cause a lot of pages
      * copied. */
-    if (!server.bgsaveinprogress) tryResizeHashTables();
+    if (!server.bgsaveinprogress) {
+        latencyStartMonitor(start);
+        tryResizeHashTables();
+        latencyEndMonitor(REDIS_LATENCY_HASH_RESIZE,start);
+    }
 
     /* Show information about connected clients */
     if (!(loops % 5)) {
@@ -761,8 +958,11 @@ static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientD
     }
 
     /* Close connections of timedout clients */
-    if (server.maxidletime && !(loops % 10))
+    if (server.maxidletime && !(loops % 10)) {
+        latencyStartMonitor(start);
         closeTimedoutClients();
+        latencyEndMonitor(REDIS_LATENCY_CLIENTS_TIMEOUT,start);
+    }
 
     /* Check if a background saving in progress terminated */
     if (server.bgsaveinprogress) {
@@ -783,8 +983,10 @@ static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientD
                     "Background saving terminated by signal");
                 rdbRemoveTempFile(server.bgsavechildpid);
             }
+            rdbReceiveChildInfo();
             server.bgsaveinprogress = 0;
             server.bgsavechildpid = -1;
+            updateDictResizePolicy();
             updateSlavesWaitingBgsave(exitcode == 0 ? REDIS_OK : REDIS_ERR);
         }
     } else {
@@ -805,6 +1007,7 @@ static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientD
     }
 
     /* Try to expire a few timed out keys */
+    latencyStartMonitor(start);
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
         int num = dictSize(db->expires);
@@ -821,22 +1024,60 @@ static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientD
                 if ((de = dictGetRandomKey(db->expires)) == NULL) break;
                 t = (time_t) dictGetEntryVal(de);
                 if (now > t) {
-                    deleteKey(db,dictGetEntryKey(de));
+                    dbAsyncDelete(db,dictGetEntryKey(de));
+                    server.stat_expired_active++;
                 }
             }
         }
     }
+    latencyEndMonitor(REDIS_LATENCY_EXPIRE_CYCLE,start);
 
     /* Check if we should connect to a MASTER */
     if (server.replstate == REDIS_REPL_CONNECT) {
         redisLog(REDIS_NOTICE,"Connecting to MASTER...");
-        if (syncWithMaster() == REDIS_OK) {
-            redisLog(REDIS_NOTICE,"MASTER <-> SLAVE sync succeeded");
+        if (connectWithMaster() == REDIS_OK) {
+            redisLog(REDIS_NOTICE,"MASTER <-> SLAVE sync started");
+        }
+    }
+
+    /* Abort a synchronization with the master that is not making progress.
+     * Before the payload starts the master may still be saving the DB. */
+    if (server.replstate == REDIS_REPL_CONNECTING ||
+        server.replstate == REDIS_REPL_RECEIVE_PSYNC ||
+        server.replstate == REDIS_REPL_TRANSFER)
+    {
+        int timeout = server.repl_timeout;
+
+        if (server.replstate == REDIS_REPL_RECEIVE_PSYNC ||
+            (server.replstate == REDIS_REPL_TRANSFER &&
+             server.repl_transfer_size == -1))
+            timeout = REDIS_REPL_WAIT_TIMEOUT;
+        if (time(NULL)-server.repl_transfer_lastio > timeout) {
+            redisLog(REDIS_WARNING,"Timeout syncing with MASTER, retrying...");
+            cancelReplicationHandshake();
         }
     }
     return 1000;
 }
 
+/* Called before to wait for events: the event loop iteration is over, the
+ * time spent sleeping is not accounted. */
+static void beforeSleep(struct aeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+
+    if (server.watchdog_period) watchdogScheduleSignal(0);
+    latencyEndMonitor(REDIS_LATENCY_EVENT_LOOP,server.el_iteration_start);
+    server.el_iteration_start = 0;
+}
+
+/* Called as soon as there are events to process: a new iteration starts */
+static void afterSleep(struct aeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+
+    latencyStartMonitor(server.el_iteration_start);
+    if (server.watchdog_period) watchdogScheduleSignal(server.watchdog_period);
+}
+
 static void createSharedObjects(void) {
     shared.crlf = createObject(REDIS_STRING,sdsnew("\r\n"));
     shared.ok = createObject(REDIS_STRING,sdsnew("+OK\r\n"));
@@ -903,8 +1144,17 @@ static void initServerConfig() {
     server.requirepass = NULL;
     server.shareobjects = 0;
     server.sharingpoolsize = 1024;
+    server.isbgsavechild = 0;
+    server.rdbsavethreads = 1;
+    server.rdbcompression = REDIS_RDB_CODEC_LZF;
+    server.rdbchecksum = 1;
+    server.rdbsavefp = NULL;
     server.maxclients = 0;
     server.maxmemory = 0;
+    server.slowlog_log_slower_than = REDIS_SLOWLOG_LOG_SLOWER_THAN;
+    server.slowlog_max_len = REDIS_SLOWLOG_MAX_LEN;
+    server.latency_monitor_threshold = 0;
+    server.watchdog_period = 0;
     ResetServerSaveParams();
 
     appendServerSaveParams(60*60,1);  /* save after 1 hour and 1 change */
@@ -916,6 +1166,14 @@ static void initServerConfig() {
     server.masterport = 6379;
     server.master = NULL;
     server.replstate = REDIS_REPL_NONE;
+    server.repl_backlog_size = REDIS_REPL_BACKLOG_SIZE;
+    server.repl_timeout = REDIS_MAX_SYNC_TIME;
+    server.repl_diskless_load = 0;
+    server.repl_transfer_s = -1;
+    server.repl_transfer_fd = -1;
+    server.loading = 0;
+    server.loadingservereads = 0;
+    resetReplicationMasterState();
 }
 
 static void initServer() {
@@ -924,16 +1182,20 @@ static void initServer() {
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
     setupSigSegvAction();
+    setupWatchdogAction();
 
     server.clients = listCreate();
     server.slaves = listCreate();
     server.monitors = listCreate();
+    server.capturemonitors = listCreate();
+    server.nextclientid = 0;
     server.objfreelist = listCreate();
     createSharedObjects();
     server.el = aeCreateEventLoop();
     server.db = zmalloc(sizeof(redisDb)*server.dbnum);
     server.sharingpool = dictCreate(&setDictType,NULL);
-    if (!server.db || !server.clients || !server.slaves || !server.monitors || !server.el || !server.objfreelist)
+    if (!server.db || !server.clients || !server.slaves || !server.monitors ||
+        !server.capturemonitors || !server.el || !server.objfreelist)
         oom("server initialization"); /* Fatal OOM */
     server.fd = anetTcpServer(server.neterr, server.port, server.bindaddr);
     if (server.fd == -1) {
@@ -941,20 +1203,46 @@ static void initServer() {
         exit(1);
     }
     for (j = 0; j < server.dbnum; j++) {
-        server.db[j].dict = dictCreate(&hashDictType,NULL);
+        server.db[j].dict = dictCreate(&hashDictType,server.db+j);
         server.db[j].expires = dictCreate(&setDictType,NULL);
         server.db[j].id = j;
+        memset(server.db[j].stats,0,sizeof(server.db[j].stats));
     }
     server.cronloops = 0;
     server.bgsaveinprogress = 0;
     server.bgsavechildpid = -1;
+    server.childinfopipe[0] = server.childinfopipe[1] = -1;
+    server.stat_fork_time = 0;
+    server.stat_rdb_cow_bytes = 0;
     server.lastsave = time(NULL);
     server.dirty = 0;
     server.usedmemory = 0;
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
+    resetKeyspaceStats();
     server.stat_starttime = time(NULL);
+    getRandomHexChars(server.replid,REDIS_REPLID_LEN);
+    server.replid[REDIS_REPLID_LEN] = '\0';
+    server.master_repl_offset = 0;
+    server.repl_backlog = NULL;
+    server.repl_backlog_histlen = 0;
+    server.repl_backlog_idx = 0;
+    server.repl_backlog_off = 0;
+    server.slaveseldb = -1;
+    lazyfreeInit();
+    server.slowlog = listCreate();
+    if (!server.slowlog) oom("listCreate");
+    listSetFreeMethod(server.slowlog,slowlogFreeEntry);
+    server.slowlog_entry_id = 0;
+    server.el_iteration_start = 0;
+    dictSetRehashProc(latencyRehashProc);
+    if (bioInit() == -1) {
+        redisLog(REDIS_WARNING,"Can't create the background jobs threads");
+        exit(1);
+    }
     aeCreateTimeEvent(server.el, 1000, serverCron, NULL, NULL);
+    aeSetBeforeSleepProc(server.el,beforeSleep);
+    aeSetAfterSleepProc(server.el,afterSleep);
 }
 
 /* Empty the whole database */
@@ -970,6 +1258,21 @@ static long long emptyDb() {
     return removed;
 }
 
+/* Like emptyDb() for a single DB, but the old tables are released by the
+ * lazy free thread */
+static long long emptyDbAsync(redisDb *db) {
+    long long removed = dictSize(db->dict);
+    dict *oldd = db->dict, *olde = db->expires;
+
+    if (dictSize(oldd) == 0 && dictSize(olde) == 0) return 0;
+    db->dict = dictCreate(&hashDictType,db);
+    db->expires = dictCreate(&setDictType,NULL);
+    if (!db->dict || !db->expires) oom("dictCreate");
+    memset(db->stats,0,sizeof(db->stats));
+    lazyfreeSubmit(NULL,oldd,olde);
+    return removed;
+}
+
 static int yesnotoi(char *s) {
     if (!strcasecmp(s,"yes")) return 1;
     else if (!strcasecmp(s,"no")) return 0;
@@ -1073,10 +1376,64 @@ static void loadServerConfig(char *filename) {
             server.maxclients = atoi(argv[1]);
         } else if (!strcasecmp(argv[0],"maxmemory") && argc == 2) {
             server.maxmemory = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"slowlog-log-slower-than") && argc == 2) {
+            server.slowlog_log_slower_than = strtoll(argv[1],NULL,10);
+        } else if (!strcasecmp(argv[0],"slowlog-max-len") && argc == 2) {
+            server.slowlog_max_len = strtoul(argv[1],NULL,10);
+        } else if (!strcasecmp(argv[0],"latency-monitor-threshold") && argc == 2) {
+            server.latency_monitor_threshold = strtoll(argv[1],NULL,10);
+            if (server.latency_monitor_threshold < 0) {
+                err = "Invalid latency monitor threshold"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"watchdog-period") && argc == 2) {
+            server.watchdog_period = atoi(argv[1]);
+            if (server.watchdog_period < 0) {
+                err = "Invalid watchdog period"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"slaveof") && argc == 3) {
             server.masterhost = sdsnew(argv[1]);
             server.masterport = atoi(argv[2]);
             server.replstate = REDIS_REPL_CONNECT;
+        } else if (!strcasecmp(argv[0],"repl-backlog-size") && argc == 2) {
+            server.repl_backlog_size = strtoll(argv[1],NULL,10);
+            if (server.repl_backlog_size < 1) {
+                err = "Invalid replication backlog size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-timeout") && argc == 2) {
+            server.repl_timeout = atoi(argv[1]);
+            if (server.repl_timeout < 1) {
+                err = "Invalid replication timeout"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-diskless-load") && argc == 2) {
+            if ((server.repl_diskless_load = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"loading-serve-reads") && argc == 2) {
+            if ((server.loadingservereads = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-save-threads") && argc == 2) {
+            server.rdbsavethreads = atoi(argv[1]);
+            if (server.rdbsavethreads < 1 ||
+                server.rdbsavethreads > REDIS_RDB_MAX_THREADS) {
+                err = "Invalid number of RDB save threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-compression") && argc == 2) {
+            if (!strcasecmp(argv[1],"no")) {
+                server.rdbcompression = REDIS_RDB_CODEC_NONE;
+            } else {
+                for (j = 0; rdbCodecs[j].name; j++)
+                    if (!strcasecmp(argv[1],rdbCodecs[j].name)) break;
+                if (rdbCodecs[j].name == NULL) {
+                    err = "argument must be 'no', 'lzf', 'lzf-fast' or 'lz4'";
+                    goto loaderr;
+                }
+                server.rdbcompression = j;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-checksum") && argc == 2) {
+            if ((server.rdbchecksum = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"glueoutputbuf") && argc == 2) {
             if ((server.glueoutputbuf = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -1142,12 +1499,16 @@ static void freeClient(redisClient *c) {
     if (c->flags & REDIS_SLAVE) {
         if (c->replstate == REDIS_REPL_SEND_BULK && c->repldbfd != -1)
             close(c->repldbfd);
-        list *l = (c->flags & REDIS_MONITOR) ? server.monitors : server.slaves;
+        list *l = (c->flags & REDIS_CAPTURE) ? server.capturemonitors :
+                  (c->flags & REDIS_MONITOR) ? server.monitors : server.slaves;
         ln = listSearchKey(l,c);
         assert(ln != NULL);
         listDelNode(l,ln);
     }
     if (c->flags & REDIS_MASTER) {
+        /* Remember the selected DB: if we are able to continue the
+         * replication stream with PSYNC the master will not send it again */
+        server.repl_master_seldb = c->db->id;
         server.master = NULL;
         server.replstate = REDIS_REPL_CONNECT;
     }
@@ -1250,8 +1611,93 @@ static struct redisCommand *lookupCommand(char *name) {
     return NULL;
 }
 
+static void updateCommandStats(struct redisCommand *cmd, long long duration) {
+    struct redisCommandStats *st = cmdStats+(cmd-cmdTable);
+    int b = 0;
+
+    if (duration < 0) duration = 0; /* the clock was set back */
+    st->calls++;
+    st->microseconds += duration;
+    if (duration > st->maxmicroseconds) st->maxmicroseconds = duration;
+    while(b < REDIS_CMDSTAT_BUCKETS-1 && (1LL<<b) < duration) b++;
+    st->latency[b]++;
+}
+
+static void resetCommandStats(void) {
+    memset(cmdStats,0,sizeof(cmdStats));
+}
+
+/* Reset the keyspace hits, misses, expires and evictions of INFO */
+static void resetKeyspaceStats(void) {
+    server.stat_keyspace_hits = 0;
+    server.stat_keyspace_misses = 0;
+    server.stat_expired_lazy = 0;
+    server.stat_expired_active = 0;
+    server.stat_evictedkeys = 0;
+}
+
+static void slowlogFreeEntry(void *ptr) {
+    slowlogEntry *se = ptr;
+    int j;
+
+    for (j = 0; j < se->argc; j++) sdsfree(se->argv[j]);
+    zfree(se->argv);
+    zfree(se);
+}
+
+/* Log the command of the client if it took at least slowlog-log-slower-than
+ * microseconds, dropping the oldest entries beyond slowlog-max-len. */
+static void slowlogPushEntryIfNeeded(redisClient *c, long long duration) {
+    slowlogEntry *se;
+    char ip[16];
+    int port, j, argc;
+
+    if (server.slowlog_log_slower_than < 0 ||
+        duration < server.slowlog_log_slower_than) return;
+    if (server.slowlog_max_len == 0) return;
+
+    argc = c->argc > REDIS_SLOWLOG_MAX_ARGC ? REDIS_SLOWLOG_MAX_ARGC : c->argc;
+    se = zmalloc(sizeof(*se));
+    if (!se || !(se->argv = zmalloc(sizeof(sds)*argc)))
+        oom("slowlogPushEntryIfNeeded");
+    se->argc = argc;
+    for (j = 0; j < argc; j++) {
+        sds arg = c->argv[j]->ptr;
+
+        if (j == argc-1 && argc < c->argc) {
+            /* The last slot tells how many arguments were not logged */
+            se->argv[j] = sdscatprintf(sdsempty(),"... (%d more arguments)",
+                c->argc-argc+1);
+        } else if (sdslen(arg) > REDIS_SLOWLOG_MAX_STRING) {
+            se->argv[j] = sdsnewlen(arg,REDIS_SLOWLOG_MAX_STRING);
+            se->argv[j] = sdscatprintf(se->argv[j],"... (%d more bytes)",
+                (int)sdslen(arg)-REDIS_SLOWLOG_MAX_STRING);
+        } else {
+            se->argv[j] = sdsdup(arg);
+        }
+    }
+    se->id = server.slowlog_entry_id++;
+    se->time = time(NULL);
+    se->duration = duration;
+    if (anetPeerToString(c->fd,ip,&port) == ANET_ERR)
+        snprintf(se->addr,sizeof(se->addr),"?:0");
+    else
+        snprintf(se->addr,sizeof(se->addr),"%s:%d",ip,port);
+    if (!listAddNodeHead(server.slowlog,se)) oom("listAddNodeHead");
+    while (listLength(server.slowlog) > server.slowlog_max_len)
+        listDelNode(server.slowlog,listLast(server.slowlog));
+}
+
 /* resetClient prepare the client to process the next command */
 static void resetClient(redisClient *c) {
+    /* A command received from our master was fully processed: advance the
+     * offset of the master stream, so that we can ask to continue from the
+     * right place with PSYNC if the link breaks. */
+    if (c->flags & REDIS_MASTER) {
+        server.repl_master_offset += c->cmdlen;
+        if (c->bulklen != -1) server.repl_master_offset += c->bulklen;
+    }
+    c->cmdlen = 0;
     freeClientArgv(c);
     c->bulklen = -1;
 }
@@ -1266,7 +1712,7 @@ static void resetClient(redisClient *c) {
  * if 0 is returned the client was destroied (i.e. after QUIT). */
 static int processCommand(redisClient *c) {
     struct redisCommand *cmd;
-    long long dirty;
+    long long dirty, start, duration;
 
     /* Free some memory if needed (maxmemory setting) */
     if (server.maxmemory) freeMemoryIfNeeded();
@@ -1293,6 +1739,7 @@ static int processCommand(redisClient *c) {
         return 1;
     } else if (cmd->flags & REDIS_CMD_BULK && c->bulklen == -1) {
         int bulklen = atoi(c->argv[c->argc-1]->ptr);
+        sds arg;
 
         decrRefCount(c->argv[c->argc-1]);
         if (bulklen < 0 || bulklen > 1024*1024*1024) {
@@ -1305,10 +1752,8 @@ static int processCommand(redisClient *c) {
         c->bulklen = bulklen+2; /* add two bytes for CR+LF */
         /* It is possible that the bulk read is already in the
          * buffer. Check this condition and handle it accordingly */
-        if ((signed)sdslen(c->querybuf) >= c->bulklen) {
-            c->argv[c->argc] = createStringObject(c->querybuf,c->bulklen-2);
-            c->argc++;
-            c->querybuf = sdsrange(c->querybuf,c->bulklen,-1);
+        if ((arg = protocolReadBulk(&c->querybuf,c->bulklen)) != NULL) {
+            c->argv[c->argc++] = createObject(REDIS_STRING,arg);
         } else {
             return 1;
         }
@@ -1325,14 +1770,32 @@ static int processCommand(redisClient *c) {
         resetClient(c);
         return 1;
     }
+    /* Only a few commands are served while the dataset is loading, and
+     * optionally the read only commands: they see only the keys already
+     * loaded, the others look like missing keys */
+    if (server.loading && !(cmd->flags & REDIS_CMD_LOADING) &&
+        !(server.loadingservereads && (cmd->flags & REDIS_CMD_READONLY)))
+    {
+        addReplySds(c,sdsnew("-LOADING Redis is loading the dataset in memory\r\n"));
+        resetClient(c);
+        return 1;
+    }
 
     /* Exec the command */
     dirty = server.dirty;
+    start = ustime();
     cmd->proc(c);
-    if (server.dirty-dirty != 0 && listLength(server.slaves))
+    duration = ustime()-start;
+    updateCommandStats(cmd,duration);
+    slowlogPushEntryIfNeeded(c,duration);
+    latencyAddSampleIfNeeded(REDIS_LATENCY_COMMAND,duration);
+    if (server.dirty-dirty != 0 &&
+        (listLength(server.slaves) || server.repl_backlog))
         replicationFeedSlaves(server.slaves,cmd,c->db->id,c->argv,c->argc);
     if (listLength(server.monitors))
         replicationFeedSlaves(server.monitors,cmd,c->db->id,c->argv,c->argc);
+    if (listLength(server.capturemonitors))
+        captureFeedMonitors(c,cmd,start);
     server.stat_numcommands++;
 
     /* Prepare the client for the next command */
@@ -1344,73 +1807,179 @@ static int processCommand(redisClient *c) {
     return 1;
 }
 
-static void replicationFeedSlaves(list *slaves, struct redisCommand *cmd, int dictid, robj **argv, int argc) {
-    listNode *ln;
-    int outc = 0, j;
-    robj **outv;
-    /* (args*2)+1 is enough room for args, spaces, newlines */
-    robj *static_outv[REDIS_STATIC_ARGS*2+1];
+/* Return the SELECT command to emit in a replication stream in order to
+ * switch to DB 'dictid'. The returned object has a zero refcount if it is
+ * not a shared one, the caller must increment it before to use it. */
+static robj *getSelectCommandObject(int dictid) {
+    robj *selectcmd;
+
+    switch(dictid) {
+    case 0: selectcmd = shared.select0; break;
+    case 1: selectcmd = shared.select1; break;
+    case 2: selectcmd = shared.select2; break;
+    case 3: selectcmd = shared.select3; break;
+    case 4: selectcmd = shared.select4; break;
+    case 5: selectcmd = shared.select5; break;
+    case 6: selectcmd = shared.select6; break;
+    case 7: selectcmd = shared.select7; break;
+    case 8: selectcmd = shared.select8; break;
+    case 9: selectcmd = shared.select9; break;
+    default:
+        selectcmd = createObject(REDIS_STRING,
+            sdscatprintf(sdsempty(),"select %d\r\n",dictid));
+        selectcmd->refcount = 0;
+        break;
+    }
+    return selectcmd;
+}
 
-    if (argc <= REDIS_STATIC_ARGS) {
-        outv = static_outv;
-    } else {
-        outv = zmalloc(sizeof(robj*)*(argc*2+1));
-        if (!outv) oom("replicationFeedSlaves");
+/* Serialize a command in the protocol used by the replication stream. The
+ * command is encoded just once in a single object that is then referenced
+ * by the output queue of every slave and monitor. If 'selectcmd' is not NULL
+ * the SELECT is emitted in the same buffer before the command. */
+static robj *createReplicationCommand(struct redisCommand *cmd, robj *selectcmd, robj **argv, int argc) {
+    char bulklen[32];
+    size_t len, totlen = 2, blen = 0; /* 2 for the final CRLF */
+    int j;
+    sds buf;
+    char *p;
+
+    if (selectcmd) totlen += sdslen(selectcmd->ptr);
+    for (j = 0; j < argc; j++)
+        totlen += sdslen(argv[j]->ptr) + (j != 0);
+    if (cmd->flags & REDIS_CMD_BULK) {
+        blen = snprintf(bulklen,sizeof(bulklen),"%d\r\n",
+            (int)sdslen(argv[argc-1]->ptr));
+        totlen += blen;
+    }
+    if ((buf = sdsnewlen(NULL,totlen)) == NULL) oom("createReplicationCommand");
+    p = buf;
+    if (selectcmd) {
+        len = sdslen(selectcmd->ptr);
+        memcpy(p,selectcmd->ptr,len);
+        p += len;
     }
-    
     for (j = 0; j < argc; j++) {
-        if (j != 0) outv[outc++] = shared.space;
+        if (j != 0) *p++ = ' ';
         if ((cmd->flags & REDIS_CMD_BULK) && j == argc-1) {
-            robj *lenobj;
-
-            lenobj = createObject(REDIS_STRING,
-                sdscatprintf(sdsempty(),"%d\r\n",sdslen(argv[j]->ptr)));
-            lenobj->refcount = 0;
-            outv[outc++] = lenobj;
+            memcpy(p,bulklen,blen);
+            p += blen;
         }
-        outv[outc++] = argv[j];
+        len = sdslen(argv[j]->ptr);
+        memcpy(p,argv[j]->ptr,len);
+        p += len;
     }
-    outv[outc++] = shared.crlf;
-
-    /* Increment all the refcounts at start and decrement at end in order to
-     * be sure to free objects if there is no slave in a replication state
-     * able to be feed with commands */
-    for (j = 0; j < outc; j++) incrRefCount(outv[j]);
-    listRewind(slaves);
-    while((ln = listYield(slaves))) {
-        redisClient *slave = ln->value;
+    memcpy(p,"\r\n",2);
+    return createObject(REDIS_STRING,buf);
+}
 
-        /* Don't feed slaves that are still waiting for BGSAVE to start */
-        if (slave->replstate == REDIS_REPL_WAIT_BGSAVE_START) continue;
-
-        /* Feed all the other slaves, MONITORs and so on */
-        if (slave->slaveseldb != dictid) {
-            robj *selectcmd;
-
-            switch(dictid) {
-            case 0: selectcmd = shared.select0; break;
-            case 1: selectcmd = shared.select1; break;
-            case 2: selectcmd = shared.select2; break;
-            case 3: selectcmd = shared.select3; break;
-            case 4: selectcmd = shared.select4; break;
-            case 5: selectcmd = shared.select5; break;
-            case 6: selectcmd = shared.select6; break;
-            case 7: selectcmd = shared.select7; break;
-            case 8: selectcmd = shared.select8; break;
-            case 9: selectcmd = shared.select9; break;
-            default:
-                selectcmd = createObject(REDIS_STRING,
-                    sdscatprintf(sdsempty(),"select %d\r\n",dictid));
-                selectcmd->refcount = 0;
-                break;
+static void replicationFeedSlaves(list *slaves, struct redisCommand *cmd, int dictid, robj **argv, int argc) {
+    listNode *ln;
+    robj *cmdobj, *selectcmd = NULL;
+
+    /* Real slaves share a single replication stream, the one we also
+     * accumulate into the backlog, so the DB selected in the stream is
+     * tracked globally. MONITORs instead track the selected DB one by one. */
+    if (slaves == server.slaves) {
+        if (server.slaveseldb != dictid) {
+            selectcmd = getSelectCommandObject(dictid);
+            incrRefCount(selectcmd);
+            server.slaveseldb = dictid;
+        }
+        cmdobj = createReplicationCommand(cmd,selectcmd,argv,argc);
+        if (selectcmd) decrRefCount(selectcmd);
+        if (server.repl_backlog)
+            feedReplicationBacklog(cmdobj->ptr,sdslen(cmdobj->ptr));
+        listRewind(slaves);
+        while((ln = listYield(slaves))) {
+            redisClient *slave = ln->value;
+
+            /* Don't feed slaves that are still waiting for BGSAVE to start */
+            if (slave->replstate == REDIS_REPL_WAIT_BGSAVE_START) continue;
+            addReply(slave,cmdobj);
+        }
+    } else {
+        cmdobj = createReplicationCommand(cmd,NULL,argv,argc);
+        listRewind(slaves);
+        while((ln = listYield(slaves))) {
+            redisClient *slave = ln->value;
+
+            if (slave->slaveseldb != dictid) {
+                selectcmd = getSelectCommandObject(dictid);
+                incrRefCount(selectcmd);
+                addReply(slave,selectcmd);
+                decrRefCount(selectcmd);
+                slave->slaveseldb = dictid;
             }
-            addReply(slave,selectcmd);
-            slave->slaveseldb = dictid;
+            addReply(slave,cmdobj);
         }
-        for (j = 0; j < outc; j++) addReply(slave,outv[j]);
     }
-    for (j = 0; j < outc; j++) decrRefCount(outv[j]);
-    if (outv != static_outv) zfree(outv);
+    decrRefCount(cmdobj);
+}
+
+static int captureVarintLen(unsigned long long v) {
+    int len = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        len++;
+    }
+    return len;
+}
+
+static unsigned char *captureEncodeVarint(unsigned char *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+/* Feed the MONITOR CAPTURE clients with a binary record of the command:
+ *
+ * <start time in microseconds: 8 bytes little endian>
+ * <client id: varint> <db id: varint> <flags: 1 byte> <argc: varint>
+ * argc times: <length: varint> <argument bytes>
+ *
+ * Varints are 7 bits per byte, least significant group first, the high bit
+ * set in all the bytes but the last. Bit 0 of flags is set if the last
+ * argument is a bulk. The record carries its own DB id, so it is encoded
+ * just once and the same object is queued to every capturing client. */
+static void captureFeedMonitors(redisClient *c, struct redisCommand *cmd, long long start) {
+    size_t totlen = 9;
+    unsigned char *p;
+    listNode *ln;
+    robj *record;
+    sds buf;
+    int j;
+
+    totlen += captureVarintLen(c->id)+captureVarintLen(c->db->id)+
+              captureVarintLen(c->argc);
+    for (j = 0; j < c->argc; j++) {
+        size_t len = sdslen(c->argv[j]->ptr);
+
+        totlen += captureVarintLen(len)+len;
+    }
+    if ((buf = sdsnewlen(NULL,totlen)) == NULL) oom("captureFeedMonitors");
+    p = (unsigned char*) buf;
+    for (j = 0; j < 8; j++) *p++ = ((unsigned long long)start >> (j*8)) & 0xff;
+    p = captureEncodeVarint(p,c->id);
+    p = captureEncodeVarint(p,c->db->id);
+    *p++ = (cmd->flags & REDIS_CMD_BULK) ? 1 : 0;
+    p = captureEncodeVarint(p,c->argc);
+    for (j = 0; j < c->argc; j++) {
+        size_t len = sdslen(c->argv[j]->ptr);
+
+        p = captureEncodeVarint(p,len);
+        memcpy(p,c->argv[j]->ptr,len);
+        p += len;
+    }
+    record = createObject(REDIS_STRING,buf);
+    listRewind(server.capturemonitors);
+    while((ln = listYield(server.capturemonitors)))
+        addReply(ln->value,record);
+    decrRefCount(record);
 }
 
 static void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -1444,51 +2013,32 @@ static void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mas
 again:
     if (c->bulklen == -1) {
         /* Read the first line of the query */
-        char *p = strchr(c->querybuf,'\n');
         size_t querylen;
+        sds *argv;
+        int argc, j;
 
-        if (p) {
-            sds query, *argv;
-            int argc, j;
-            
-            query = c->querybuf;
-            c->querybuf = sdsempty();
-            querylen = 1+(p-(query));
-            if (sdslen(query) > querylen) {
-                /* leave data after the first line of the query in the buffer */
-                c->querybuf = sdscatlen(c->querybuf,query+querylen,sdslen(query)-querylen);
-            }
-            *p = '\0'; /* remove "\n" */
-            if (*(p-1) == '\r') *(p-1) = '\0'; /* and "\r" if any */
-            sdsupdatelen(query);
-
-            /* Now we can split the query in arguments */
-            if (sdslen(query) == 0) {
+        querylen = protocolReadInlineQuery(&c->querybuf,&argv,&argc);
+        if (querylen) {
+            if (argc == -1) oom("sdssplitlen");
+            if (argc == 0) {
                 /* Ignore empty query */
-                sdsfree(query);
+                if (c->flags & REDIS_MASTER)
+                    server.repl_master_offset += querylen;
+                if (sdslen(c->querybuf)) goto again;
                 return;
             }
-            argv = sdssplitlen(query,sdslen(query)," ",1,&argc);
-            if (argv == NULL) oom("sdssplitlen");
-            sdsfree(query);
-
+            c->cmdlen = querylen;
             if (c->argv) zfree(c->argv);
             c->argv = zmalloc(sizeof(robj*)*argc);
             if (c->argv == NULL) oom("allocating arguments list for client");
 
-            for (j = 0; j < argc; j++) {
-                if (sdslen(argv[j])) {
-                    c->argv[c->argc] = createObject(REDIS_STRING,argv[j]);
-                    c->argc++;
-                } else {
-                    sdsfree(argv[j]);
-                }
-            }
+            for (j = 0; j < argc; j++)
+                c->argv[c->argc++] = createObject(REDIS_STRING,argv[j]);
             zfree(argv);
             /* Execute the command. If the client is still valid
              * after processCommand() return and there is something
              * on the query buffer try to process the next command. */
-            if (c->argc && processCommand(c) && sdslen(c->querybuf)) goto again;
+            if (processCommand(c) && sdslen(c->querybuf)) goto again;
             return;
         } else if (sdslen(c->querybuf) >= REDIS_REQUEST_MAX_SIZE) {
             redisLog(REDIS_DEBUG, "Client protocol error");
@@ -1500,14 +2050,12 @@ again:
            the client already sent a command terminated with a newline,
            we are reading the bulk data that is actually the last
            argument of the command. */
-        int qbl = sdslen(c->querybuf);
-
-        if (c->bulklen <= qbl) {
-            /* Copy everything but the final CRLF as final argument */
-            c->argv[c->argc] = createStringObject(c->querybuf,c->bulklen-2);
-            c->argc++;
-            c->querybuf = sdsrange(c->querybuf,c->bulklen,-1);
-            processCommand(c);
+        sds arg = protocolReadBulk(&c->querybuf,c->bulklen);
+
+        if (arg) {
+            c->argv[c->argc++] = createObject(REDIS_STRING,arg);
+            /* Pipelined commands may follow the bulk data */
+            if (processCommand(c) && sdslen(c->querybuf)) goto again;
             return;
         }
     }
@@ -1520,11 +2068,6 @@ static int selectDb(redisClient *c, int id) {
     return REDIS_OK;
 }
 
-static void *dupClientReplyValue(void *o) {
-    incrRefCount((robj*)o);
-    return 0;
-}
-
 static redisClient *createClient(int fd) {
     redisClient *c = zmalloc(sizeof(*c));
 
@@ -1533,10 +2076,12 @@ static redisClient *createClient(int fd) {
     if (!c) return NULL;
     selectDb(c,0);
     c->fd = fd;
+    c->id = server.nextclientid++;
     c->querybuf = sdsempty();
     c->argc = 0;
     c->argv = NULL;
     c->bulklen = -1;
+    c->cmdlen = 0;
     c->sentlen = 0;
     c->flags = 0;
     c->lastinteraction = time(NULL);
@@ -1544,7 +2089,6 @@ static redisClient *createClient(int fd) {
     c->replstate = REDIS_REPL_NONE;
     if ((c->reply = listCreate()) == NULL) oom("listCreate");
     listSetFreeMethod(c->reply,decrRefCount);
-    listSetDupMethod(c->reply,dupClientReplyValue);
     if (aeCreateFileEvent(server.el, c->fd, AE_READABLE,
         readQueryFromClient, c, NULL) == AE_ERR) {
         freeClient(c);
@@ -1564,6 +2108,17 @@ static void addReply(redisClient *c, robj *obj) {
     incrRefCount(obj);
 }
 
+/* Add to the reply an object stored in the DB. Taking a reference writes
+ * the object header, and while a BGSAVE child is running this means the
+ * whole page gets duplicated by copy-on-write: small objects are replied
+ * using a private copy instead, that is cheaper than copying the page. */
+static void addReplyDbObject(redisClient *c, robj *obj) {
+    if (server.bgsaveinprogress && sdslen(obj->ptr) < REDIS_COW_COPY_MAXLEN)
+        addReplySds(c,sdsnewlen(obj->ptr,sdslen(obj->ptr)));
+    else
+        addReply(c,obj);
+}
+
 static void addReplySds(redisClient *c, sds s) {
     robj *o = createObject(REDIS_STRING,s);
     addReply(c,o);
@@ -1641,6 +2196,55 @@ static robj *createSetObject(void) {
     return createObject(REDIS_SET,d);
 }
 
+/* Memory used by a string, the allocator overhead is not accounted */
+static size_t sdsAllocSize(sds s) {
+    return sizeof(struct sdshdr)+sdslen(s)+sdsavail(s)+1;
+}
+
+static size_t stringObjectSize(robj *o) {
+    return sizeof(robj)+sdsAllocSize(o->ptr);
+}
+
+/* Number of elements of a value */
+static long long objectLength(robj *o) {
+    switch(o->type) {
+    case REDIS_LIST: return listLength((list*)o->ptr);
+    case REDIS_SET:
+    case REDIS_HASH: return dictSize((dict*)o->ptr);
+    default: return 1;
+    }
+}
+
+static void dbStatsObserveElement(int type, robj *ele) {
+    server.elesize_sum[type] += sdsAllocSize(ele->ptr);
+    server.elesize_count[type]++;
+}
+
+/* The value 'o' was added to (sign 1) or removed from (sign -1) the DB.
+ * For a list or a set the size of its first element is observed. */
+static void dbStatsUpdateValue(redisDb *db, robj *o, int sign) {
+    dbTypeStats *ts = db->stats+o->type;
+
+    ts->keys += sign;
+    ts->elements += sign*objectLength(o);
+    if (o->type == REDIS_STRING) {
+        ts->bytes += sign*(long long)stringObjectSize(o);
+    } else if (sign > 0 && o->type == REDIS_LIST && listLength((list*)o->ptr)) {
+        dbStatsObserveElement(o->type,listNodeValue(listFirst((list*)o->ptr)));
+    } else if (sign > 0 && o->type == REDIS_SET && dictSize((dict*)o->ptr)) {
+        dictEntry *de = dictGetRandomKey(o->ptr);
+
+        if (de) dbStatsObserveElement(o->type,dictGetEntryKey(de));
+    }
+}
+
+/* Elements added to or removed from a list or set already in the DB.
+ * 'added' is the new element, if any. */
+static void dbStatsUpdateElements(redisDb *db, int type, long long delta, robj *added) {
+    db->stats[type].elements += delta;
+    if (added) dbStatsObserveElement(type,added);
+}
+
 static void freeStringObject(robj *o) {
     sdsfree(o->ptr);
 }
@@ -1667,6 +2271,7 @@ static void incrRefCount(robj *o) {
 
 static void decrRefCount(void *obj) {
     robj *o = obj;
+    long long start;
 
 #ifdef DEBUG_REFCOUNT
     if (o->type == REDIS_STRING)
@@ -1675,8 +2280,16 @@ static void decrRefCount(void *obj) {
     if (--(o->refcount) == 0) {
         switch(o->type) {
         case REDIS_STRING: freeStringObject(o); break;
-        case REDIS_LIST: freeListObject(o); break;
-        case REDIS_SET: freeSetObject(o); break;
+        case REDIS_LIST:
+            latencyStartMonitor(start);
+            freeListObject(o);
+            latencyEndMonitor(REDIS_LATENCY_FREE_OBJECT,start);
+            break;
+        case REDIS_SET:
+            latencyStartMonitor(start);
+            freeSetObject(o);
+            latencyEndMonitor(REDIS_LATENCY_FREE_OBJECT,start);
+            break;
         case REDIS_HASH: freeHashObject(o); break;
         default: assert(0 != 0); break;
         }
@@ -1736,11 +2349,21 @@ static robj *lookupKey(redisDb *db, robj *key) {
     return de ? dictGetEntryVal(de) : NULL;
 }
 
-static robj *lookupKeyRead(redisDb *db, robj *key) {
+/* Lookup for reading without touching the keyspace hits/misses stats,
+ * for the lookups a command does on its own like SORT BY/GET or TYPE. */
+static robj *lookupKeyReadNoStats(redisDb *db, robj *key) {
     expireIfNeeded(db,key);
     return lookupKey(db,key);
 }
 
+static robj *lookupKeyRead(redisDb *db, robj *key) {
+    robj *o = lookupKeyReadNoStats(db,key);
+
+    if (o) server.stat_keyspace_hits++;
+    else server.stat_keyspace_misses++;
+    return o;
+}
+
 static robj *lookupKeyWrite(redisDb *db, robj *key) {
     deleteIfVolatile(db,key);
     return lookupKey(db,key);
@@ -1761,71 +2384,268 @@ static int deleteKey(redisDb *db, robj *key) {
     return retval == DICT_OK;
 }
 
-/*============================ DB saving/loading ============================ */
+/*============================== Lazy free ================================= */
 
-static int rdbSaveType(FILE *fp, unsigned char type) {
-    if (fwrite(&type,1,1,fp) == 0) return -1;
-    return 0;
-}
+/* Releasing a list or set with millions of elements blocks the server for
+ * all the time needed to free every element. UNLINK, FLUSHDB ASYNC and
+ * FLUSHALL ASYNC, as well as expires and maxmemory evictions, only detach
+ * big values from the DB: the memory is released by a REDIS_BIO_LAZY_FREE
+ * background job.
+ *
+ * The job frees an object only if its refcount is 1: once detached from
+ * the DB nobody else can reach it. Objects referenced elsewhere too (shared
+ * objects, elements in a client reply) are handed back to the main thread
+ * that calls decrRefCount() on them from serverCron(). */
 
-static int rdbSaveTime(FILE *fp, time_t t) {
-    int32_t t32 = (int32_t) t;
-    if (fwrite(&t32,4,1,fp) == 0) return -1;
-    return 0;
+typedef struct lazyfreeJob {
+    robj *obj;                  /* value to release, or NULL */
+    dict *dict, *expires;       /* tables of an emptied DB, or NULL */
+} lazyfreeJob;
+
+/* Used to release a dict without calling decrRefCount() on its entries */
+static dictType lazyfreeDictType = {NULL,NULL,NULL,NULL,NULL,NULL};
+
+static void lazyfreeReleaseObject(robj *o);
+
+static void lazyfreeReleaseDict(dict *d, int releasevals) {
+    dictIterator *di = dictGetIterator(d);
+    dictEntry *de;
+
+    if (!di) oom("dictGetIterator");
+    while((de = dictNext(di)) != NULL) {
+        lazyfreeReleaseObject(dictGetEntryKey(de));
+        if (releasevals && dictGetEntryVal(de))
+            lazyfreeReleaseObject(dictGetEntryVal(de));
+    }
+    dictReleaseIterator(di);
+    d->type = &lazyfreeDictType;
+    dictRelease(d);
 }
 
-/* check rdbLoadLen() comments for more info */
-static int rdbSaveLen(FILE *fp, uint32_t len) {
-    unsigned char buf[2];
+static void lazyfreeReleaseObject(robj *o) {
+    if (*((volatile int*)&o->refcount) != 1) {
+        pthread_mutex_lock(&server.lazyfree_mutex);
+        if (!listAddNodeTail(server.lazyfree_decrs,o)) oom("listAddNodeTail");
+        pthread_mutex_unlock(&server.lazyfree_mutex);
+        return;
+    }
+    switch(o->type) {
+    case REDIS_STRING:
+        sdsfree(o->ptr);
+        break;
+    case REDIS_LIST: {
+        list *l = o->ptr;
+        listNode *ln;
 
-    if (len < (1<<6)) {
-        /* Save a 6 bit len */
-        buf[0] = (len&0xFF)|(REDIS_RDB_6BITLEN<<6);
-        if (fwrite(buf,1,1,fp) == 0) return -1;
-    } else if (len < (1<<14)) {
-        /* Save a 14 bit len */
-        buf[0] = ((len>>8)&0xFF)|(REDIS_RDB_14BITLEN<<6);
-        buf[1] = len&0xFF;
-        if (fwrite(buf,2,1,fp) == 0) return -1;
-    } else {
-        /* Save a 32 bit len */
-        buf[0] = (REDIS_RDB_32BITLEN<<6);
-        if (fwrite(buf,1,1,fp) == 0) return -1;
-        len = htonl(len);
-        if (fwrite(&len,4,1,fp) == 0) return -1;
+        for (ln = listFirst(l); ln; ln = listNextNode(ln))
+            lazyfreeReleaseObject(listNodeValue(ln));
+        listSetFreeMethod(l,NULL);
+        listRelease(l);
+        break;
+        }
+    case REDIS_SET: lazyfreeReleaseDict(o->ptr,0); break;
+    case REDIS_HASH: lazyfreeReleaseDict(o->ptr,1); break;
+    default: assert(0 != 0); break;
     }
-    return 0;
+    zfree(o); /* the objfreelist belongs to the main thread */
 }
 
-/* String objects in the form "2391" "-100" without any space and with a
- * range of values that can fit in an 8, 16 or 32 bit signed value can be
- * encoded as integers to save space */
-static int rdbTryIntegerEncoding(sds s, unsigned char *enc) {
-    long long value;
-    char *endptr, buf[32];
+/* Executed by the REDIS_BIO_LAZY_FREE thread */
+static void lazyfreeJobProc(void *arg) {
+    lazyfreeJob *job = arg;
 
-    /* Check if it's possible to encode this value as a number */
-    value = strtoll(s, &endptr, 10);
-    if (endptr[0] != '\0') return 0;
-    snprintf(buf,32,"%lld",value);
+    if (job->obj) lazyfreeReleaseObject(job->obj);
+    if (job->dict) lazyfreeReleaseDict(job->dict,1);
+    if (job->expires) lazyfreeReleaseDict(job->expires,0);
+    zfree(job);
+}
 
-    /* If the number converted back into a string is not identical
-     * then it's not possible to encode the string as integer */
-    if (strlen(buf) != sdslen(s) || memcmp(buf,s,sdslen(s))) return 0;
+static void lazyfreeInit(void) {
+    server.lazyfree_decrs = listCreate();
+    if (!server.lazyfree_decrs) oom("lazyfreeInit");
+    pthread_mutex_init(&server.lazyfree_mutex,NULL);
+}
 
-    /* Finally check if it fits in our ranges */
-    if (value >= -(1<<7) && value <= (1<<7)-1) {
-        enc[0] = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_INT8;
-        enc[1] = value&0xFF;
-        return 2;
-    } else if (value >= -(1<<15) && value <= (1<<15)-1) {
-        enc[0] = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_INT16;
-        enc[1] = value&0xFF;
-        enc[2] = (value>>8)&0xFF;
-        return 3;
-    } else if (value >= -((long long)1<<31) && value <= ((long long)1<<31)-1) {
-        enc[0] = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_INT32;
-        enc[1] = value&0xFF;
+static void lazyfreeSubmit(robj *o, dict *d, dict *expires) {
+    lazyfreeJob *job = zmalloc(sizeof(*job));
+
+    if (!job) oom("lazyfreeSubmit");
+    job->obj = o;
+    job->dict = d;
+    job->expires = expires;
+    bioCreateProcJob(REDIS_BIO_LAZY_FREE,lazyfreeJobProc,job);
+}
+
+static void lazyfreeProcessDecrs(void) {
+    list *decrs;
+
+    pthread_mutex_lock(&server.lazyfree_mutex);
+    if (listLength(server.lazyfree_decrs) == 0) {
+        pthread_mutex_unlock(&server.lazyfree_mutex);
+        return;
+    }
+    decrs = server.lazyfree_decrs;
+    server.lazyfree_decrs = listCreate();
+    if (!server.lazyfree_decrs) oom("listCreate");
+    pthread_mutex_unlock(&server.lazyfree_mutex);
+    listSetFreeMethod(decrs,decrRefCount);
+    listRelease(decrs);
+}
+
+/* Number of allocations to free to release the value */
+static unsigned long lazyfreeGetEffort(robj *o) {
+    if (o->type == REDIS_LIST)
+        return listLength((list*)o->ptr);
+    else if (o->type == REDIS_SET || o->type == REDIS_HASH)
+        return dictSize((dict*)o->ptr);
+    return 1;
+}
+
+/* Like deleteKey() but big values are released by the lazy free thread */
+static int dbAsyncDelete(redisDb *db, robj *key) {
+    dictEntry *de;
+    int retval;
+
+    incrRefCount(key); /* see deleteKey() */
+    if (dictSize(db->expires)) dictDelete(db->expires,key);
+    if ((de = dictFind(db->dict,key)) != NULL) {
+        robj *val = dictGetEntryVal(de);
+
+        if (val->refcount == 1 &&
+            lazyfreeGetEffort(val) > REDIS_LAZYFREE_THRESHOLD)
+        {
+            dbStatsUpdateValue(db,val,-1);
+            dictGetEntryVal(de) = NULL;
+            lazyfreeSubmit(val,NULL,NULL);
+        }
+    }
+    retval = dictDelete(db->dict,key);
+    decrRefCount(key);
+    return retval == DICT_OK;
+}
+
+/*============================ DB saving/loading ============================ */
+
+/* Removing a big file blocks until all its blocks are released, that
+ * happens when the last reference to the inode goes away. So the file is
+ * kept open across the unlink() or the rename() over it, and the final
+ * close() is left to a background job. The BGSAVE child has no background
+ * jobs: there blocking is harmless as the parent is serving the clients. */
+static void unlinkFileInBackground(char *filename) {
+    int fd = server.isbgsavechild ? -1 : open(filename,O_RDONLY|O_NONBLOCK);
+
+    unlink(filename);
+    if (fd != -1) bioCreateBackgroundJob(REDIS_BIO_CLOSE_FILE,(void*)(long)fd,NULL);
+}
+
+static int renameFileInBackground(char *oldpath, char *newpath) {
+    int fd = server.isbgsavechild ? -1 : open(newpath,O_RDONLY|O_NONBLOCK);
+    int retval = rename(oldpath,newpath);
+
+    if (fd != -1) {
+        if (retval == -1) {
+            int saved_errno = errno;
+
+            close(fd);
+            errno = saved_errno;
+        } else {
+            bioCreateBackgroundJob(REDIS_BIO_CLOSE_FILE,(void*)(long)fd,NULL);
+        }
+    }
+    return retval;
+}
+
+/* Write 'len' bytes to the DB file updating the checksum */
+static int rdbFlushRaw(void *p, size_t len) {
+    if (server.rdbchecksum)
+        server.rdbsavecrc = crc64(server.rdbsavecrc,p,len);
+    if (len && fwrite(p,len,1,server.rdbsavefp) == 0) return -1;
+    return 0;
+}
+
+/* Every write of the DB goes here. Writes to the DB file are accumulated in
+ * our own buffer instead of the stdio one, so that the checksum is computed
+ * on big blocks as they are flushed: summing every small write would cost
+ * more than the CRC itself. Other streams, like the memory streams used by
+ * the BGSAVE threads, are written as they are: their content is summed when
+ * appended to the DB file, so only the thread calling rdbSave() updates the
+ * checksum. */
+static int rdbWriteRaw(FILE *fp, void *p, size_t len) {
+    if (fp != server.rdbsavefp) return (fwrite(p,len,1,fp) == 0) ? -1 : 0;
+    if (server.rdbsavebufpos+len > REDIS_RDB_WRITEBUF_LEN) {
+        if (rdbFlushRaw(server.rdbsavebuf,server.rdbsavebufpos) == -1)
+            return -1;
+        server.rdbsavebufpos = 0;
+        if (len >= REDIS_RDB_WRITEBUF_LEN) return rdbFlushRaw(p,len);
+    }
+    memcpy(server.rdbsavebuf+server.rdbsavebufpos,p,len);
+    server.rdbsavebufpos += len;
+    return 0;
+}
+
+static int rdbSaveType(FILE *fp, unsigned char type) {
+    if (rdbWriteRaw(fp,&type,1) == -1) return -1;
+    return 0;
+}
+
+static int rdbSaveTime(FILE *fp, time_t t) {
+    int32_t t32 = (int32_t) t;
+    if (rdbWriteRaw(fp,&t32,4) == -1) return -1;
+    return 0;
+}
+
+/* check rdbLoadLen() comments for more info */
+static int rdbSaveLen(FILE *fp, uint32_t len) {
+    unsigned char buf[2];
+
+    if (len < (1<<6)) {
+        /* Save a 6 bit len */
+        buf[0] = (len&0xFF)|(REDIS_RDB_6BITLEN<<6);
+        if (rdbWriteRaw(fp,buf,1) == -1) return -1;
+    } else if (len < (1<<14)) {
+        /* Save a 14 bit len */
+        buf[0] = ((len>>8)&0xFF)|(REDIS_RDB_14BITLEN<<6);
+        buf[1] = len&0xFF;
+        if (rdbWriteRaw(fp,buf,2) == -1) return -1;
+    } else {
+        /* Save a 32 bit len */
+        buf[0] = (REDIS_RDB_32BITLEN<<6);
+        if (rdbWriteRaw(fp,buf,1) == -1) return -1;
+        len = htonl(len);
+        if (rdbWriteRaw(fp,&len,4) == -1) return -1;
+    }
+    return 0;
+}
+
+/* String objects in the form "2391" "-100" without any space and with a
+ * range of values that can fit in an 8, 16 or 32 bit signed value can be
+ * encoded as integers to save space */
+static int rdbTryIntegerEncoding(sds s, unsigned char *enc) {
+    long long value;
+    char *endptr, buf[32];
+
+    /* Check if it's possible to encode this value as a number */
+    value = strtoll(s, &endptr, 10);
+    if (endptr[0] != '\0') return 0;
+    snprintf(buf,32,"%lld",value);
+
+    /* If the number converted back into a string is not identical
+     * then it's not possible to encode the string as integer */
+    if (strlen(buf) != sdslen(s) || memcmp(buf,s,sdslen(s))) return 0;
+
+    /* Finally check if it fits in our ranges */
+    if (value >= -(1<<7) && value <= (1<<7)-1) {
+        enc[0] = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_INT8;
+        enc[1] = value&0xFF;
+        return 2;
+    } else if (value >= -(1<<15) && value <= (1<<15)-1) {
+        enc[0] = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_INT16;
+        enc[1] = value&0xFF;
+        enc[2] = (value>>8)&0xFF;
+        return 3;
+    } else if (value >= -((long long)1<<31) && value <= ((long long)1<<31)-1) {
+        enc[0] = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_INT32;
+        enc[1] = value&0xFF;
         enc[2] = (value>>8)&0xFF;
         enc[3] = (value>>16)&0xFF;
         enc[4] = (value>>24)&0xFF;
@@ -1835,7 +2655,22 @@ static int rdbTryIntegerEncoding(sds s, unsigned char *enc) {
     }
 }
 
-static int rdbSaveLzfStringObject(FILE *fp, robj *obj) {
+/* Returns 0 if compressing a sample of a big value with the given codec
+ * doesn't save enough space to make compressing the whole value worth it */
+static int rdbSampleCompressible(struct rdbCodec *codec, sds s) {
+    char out[REDIS_RDB_SAMPLE_LEN];
+    size_t len = sdslen(s);
+
+    if (len < REDIS_RDB_SAMPLE_MINLEN) return 1;
+    /* Take the sample in the middle, headers are often more compressible */
+    return codec->compress(s+(len-REDIS_RDB_SAMPLE_LEN)/2,
+        REDIS_RDB_SAMPLE_LEN,out,REDIS_RDB_SAMPLE_LEN/8*7) != 0;
+}
+
+/* Save the object compressed with the configured codec. Returns 0 if the
+ * object was not compressed, -1 on error, otherwise the compressed length */
+static int rdbSaveCompressedStringObject(FILE *fp, robj *obj) {
+    struct rdbCodec *codec = rdbCodecs+server.rdbcompression;
     unsigned int comprlen, outlen;
     unsigned char byte;
     void *out;
@@ -1843,18 +2678,27 @@ static int rdbSaveLzfStringObject(FILE *fp, robj *obj) {
     /* We require at least four bytes compression for this to be worth it */
     outlen = sdslen(obj->ptr)-4;
     if (outlen <= 0) return 0;
+    if (!rdbSampleCompressible(codec,obj->ptr)) return 0;
     if ((out = zmalloc(outlen+1)) == NULL) return 0;
-    comprlen = lzf_compress(obj->ptr, sdslen(obj->ptr), out, outlen);
+    comprlen = codec->compress(obj->ptr, sdslen(obj->ptr), out, outlen);
     if (comprlen == 0) {
         zfree(out);
         return 0;
     }
     /* Data compressed! Let's save it on disk */
-    byte = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_LZF;
-    if (fwrite(&byte,1,1,fp) == 0) goto writeerr;
+    if (server.rdbcompression == REDIS_RDB_CODEC_LZF ||
+        server.rdbcompression == REDIS_RDB_CODEC_LZF_FAST) {
+        byte = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_LZF;
+        if (rdbWriteRaw(fp,&byte,1) == -1) goto writeerr;
+    } else {
+        byte = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_CODEC;
+        if (rdbWriteRaw(fp,&byte,1) == -1) goto writeerr;
+        byte = server.rdbcompression;
+        if (rdbWriteRaw(fp,&byte,1) == -1) goto writeerr;
+    }
     if (rdbSaveLen(fp,comprlen) == -1) goto writeerr;
     if (rdbSaveLen(fp,sdslen(obj->ptr)) == -1) goto writeerr;
-    if (fwrite(out,comprlen,1,fp) == 0) goto writeerr;
+    if (rdbWriteRaw(fp,out,comprlen) == -1) goto writeerr;
     zfree(out);
     return comprlen;
 
@@ -1873,17 +2717,17 @@ static int rdbSaveStringObject(FILE *fp, robj *obj) {
     if (len <= 11) {
         unsigned char buf[5];
         if ((enclen = rdbTryIntegerEncoding(obj->ptr,buf)) > 0) {
-            if (fwrite(buf,enclen,1,fp) == 0) return -1;
+            if (rdbWriteRaw(fp,buf,enclen) == -1) return -1;
             return 0;
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
+    /* Try compression - under 20 bytes it's unable to compress even
      * aaaaaaaaaaaaaaaaaa so skip it */
-    if (1 && len > 20) {
+    if (server.rdbcompression != REDIS_RDB_CODEC_NONE && len > 20) {
         int retval;
 
-        retval = rdbSaveLzfStringObject(fp,obj);
+        retval = rdbSaveCompressedStringObject(fp,obj);
         if (retval == -1) return -1;
         if (retval > 0) return 0;
         /* retval == 0 means data can't be compressed, save the old way */
@@ -1891,16 +2735,255 @@ static int rdbSaveStringObject(FILE *fp, robj *obj) {
 
     /* Store verbatim */
     if (rdbSaveLen(fp,len) == -1) return -1;
-    if (len && fwrite(obj->ptr,len,1,fp) == 0) return -1;
+    if (len && rdbWriteRaw(fp,obj->ptr,len) == -1) return -1;
     return 0;
 }
 
+/* Write the SELECT DB opcode, followed by the size of the DB so that the
+ * hash tables can be created with the right size when loading */
+static int rdbSaveSelectDb(FILE *fp, redisDb *db) {
+    if (rdbSaveType(fp,REDIS_SELECTDB) == -1) return -1;
+    if (rdbSaveLen(fp,db->id) == -1) return -1;
+    if (rdbSaveType(fp,REDIS_RESIZEDB) == -1) return -1;
+    if (rdbSaveLen(fp,dictSize(db->dict)) == -1) return -1;
+    if (rdbSaveLen(fp,dictSize(db->expires)) == -1) return -1;
+    return 0;
+}
+
+/* Save a key, its value and its expire time. Keys already expired are
+ * skipped. Returns -1 on error, 0 on success */
+static int rdbSaveKeyValuePair(FILE *fp, robj *key, robj *o,
+        time_t expiretime, time_t now)
+{
+    /* Save the expire time */
+    if (expiretime != -1) {
+        /* If this key is already expired skip it */
+        if (expiretime < now) return 0;
+        if (rdbSaveType(fp,REDIS_EXPIRETIME) == -1) return -1;
+        if (rdbSaveTime(fp,expiretime) == -1) return -1;
+    }
+    /* Save the key and associated value */
+    if (rdbSaveType(fp,o->type) == -1) return -1;
+    if (rdbSaveStringObject(fp,key) == -1) return -1;
+    if (o->type == REDIS_STRING) {
+        /* Save a string value */
+        if (rdbSaveStringObject(fp,o) == -1) return -1;
+    } else if (o->type == REDIS_LIST) {
+        /* Save a list value */
+        list *list = o->ptr;
+        listNode *ln;
+
+        listRewind(list);
+        if (rdbSaveLen(fp,listLength(list)) == -1) return -1;
+        while((ln = listYield(list))) {
+            robj *eleobj = listNodeValue(ln);
+
+            if (rdbSaveStringObject(fp,eleobj) == -1) return -1;
+        }
+    } else if (o->type == REDIS_SET) {
+        /* Save a set value */
+        dict *set = o->ptr;
+        dictIterator *di = dictGetIterator(set);
+        dictEntry *de;
+
+        if (!di) oom("dictGetIterator");
+        if (rdbSaveLen(fp,dictSize(set)) == -1) {
+            dictReleaseIterator(di);
+            return -1;
+        }
+        while((de = dictNext(di)) != NULL) {
+            robj *eleobj = dictGetEntryKey(de);
+
+            if (rdbSaveStringObject(fp,eleobj) == -1) {
+                dictReleaseIterator(di);
+                return -1;
+            }
+        }
+        dictReleaseIterator(di);
+    } else {
+        assert(0 != 0);
+    }
+    return 0;
+}
+
+/* ------------------------ Multi threaded RDB save -------------------------
+ *
+ * The BGSAVE child can split the keyspace into jobs of REDIS_RDB_JOB_KEYS
+ * keys, in DB and hash table order. A pool of threads serializes and
+ * compresses every job in memory, while the main thread of the child writes
+ * the jobs to the file in the same order they were created: the resulting
+ * file is exactly the same the single threaded code would produce.
+ *
+ * The dataset is never modified in the child, so the threads can read it
+ * without locks. */
+
+typedef struct rdbSaveJob {
+    redisDb *db;
+    int selectdb;           /* write the SELECT DB opcode before the keys */
+    dictEntry *de[REDIS_RDB_JOB_KEYS];
+    int numkeys;
+    char *buf;              /* serialized keys, allocated by open_memstream() */
+    size_t len;
+    int done;               /* serialized by a worker, ready to be written */
+    int err;
+} rdbSaveJob;
+
+typedef struct rdbSavePool {
+    pthread_mutex_t lock;
+    pthread_cond_t workcond;    /* a new job was queued, or no more jobs */
+    pthread_cond_t donecond;    /* a job was serialized */
+    rdbSaveJob *jobs;           /* ring of jobs, used in creation order */
+    int numjobs;
+    long long queued, taken, written;
+    int finished;               /* all the jobs were queued */
+    time_t now;
+} rdbSavePool;
+
+static int rdbSaveJobKeys(rdbSaveJob *job, time_t now) {
+    FILE *fp = open_memstream(&job->buf,&job->len);
+    int j;
+
+    if (fp == NULL) return -1;
+    for (j = 0; j < job->numkeys; j++) {
+        robj *key = dictGetEntryKey(job->de[j]);
+
+        if (rdbSaveKeyValuePair(fp,key,dictGetEntryVal(job->de[j]),
+                getExpire(job->db,key),now) == -1) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    return (fclose(fp) == EOF) ? -1 : 0;
+}
+
+static void *rdbSaveThread(void *arg) {
+    rdbSavePool *pool = arg;
+
+    while(1) {
+        rdbSaveJob *job;
+
+        pthread_mutex_lock(&pool->lock);
+        while(pool->taken == pool->queued && !pool->finished)
+            pthread_cond_wait(&pool->workcond,&pool->lock);
+        if (pool->taken == pool->queued) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        job = pool->jobs+(pool->taken++ % pool->numjobs);
+        pthread_mutex_unlock(&pool->lock);
+
+        job->err = rdbSaveJobKeys(job,pool->now);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_signal(&pool->donecond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Wait for the oldest job not yet written to be serialized, and write it.
+ * The buffer is released with free() since open_memstream() allocated it. */
+static int rdbSaveWriteJob(rdbSavePool *pool, FILE *fp) {
+    rdbSaveJob *job = pool->jobs+(pool->written % pool->numjobs);
+    int retval = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while(!job->done) pthread_cond_wait(&pool->donecond,&pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (job->err ||
+        (job->selectdb && rdbSaveSelectDb(fp,job->db) == -1) ||
+        (job->len && rdbWriteRaw(fp,job->buf,job->len) == -1)) retval = -1;
+    free(job->buf);
+    job->buf = NULL;
+    job->done = 0;
+    pool->written++;
+    return retval;
+}
+
+static int rdbSaveThreaded(FILE *fp, time_t now) {
+    rdbSavePool pool;
+    pthread_t threads[REDIS_RDB_MAX_THREADS];
+    int numthreads = 0, j, retval = 0;
+
+    pthread_mutex_init(&pool.lock,NULL);
+    pthread_cond_init(&pool.workcond,NULL);
+    pthread_cond_init(&pool.donecond,NULL);
+    pool.numjobs = server.rdbsavethreads*2;
+    pool.jobs = zmalloc(sizeof(rdbSaveJob)*pool.numjobs);
+    if (!pool.jobs) oom("rdbSaveThreaded");
+    memset(pool.jobs,0,sizeof(rdbSaveJob)*pool.numjobs);
+    pool.queued = pool.taken = pool.written = 0;
+    pool.finished = 0;
+    pool.now = now;
+    for (j = 0; j < server.rdbsavethreads; j++) {
+        if (pthread_create(threads+numthreads,NULL,rdbSaveThread,&pool) != 0)
+            break;
+        numthreads++;
+    }
+    if (numthreads == 0) {
+        redisLog(REDIS_WARNING,"Can't create the RDB save threads");
+        retval = -1;
+        goto cleanup;
+    }
+    redisLog(REDIS_NOTICE,"Saving the DB with %d threads",numthreads);
+
+    for (j = 0; j < server.dbnum && retval == 0; j++) {
+        redisDb *db = server.db+j;
+        dictIterator *di;
+        dictEntry *de;
+        rdbSaveJob *job = NULL;
+        int selectdb = 1;
+
+        if (dictSize(db->dict) == 0) continue;
+        if ((di = dictGetIterator(db->dict)) == NULL) oom("dictGetIterator");
+        while(retval == 0) {
+            de = dictNext(di);
+            if (de && job == NULL) {
+                /* Make room in the ring writing the oldest job */
+                if (pool.queued - pool.written == pool.numjobs &&
+                    rdbSaveWriteJob(&pool,fp) == -1) retval = -1;
+                job = pool.jobs+(pool.queued % pool.numjobs);
+                job->db = db;
+                job->selectdb = selectdb;
+                job->numkeys = 0;
+                selectdb = 0;
+            }
+            if (de) job->de[job->numkeys++] = de;
+            if (job && (!de || job->numkeys == REDIS_RDB_JOB_KEYS)) {
+                pthread_mutex_lock(&pool.lock);
+                pool.queued++;
+                pthread_cond_signal(&pool.workcond);
+                pthread_mutex_unlock(&pool.lock);
+                job = NULL;
+            }
+            if (!de) break;
+        }
+        dictReleaseIterator(di);
+    }
+    while(pool.written < pool.queued)
+        if (rdbSaveWriteJob(&pool,fp) == -1) retval = -1;
+
+cleanup:
+    pthread_mutex_lock(&pool.lock);
+    pool.finished = 1;
+    pthread_cond_broadcast(&pool.workcond);
+    pthread_mutex_unlock(&pool.lock);
+    for (j = 0; j < numthreads; j++) pthread_join(threads[j],NULL);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.workcond);
+    pthread_cond_destroy(&pool.donecond);
+    zfree(pool.jobs);
+    return retval;
+}
+
 /* Save the DB on disk. Return REDIS_ERR on error, REDIS_OK on success */
 static int rdbSave(char *filename) {
     dictIterator *di = NULL;
     dictEntry *de;
     FILE *fp;
-    char tmpfile[256];
+    char tmpfile[256], magic[10];
+    unsigned char crc[REDIS_RDB_CRC_LEN];
     int j;
     time_t now = time(NULL);
 
@@ -1910,75 +2993,51 @@ static int rdbSave(char *filename) {
         redisLog(REDIS_WARNING, "Failed saving the DB: %s", strerror(errno));
         return REDIS_ERR;
     }
-    if (fwrite("REDIS0001",9,1,fp) == 0) goto werr;
-    for (j = 0; j < server.dbnum; j++) {
-        redisDb *db = server.db+j;
-        dict *d = db->dict;
-        if (dictSize(d) == 0) continue;
-        di = dictGetIterator(d);
-        if (!di) {
-            fclose(fp);
-            return REDIS_ERR;
-        }
+    /* We buffer the writes ourselves, see rdbWriteRaw() */
+    setvbuf(fp,NULL,_IONBF,0);
+    if ((server.rdbsavebuf = zmalloc(REDIS_RDB_WRITEBUF_LEN)) == NULL)
+        oom("rdbSave");
+    server.rdbsavebufpos = 0;
+    server.rdbsavefp = fp;
+    server.rdbsavecrc = 0;
+    snprintf(magic,sizeof(magic),"REDIS%04d",REDIS_RDB_VERSION);
+    if (rdbWriteRaw(fp,magic,9) == -1) goto werr;
+    if (server.isbgsavechild && server.rdbsavethreads > 1) {
+        /* The BGSAVE child can use more threads to serialize and compress
+         * the keys. Only the child: zmalloc() stats are not thread safe. */
+        if (rdbSaveThreaded(fp,now) == -1) goto werr;
+    } else {
+        for (j = 0; j < server.dbnum; j++) {
+            redisDb *db = server.db+j;
+            dict *d = db->dict;
+            if (dictSize(d) == 0) continue;
+            di = dictGetIterator(d);
+            if (!di) goto werr;
 
-        /* Write the SELECT DB opcode */
-        if (rdbSaveType(fp,REDIS_SELECTDB) == -1) goto werr;
-        if (rdbSaveLen(fp,j) == -1) goto werr;
+            if (rdbSaveSelectDb(fp,db) == -1) goto werr;
 
-        /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
-            robj *key = dictGetEntryKey(de);
-            robj *o = dictGetEntryVal(de);
-            time_t expiretime = getExpire(db,key);
-
-            /* Save the expire time */
-            if (expiretime != -1) {
-                /* If this key is already expired skip it */
-                if (expiretime < now) continue;
-                if (rdbSaveType(fp,REDIS_EXPIRETIME) == -1) goto werr;
-                if (rdbSaveTime(fp,expiretime) == -1) goto werr;
-            }
-            /* Save the key and associated value */
-            if (rdbSaveType(fp,o->type) == -1) goto werr;
-            if (rdbSaveStringObject(fp,key) == -1) goto werr;
-            if (o->type == REDIS_STRING) {
-                /* Save a string value */
-                if (rdbSaveStringObject(fp,o) == -1) goto werr;
-            } else if (o->type == REDIS_LIST) {
-                /* Save a list value */
-                list *list = o->ptr;
-                listNode *ln;
-
-                listRewind(list);
-                if (rdbSaveLen(fp,listLength(list)) == -1) goto werr;
-                while((ln = listYield(list))) {
-                    robj *eleobj = listNodeValue(ln);
-
-                    if (rdbSaveStringObject(fp,eleobj) == -1) goto werr;
-                }
-            } else if (o->type == REDIS_SET) {
-                /* Save a set value */
-                dict *set = o->ptr;
-                dictIterator *di = dictGetIterator(set);
-                dictEntry *de;
+            /* Iterate this DB writing every entry */
+            while((de = dictNext(di)) != NULL) {
+                robj *key = dictGetEntryKey(de);
 
-                if (!set) oom("dictGetIteraotr");
-                if (rdbSaveLen(fp,dictSize(set)) == -1) goto werr;
-                while((de = dictNext(di)) != NULL) {
-                    robj *eleobj = dictGetEntryKey(de);
-
-                    if (rdbSaveStringObject(fp,eleobj) == -1) goto werr;
-                }
-                dictReleaseIterator(di);
-            } else {
-                assert(0 != 0);
+                if (rdbSaveKeyValuePair(fp,key,dictGetEntryVal(de),
+                        getExpire(db,key),now) == -1) goto werr;
             }
+            dictReleaseIterator(di);
+            di = NULL;
         }
-        dictReleaseIterator(di);
     }
     /* EOF opcode */
     if (rdbSaveType(fp,REDIS_EOF) == -1) goto werr;
 
+    /* CRC64 trailer, not part of the checksum itself */
+    if (rdbFlushRaw(server.rdbsavebuf,server.rdbsavebufpos) == -1) goto werr;
+    for (j = 0; j < REDIS_RDB_CRC_LEN; j++)
+        crc[j] = server.rdbchecksum ? (server.rdbsavecrc >> (j*8)) & 0xff : 0;
+    if (fwrite(crc,REDIS_RDB_CRC_LEN,1,fp) == 0) goto werr;
+    server.rdbsavefp = NULL;
+    zfree(server.rdbsavebuf);
+
     /* Make sure data will not remain on the OS's output buffers */
     fflush(fp);
     fsync(fileno(fp));
@@ -1986,9 +3045,9 @@ static int rdbSave(char *filename) {
     
     /* Use RENAME to make sure the DB file is changed atomically only
      * if the generate DB file is ok. */
-    if (rename(tmpfile,filename) == -1) {
+    if (renameFileInBackground(tmpfile,filename) == -1) {
         redisLog(REDIS_WARNING,"Error moving temp DB file on the final destionation: %s", strerror(errno));
-        unlink(tmpfile);
+        unlinkFileInBackground(tmpfile);
         return REDIS_ERR;
     }
     redisLog(REDIS_NOTICE,"DB saved on disk");
@@ -1997,35 +3056,115 @@ static int rdbSave(char *filename) {
     return REDIS_OK;
 
 werr:
+    server.rdbsavefp = NULL;
+    zfree(server.rdbsavebuf);
     fclose(fp);
-    unlink(tmpfile);
+    unlinkFileInBackground(tmpfile);
     redisLog(REDIS_WARNING,"Write error saving DB on disk: %s", strerror(errno));
     if (di) dictReleaseIterator(di);
     return REDIS_ERR;
 }
 
+/* Return the amount of memory of the process that is not shared anymore
+ * with the parent or the child after a fork(), that is what copy-on-write
+ * duplicated. Only available on Linux, 0 is returned elsewhere. */
+static size_t getPrivateDirtyMemory(void) {
+#ifdef __linux__
+    char line[256];
+    size_t total = 0;
+    FILE *fp = fopen("/proc/self/smaps","r");
+
+    if (!fp) return 0;
+    while(fgets(line,sizeof(line),fp) != NULL) {
+        if (strncmp(line,"Private_Dirty:",14) == 0)
+            total += strtoul(line+14,NULL,10)*1024;
+    }
+    fclose(fp);
+    return total;
+#else
+    return 0;
+#endif
+}
+
+/* Called by the BGSAVE child when the DB was saved: the memory it had to
+ * copy because of the writes of the parent is sent to the parent using
+ * the child info pipe. */
+static void rdbSendChildInfo(void) {
+    size_t cow = getPrivateDirtyMemory();
+
+    if (cow) {
+        redisLog(REDIS_NOTICE,"RDB: %zu MB of memory used by copy-on-write",
+            cow/(1024*1024));
+    }
+    if (write(server.childinfopipe[1],&cow,sizeof(cow)) != sizeof(cow)) {
+        /* Nothing to do, the parent will just not update the stat */
+    }
+}
+
+/* Read what the child sent, if anything, and close the pipe */
+static void rdbReceiveChildInfo(void) {
+    if (server.childinfopipe[0] == -1) return;
+    /* Writes of a few bytes to a pipe are atomic, there are no short reads */
+    if (read(server.childinfopipe[0],&server.stat_rdb_cow_bytes,
+        sizeof(server.stat_rdb_cow_bytes)) == -1)
+    {
+        /* No info from the child, keep the old value */
+    }
+    close(server.childinfopipe[0]);
+    server.childinfopipe[0] = -1;
+}
+
+/* Resizing a hash table moves all its entries: while there is a child
+ * saving the DB this would duplicate a lot of pages, so it's allowed only
+ * when the table is really too small, see dictDisableResize(). */
+static void updateDictResizePolicy(void) {
+    if (server.bgsaveinprogress)
+        dictDisableResize();
+    else
+        dictEnableResize();
+}
+
 static int rdbSaveBackground(char *filename) {
     pid_t childpid;
+    long long start;
 
     if (server.bgsaveinprogress) return REDIS_ERR;
+    if (pipe(server.childinfopipe) == -1) {
+        server.childinfopipe[0] = server.childinfopipe[1] = -1;
+    } else {
+        anetNonBlock(NULL,server.childinfopipe[0]);
+    }
+    start = ustime();
     if ((childpid = fork()) == 0) {
         /* Child */
         close(server.fd);
+        if (server.childinfopipe[0] != -1) close(server.childinfopipe[0]);
+        server.isbgsavechild = 1;
         if (rdbSave(filename) == REDIS_OK) {
+            if (server.childinfopipe[1] != -1) rdbSendChildInfo();
             exit(0);
         } else {
             exit(1);
         }
     } else {
         /* Parent */
+        server.stat_fork_time = ustime()-start;
+        latencyAddSampleIfNeeded(REDIS_LATENCY_FORK,server.stat_fork_time);
+        if (server.childinfopipe[1] != -1) {
+            close(server.childinfopipe[1]);
+            server.childinfopipe[1] = -1;
+        }
         if (childpid == -1) {
             redisLog(REDIS_WARNING,"Can't save in background: fork: %s",
                 strerror(errno));
+            rdbReceiveChildInfo();
             return REDIS_ERR;
         }
-        redisLog(REDIS_NOTICE,"Background saving started by pid %d",childpid);
+        redisLog(REDIS_NOTICE,"Background saving started by pid %d (fork took %lld microseconds)",
+            childpid, server.stat_fork_time);
         server.bgsaveinprogress = 1;
         server.bgsavechildpid = childpid;
+        updateDictResizePolicy();
         return REDIS_OK;
     }
     return REDIS_OK; /* unreached */
@@ -2035,18 +3174,94 @@ static void rdbRemoveTempFile(pid_t childpid) {
     char tmpfile[256];
 
     snprintf(tmpfile,256,"temp-%d.rdb", (int) childpid);
-    unlink(tmpfile);
+    unlinkFileInBackground(tmpfile);
+}
+
+/* Read 'len' bytes from the RDB input. Like fread() returns 0 on short read
+ * or error, otherwise the number of bytes read. */
+static size_t rdbRead(rdbInput *rdb, void *p, size_t len) {
+    char *dst = p;
+    size_t left = len;
+
+    while(left) {
+        size_t avail = rdb->buflen - rdb->bufpos;
+
+        if (avail == 0) {
+            /* Big values are read from the file without copying them */
+            if (rdb->fp && left >= REDIS_RDB_READBUF_LEN) {
+                if (fread(dst,left,1,rdb->fp) == 0) return 0;
+                break;
+            }
+            if (rdbFillBuffer(rdb) == REDIS_ERR) return 0;
+            continue;
+        }
+        if (avail > left) avail = left;
+        memcpy(dst,rdb->buf+rdb->bufpos,avail);
+        rdb->bufpos += avail;
+        dst += avail;
+        left -= avail;
+    }
+    rdb->crc = crc64(rdb->crc,p,len);
+    rdb->processed += len;
+    return len;
+}
+
+/* Refill the buffer of an RDB input. Files are read in big chunks instead
+ * of using many small fread() calls.
+ *
+ * From the master socket we never read past the end of the payload: what
+ * follows is the replication stream. While waiting for data the event loop
+ * is served, so that clients can still get INFO and PING replies. */
+static int rdbFillBuffer(rdbInput *rdb) {
+    time_t lastio = time(NULL);
+
+    if (rdb->fp) {
+        size_t nread = fread(rdb->buf,1,REDIS_RDB_READBUF_LEN,rdb->fp);
+
+        if (nread == 0) return REDIS_ERR;
+        rdb->bufpos = 0;
+        rdb->buflen = nread;
+        return REDIS_OK;
+    }
+    if (rdb->left == 0) return REDIS_ERR;
+    while(1) {
+        ssize_t toread, nread;
+
+        if (aeWait(rdb->fd,AE_READABLE,100) & AE_READABLE) {
+            toread = (rdb->left < REDIS_REPL_TRANSFER_BUFLEN) ?
+                     rdb->left : REDIS_REPL_TRANSFER_BUFLEN;
+            nread = read(rdb->fd,rdb->buf,toread);
+            if (nread == 0) {
+                redisLog(REDIS_WARNING,"MASTER closed the connection during the transfer");
+                return REDIS_ERR;
+            } else if (nread == -1 && errno != EAGAIN) {
+                redisLog(REDIS_WARNING,"I/O error reading the DB from MASTER: %s",
+                    strerror(errno));
+                return REDIS_ERR;
+            } else if (nread > 0) {
+                rdb->bufpos = 0;
+                rdb->buflen = nread;
+                rdb->left -= nread;
+                return REDIS_OK;
+            }
+        }
+        if (time(NULL)-lastio > server.repl_timeout) {
+            redisLog(REDIS_WARNING,"Timeout receiving the DB from MASTER");
+            return REDIS_ERR;
+        }
+        if (server.loading) processEventsWhileLoading();
+    }
 }
 
-static int rdbLoadType(FILE *fp) {
+static int rdbLoadType(rdbInput *rdb) {
     unsigned char type;
-    if (fread(&type,1,1,fp) == 0) return -1;
+    if (rdbRead(rdb,&type,1) == 0) return -1;
     return type;
 }
 
-static time_t rdbLoadTime(FILE *fp) {
+static time_t rdbLoadTime(rdbInput *rdb) {
     int32_t t32;
-    if (fread(&t32,4,1,fp) == 0) return -1;
+    if (rdbRead(rdb,&t32,4) == 0) return -1;
     return (time_t) t32;
 }
 
@@ -2055,18 +3270,18 @@ static time_t rdbLoadTime(FILE *fp) {
  *
  * isencoded is set to 1 if the readed length is not actually a length but
  * an "encoding type", check the above comments for more info */
-static uint32_t rdbLoadLen(FILE *fp, int rdbver, int *isencoded) {
+static uint32_t rdbLoadLen(rdbInput *rdb, int rdbver, int *isencoded) {
     unsigned char buf[2];
     uint32_t len;
 
     if (isencoded) *isencoded = 0;
     if (rdbver == 0) {
-        if (fread(&len,4,1,fp) == 0) return REDIS_RDB_LENERR;
+        if (rdbRead(rdb,&len,4) == 0) return REDIS_RDB_LENERR;
         return ntohl(len);
     } else {
         int type;
 
-        if (fread(buf,1,1,fp) == 0) return REDIS_RDB_LENERR;
+        if (rdbRead(rdb,buf,1) == 0) return REDIS_RDB_LENERR;
         type = (buf[0]&0xC0)>>6;
         if (type == REDIS_RDB_6BITLEN) {
             /* Read a 6 bit len */
@@ -2077,31 +3292,31 @@ static uint32_t rdbLoadLen(FILE *fp, int rdbver, int *isencoded) {
             return buf[0]&0x3F;
         } else if (type == REDIS_RDB_14BITLEN) {
             /* Read a 14 bit len */
-            if (fread(buf+1,1,1,fp) == 0) return REDIS_RDB_LENERR;
+            if (rdbRead(rdb,buf+1,1) == 0) return REDIS_RDB_LENERR;
             return ((buf[0]&0x3F)<<8)|buf[1];
         } else {
             /* Read a 32 bit len */
-            if (fread(&len,4,1,fp) == 0) return REDIS_RDB_LENERR;
+            if (rdbRead(rdb,&len,4) == 0) return REDIS_RDB_LENERR;
             return ntohl(len);
         }
     }
 }
 
-static robj *rdbLoadIntegerObject(FILE *fp, int enctype) {
+static robj *rdbLoadIntegerObject(rdbInput *rdb, int enctype) {
     unsigned char enc[4];
     long long val;
 
     if (enctype == REDIS_RDB_ENC_INT8) {
-        if (fread(enc,1,1,fp) == 0) return NULL;
+        if (rdbRead(rdb,enc,1) == 0) return NULL;
         val = (signed char)enc[0];
     } else if (enctype == REDIS_RDB_ENC_INT16) {
         uint16_t v;
-        if (fread(enc,2,1,fp) == 0) return NULL;
+        if (rdbRead(rdb,enc,2) == 0) return NULL;
         v = enc[0]|(enc[1]<<8);
         val = (int16_t)v;
     } else if (enctype == REDIS_RDB_ENC_INT32) {
         uint32_t v;
-        if (fread(enc,4,1,fp) == 0) return NULL;
+        if (rdbRead(rdb,enc,4) == 0) return NULL;
         v = enc[0]|(enc[1]<<8)|(enc[2]<<16)|(enc[3]<<24);
         val = (int32_t)v;
     } else {
@@ -2111,17 +3326,30 @@ static robj *rdbLoadIntegerObject(FILE *fp, int enctype) {
     return createObject(REDIS_STRING,sdscatprintf(sdsempty(),"%lld",val));
 }
 
-static robj *rdbLoadLzfStringObject(FILE*fp, int rdbver) {
+static robj *rdbLoadCompressedStringObject(rdbInput *rdb, int rdbver,
+        int codec)
+{
     unsigned int len, clen;
     unsigned char *c = NULL;
     sds val = NULL;
 
-    if ((clen = rdbLoadLen(fp,rdbver,NULL)) == REDIS_RDB_LENERR) return NULL;
-    if ((len = rdbLoadLen(fp,rdbver,NULL)) == REDIS_RDB_LENERR) return NULL;
+    if (codec == REDIS_RDB_CODEC_NONE) {
+        /* REDIS_RDB_ENC_CODEC: the codec ID follows */
+        unsigned char id;
+
+        if (rdbRead(rdb,&id,1) == 0) return NULL;
+        if (id >= sizeof(rdbCodecs)/sizeof(rdbCodecs[0])-1) {
+            redisLog(REDIS_WARNING,"Unknown compression codec %d in the DB",id);
+            return NULL;
+        }
+        codec = id;
+    }
+    if ((clen = rdbLoadLen(rdb,rdbver,NULL)) == REDIS_RDB_LENERR) return NULL;
+    if ((len = rdbLoadLen(rdb,rdbver,NULL)) == REDIS_RDB_LENERR) return NULL;
     if ((c = zmalloc(clen)) == NULL) goto err;
     if ((val = sdsnewlen(NULL,len)) == NULL) goto err;
-    if (fread(c,clen,1,fp) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) goto err;
+    if (rdbRead(rdb,c,clen) == 0) goto err;
+    if (rdbCodecs[codec].decompress(c,clen,val,len) != len) goto err;
     zfree(c);
     return createObject(REDIS_STRING,val);
 err:
@@ -2130,20 +3358,24 @@ err:
     return NULL;
 }
 
-static robj *rdbLoadStringObject(FILE*fp, int rdbver) {
+static robj *rdbLoadStringObject(rdbInput *rdb, int rdbver) {
     int isencoded;
     uint32_t len;
     sds val;
 
-    len = rdbLoadLen(fp,rdbver,&isencoded);
+    len = rdbLoadLen(rdb,rdbver,&isencoded);
     if (isencoded) {
         switch(len) {
         case REDIS_RDB_ENC_INT8:
         case REDIS_RDB_ENC_INT16:
         case REDIS_RDB_ENC_INT32:
-            return tryObjectSharing(rdbLoadIntegerObject(fp,len));
+            return tryObjectSharing(rdbLoadIntegerObject(rdb,len));
         case REDIS_RDB_ENC_LZF:
-            return tryObjectSharing(rdbLoadLzfStringObject(fp,rdbver));
+            return tryObjectSharing(rdbLoadCompressedStringObject(rdb,rdbver,
+                REDIS_RDB_CODEC_LZF));
+        case REDIS_RDB_ENC_CODEC:
+            return tryObjectSharing(rdbLoadCompressedStringObject(rdb,rdbver,
+                REDIS_RDB_CODEC_NONE));
         default:
             assert(0!=0);
         }
@@ -2151,15 +3383,36 @@ static robj *rdbLoadStringObject(FILE*fp, int rdbver) {
 
     if (len == REDIS_RDB_LENERR) return NULL;
     val = sdsnewlen(NULL,len);
-    if (len && fread(val,len,1,fp) == 0) {
+    if (len && rdbRead(rdb,val,len) == 0) {
         sdsfree(val);
         return NULL;
     }
     return tryObjectSharing(createObject(REDIS_STRING,val));
 }
 
-static int rdbLoad(char *filename) {
-    FILE *fp;
+/* Log the loading progress every REDIS_LOADING_REPORT_PERIOD seconds, and
+ * the final throughput once the load is complete. */
+static void rdbLoadProgress(rdbInput *rdb, int done) {
+    time_t now = time(NULL);
+    double elapsed, mb = (double)rdb->processed/(1024*1024);
+
+    if (!done && now - rdb->lastreport < REDIS_LOADING_REPORT_PERIOD) return;
+    rdb->lastreport = now;
+    elapsed = (double)(ustime()-rdb->start)/1000000;
+    if (done) {
+        redisLog(REDIS_NOTICE,"DB loaded: %lld keys, %.2f MB in %.3f seconds (%.2f MB/s)",
+            rdb->keys, mb, elapsed, elapsed ? mb/elapsed : 0);
+    } else {
+        redisLog(REDIS_NOTICE,"Loading DB: %lld keys, %.2f MB%s%.0f%s (%.2f MB/s)",
+            rdb->keys, mb, rdb->size ? " of " : "",
+            rdb->size ? (double)rdb->size/(1024*1024) : 0,
+            rdb->size ? " MB" : "", elapsed ? mb/elapsed : 0);
+    }
+}
+
+/* Load the dataset from an RDB input. Returns REDIS_ERR on a short read or
+ * a wrong header, the caller decides if this is a fatal condition. */
+static int rdbLoadInput(rdbInput *rdb) {
     robj *keyobj = NULL;
     uint32_t dbid;
     int type, retval, rdbver;
@@ -2167,36 +3420,43 @@ static int rdbLoad(char *filename) {
     redisDb *db = server.db+0;
     char buf[1024];
     time_t expiretime = -1, now = time(NULL);
+    long long loadedkeys = 0;
 
-    fp = fopen(filename,"r");
-    if (!fp) return REDIS_ERR;
-    if (fread(buf,9,1,fp) == 0) goto eoferr;
+    if (rdbRead(rdb,buf,9) == 0) goto eoferr;
     buf[9] = '\0';
     if (memcmp(buf,"REDIS",5) != 0) {
-        fclose(fp);
         redisLog(REDIS_WARNING,"Wrong signature trying to load DB from file");
+        rdb->badheader = 1;
         return REDIS_ERR;
     }
     rdbver = atoi(buf+5);
-    if (rdbver > 1) {
-        fclose(fp);
+    if (rdbver > REDIS_RDB_VERSION) {
         redisLog(REDIS_WARNING,"Can't handle RDB format version %d",rdbver);
+        rdb->badheader = 1;
         return REDIS_ERR;
     }
     while(1) {
         robj *o;
 
+        /* Serve the clients from time to time if we are loading in the
+         * background of an active event loop */
+        if (!(++loadedkeys % REDIS_LOADING_PROCESS_EVENTS_KEYS)) {
+            server.loading_loaded_bytes = rdb->processed;
+            if (server.loading) processEventsWhileLoading();
+            rdbLoadProgress(rdb,0);
+        }
+
         /* Read type. */
-        if ((type = rdbLoadType(fp)) == -1) goto eoferr;
+        if ((type = rdbLoadType(rdb)) == -1) goto eoferr;
         if (type == REDIS_EXPIRETIME) {
-            if ((expiretime = rdbLoadTime(fp)) == -1) goto eoferr;
+            if ((expiretime = rdbLoadTime(rdb)) == -1) goto eoferr;
             /* We read the time so we need to read the object type again */
-            if ((type = rdbLoadType(fp)) == -1) goto eoferr;
+            if ((type = rdbLoadType(rdb)) == -1) goto eoferr;
         }
         if (type == REDIS_EOF) break;
         /* Handle SELECT DB opcode as a special case */
         if (type == REDIS_SELECTDB) {
-            if ((dbid = rdbLoadLen(fp,rdbver,NULL)) == REDIS_RDB_LENERR)
+            if ((dbid = rdbLoadLen(rdb,rdbver,NULL)) == REDIS_RDB_LENERR)
                 goto eoferr;
             if (dbid >= (unsigned)server.dbnum) {
                 redisLog(REDIS_WARNING,"FATAL: Data file was created with a Redis server configured to handle more than %d databases. Exiting\n", server.dbnum);
@@ -2206,24 +3466,41 @@ static int rdbLoad(char *filename) {
             d = db->dict;
             continue;
         }
+        /* Presize the hash tables of the DB, so that they don't need to be
+         * rehashed again and again while the keys are added */
+        if (type == REDIS_RESIZEDB) {
+            uint32_t dbsize, expiressize;
+
+            if ((dbsize = rdbLoadLen(rdb,rdbver,NULL)) == REDIS_RDB_LENERR ||
+                (expiressize = rdbLoadLen(rdb,rdbver,NULL)) == REDIS_RDB_LENERR)
+                goto eoferr;
+            if (dictSize(d) == 0 && dbsize) dictExpand(d,dbsize);
+            if (dictSize(db->expires) == 0 && expiressize)
+                dictExpand(db->expires,expiressize);
+            continue;
+        }
         /* Read key */
-        if ((keyobj = rdbLoadStringObject(fp,rdbver)) == NULL) goto eoferr;
+        if ((keyobj = rdbLoadStringObject(rdb,rdbver)) == NULL) goto eoferr;
 
         if (type == REDIS_STRING) {
             /* Read string value */
-            if ((o = rdbLoadStringObject(fp,rdbver)) == NULL) goto eoferr;
+            if ((o = rdbLoadStringObject(rdb,rdbver)) == NULL) goto eoferr;
         } else if (type == REDIS_LIST || type == REDIS_SET) {
             /* Read list/set value */
             uint32_t listlen;
 
-            if ((listlen = rdbLoadLen(fp,rdbver,NULL)) == REDIS_RDB_LENERR)
+            if ((listlen = rdbLoadLen(rdb,rdbver,NULL)) == REDIS_RDB_LENERR)
                 goto eoferr;
             o = (type == REDIS_LIST) ? createListObject() : createSetObject();
+            /* The number of elements is known, create the set already big
+             * enough to hold all of them */
+            if (type == REDIS_SET && listlen > DICT_HT_INITIAL_SIZE)
+                dictExpand((dict*)o->ptr,listlen);
             /* Load every single element of the list/set */
             while(listlen--) {
                 robj *ele;
 
-                if ((ele = rdbLoadStringObject(fp,rdbver)) == NULL) goto eoferr;
+                if ((ele = rdbLoadStringObject(rdb,rdbver)) == NULL) goto eoferr;
                 if (type == REDIS_LIST) {
                     if (!listAddNodeTail((list*)o->ptr,ele))
                         oom("listAddNodeTail");
@@ -2249,15 +3526,207 @@ static int rdbLoad(char *filename) {
             expiretime = -1;
         }
         keyobj = o = NULL;
+        rdb->keys++;
     }
-    fclose(fp);
+    /* Verify the checksum of everything read so far, EOF opcode included */
+    if (rdbver >= 3) {
+        uint64_t expected = rdb->crc, crc = 0;
+        unsigned char trailer[REDIS_RDB_CRC_LEN];
+        int j;
+
+        if (rdbRead(rdb,trailer,REDIS_RDB_CRC_LEN) == 0) goto eoferr;
+        for (j = 0; j < REDIS_RDB_CRC_LEN; j++)
+            crc |= (uint64_t)trailer[j] << (j*8);
+        if (crc != 0 && crc != expected) {
+            redisLog(REDIS_WARNING,"Wrong RDB checksum: %016llx expected, %016llx found",
+                (unsigned long long) expected, (unsigned long long) crc);
+            rdb->badchecksum = 1;
+            return REDIS_ERR;
+        }
+    }
+    server.loading_loaded_bytes = rdb->processed;
+    rdbLoadProgress(rdb,1);
     return REDIS_OK;
 
-eoferr: /* unexpected end of file is handled here with a fatal exit */
+eoferr:
     if (keyobj) decrRefCount(keyobj);
-    redisLog(REDIS_WARNING,"Short read or OOM loading DB. Unrecoverable error, exiting now.");
-    exit(1);
-    return REDIS_ERR; /* Just to avoid warning */
+    return REDIS_ERR;
+}
+
+/* Load a DB file. On error 'rdb' tells why, the file may be missing as well */
+static int rdbLoadFile(char *filename, rdbInput *rdb) {
+    struct stat sb;
+    int retval;
+
+    memset(rdb,0,sizeof(*rdb));
+    rdb->fp = fopen(filename,"r");
+    if (!rdb->fp) return REDIS_ERR;
+    if (fstat(fileno(rdb->fp),&sb) != -1) rdb->size = sb.st_size;
+    rdb->start = ustime();
+    rdb->lastreport = time(NULL);
+    rdb->buf = zmalloc(REDIS_RDB_READBUF_LEN);
+    if (!rdb->buf) oom("rdbLoad");
+    retval = rdbLoadInput(rdb);
+    fclose(rdb->fp);
+    zfree(rdb->buf);
+    return retval;
+}
+
+static int rdbLoad(char *filename) {
+    rdbInput rdb;
+    int retval;
+
+    retval = rdbLoadFile(filename,&rdb);
+    if (retval != REDIS_OK && rdb.badchecksum) {
+        redisLog(REDIS_WARNING,"The DB file is corrupted. Unrecoverable error, exiting now.");
+        exit(1);
+    } else if (retval != REDIS_OK && !rdb.badheader) {
+        /* unexpected end of file is handled here with a fatal exit */
+        redisLog(REDIS_WARNING,"Short read or OOM loading DB. Unrecoverable error, exiting now.");
+        exit(1);
+    }
+    return retval;
+}
+
+/* Load the dataset directly from the socket connected to our master, that
+ * is going to send 'size' bytes of RDB payload. */
+static int rdbLoadFromSocket(int fd, long long size) {
+    rdbInput rdb;
+    int retval;
+
+    memset(&rdb,0,sizeof(rdb));
+    rdb.fd = fd;
+    rdb.left = size;
+    rdb.size = size;
+    rdb.start = ustime();
+    rdb.lastreport = time(NULL);
+    rdb.buf = zmalloc(REDIS_REPL_TRANSFER_BUFLEN);
+    if (!rdb.buf) oom("rdbLoadFromSocket");
+    retval = rdbLoadInput(&rdb);
+    /* Data after the RDB EOF opcode would be out of sync with the stream */
+    if (retval == REDIS_OK && (rdb.left || rdb.bufpos != rdb.buflen)) {
+        redisLog(REDIS_WARNING,"Trailing data after the DB received from MASTER");
+        retval = REDIS_ERR;
+    }
+    zfree(rdb.buf);
+    return retval;
+}
+
+/* Verify the checksum of a DB file without loading it: the file is read
+ * sequentially and summed, that is way faster than parsing it. Files older
+ * than version 3, or saved with rdb-checksum no, have no checksum to
+ * verify and are considered valid. */
+static int rdbCheckFile(char *filename) {
+    FILE *fp;
+    struct stat sb;
+    char *buf;
+    unsigned char trailer[REDIS_RDB_CRC_LEN+1];
+    uint64_t crc = 0, stored = 0;
+    long long left;
+    int rdbver, j, retval = REDIS_ERR;
+
+    if ((fp = fopen(filename,"r")) == NULL) {
+        redisLog(REDIS_WARNING,"Can't open %s: %s",filename,strerror(errno));
+        return REDIS_ERR;
+    }
+    if ((buf = zmalloc(REDIS_RDB_READBUF_LEN)) == NULL) oom("rdbCheckFile");
+    if (fstat(fileno(fp),&sb) == -1 || sb.st_size < 9 ||
+        fread(buf,9,1,fp) == 0 || memcmp(buf,"REDIS",5) != 0)
+    {
+        redisLog(REDIS_WARNING,"%s is not a Redis DB file",filename);
+        goto cleanup;
+    }
+    buf[9] = '\0';
+    rdbver = atoi(buf+5);
+    if (rdbver > REDIS_RDB_VERSION) {
+        redisLog(REDIS_WARNING,"Can't handle RDB format version %d",rdbver);
+        goto cleanup;
+    }
+    if (rdbver < 3) {
+        redisLog(REDIS_NOTICE,"RDB format version %d has no checksum",rdbver);
+        retval = REDIS_OK;
+        goto cleanup;
+    }
+    /* Sum everything up to the EOF opcode, then read the opcode itself
+     * and the trailer */
+    crc = crc64(crc,buf,9);
+    left = (long long)sb.st_size-9-(REDIS_RDB_CRC_LEN+1);
+    if (left < 0) goto shortread;
+    while(left) {
+        size_t toread = (left < REDIS_RDB_READBUF_LEN) ?
+                        left : REDIS_RDB_READBUF_LEN;
+
+        if (fread(buf,toread,1,fp) == 0) goto shortread;
+        crc = crc64(crc,buf,toread);
+        left -= toread;
+    }
+    if (fread(trailer,sizeof(trailer),1,fp) == 0) goto shortread;
+    if (trailer[0] != REDIS_EOF) {
+        redisLog(REDIS_WARNING,"%s is truncated or corrupted: no EOF opcode before the checksum",filename);
+        goto cleanup;
+    }
+    crc = crc64(crc,trailer,1);
+    for (j = 0; j < REDIS_RDB_CRC_LEN; j++)
+        stored |= (uint64_t)trailer[j+1] << (j*8);
+    if (stored == 0) {
+        redisLog(REDIS_NOTICE,"%s was saved without checksum",filename);
+        retval = REDIS_OK;
+    } else if (stored != crc) {
+        redisLog(REDIS_WARNING,"Wrong RDB checksum in %s: %016llx expected, %016llx found",
+            filename, (unsigned long long) crc, (unsigned long long) stored);
+    } else {
+        redisLog(REDIS_NOTICE,"%s: checksum %016llx OK",filename,
+            (unsigned long long) crc);
+        retval = REDIS_OK;
+    }
+    goto cleanup;
+
+shortread:
+    redisLog(REDIS_WARNING,"Short read checking %s",filename);
+cleanup:
+    fclose(fp);
+    zfree(buf);
+    return retval;
+}
+
+/* ---------------------------- Loading state ------------------------------ */
+
+/* While loading a dataset on a live server (at startup, or a slave receiving
+ * the DB from its master) we keep serving the clients: only the commands
+ * flagged with REDIS_CMD_LOADING are accepted (plus REDIS_CMD_READONLY ones
+ * if loading-serve-reads is on), the others get a -LOADING error. */
+static void startLoading(long long totalbytes) {
+    server.loading = 1;
+    server.loading_start_time = time(NULL);
+    server.loading_total_bytes = totalbytes;
+    server.loading_loaded_bytes = 0;
+}
+
+static void stopLoading(void) {
+    server.loading = 0;
+}
+
+/* Only file events are processed: timers like serverCron() must not run in
+ * the middle of the load. */
+static void processEventsWhileLoading(void) {
+    aeProcessEvents(server.el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    /* Clients are served: the load is not an event loop stall */
+    if (server.watchdog_period) watchdogScheduleSignal(server.watchdog_period);
+}
+
+/* Load the DB at startup. The clients are served while loading, see
+ * startLoading() */
+static void loadDataFromDisk(void) {
+    struct stat sb;
+
+    if (stat(server.dbfilename,&sb) == -1) return;
+    redisLog(REDIS_NOTICE,"Loading the DB from disk (%lld bytes), serving PING and INFO%s meanwhile",
+        (long long) sb.st_size,
+        server.loadingservereads ? " and the read only commands" : "");
+    startLoading(sb.st_size);
+    if (rdbLoad(server.dbfilename) == REDIS_OK)
+        redisLog(REDIS_NOTICE,"DB loaded from disk");
+    stopLoading();
 }
 
 /*================================== Commands =============================== */
@@ -2324,7 +3793,7 @@ static void getCommand(redisClient *c) {
             addReply(c,shared.wrongtypeerr);
         } else {
             addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n",(int)sdslen(o->ptr)));
-            addReply(c,o);
+            addReplyDbObject(c,o);
             addReply(c,shared.crlf);
         }
     }
@@ -2355,7 +3824,7 @@ static void mgetCommand(redisClient *c) {
                 addReply(c,shared.nullbulk);
             } else {
                 addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n",(int)sdslen(o->ptr)));
-                addReply(c,o);
+                addReplyDbObject(c,o);
                 addReply(c,shared.crlf);
             }
         }
@@ -2415,11 +3884,12 @@ static void decrbyCommand(redisClient *c) {
 
 /* ========================= Type agnostic commands ========================= */
 
-static void delCommand(redisClient *c) {
+static void delGenericCommand(redisClient *c, int lazy) {
     int deleted = 0, j;
 
     for (j = 1; j < c->argc; j++) {
-        if (deleteKey(c->db,c->argv[j])) {
+        if (lazy ? dbAsyncDelete(c->db,c->argv[j]) :
+                   deleteKey(c->db,c->argv[j])) {
             server.dirty++;
             deleted++;
         }
@@ -2437,6 +3907,14 @@ static void delCommand(redisClient *c) {
     }
 }
 
+static void delCommand(redisClient *c) {
+    delGenericCommand(c,0);
+}
+
+static void unlinkCommand(redisClient *c) {
+    delGenericCommand(c,1);
+}
+
 static void existsCommand(redisClient *c) {
     addReply(c,lookupKeyRead(c->db,c->argv[1]) ? shared.cone : shared.czero);
 }
@@ -2463,7 +3941,7 @@ static void randomkeyCommand(redisClient *c) {
         addReply(c,shared.crlf);
     } else {
         addReply(c,shared.plus);
-        addReply(c,dictGetEntryKey(de));
+        addReplyDbObject(c,dictGetEntryKey(de));
         addReply(c,shared.crlf);
     }
 }
@@ -2472,10 +3950,13 @@ static void keysCommand(redisClient *c) {
     dictIterator *di;
     dictEntry *de;
     sds pattern = c->argv[1]->ptr;
-    int plen = sdslen(pattern);
     int numkeys = 0, keyslen = 0;
     robj *lenobj = createObject(REDIS_STRING,NULL);
+    stringmatchPattern *p;
 
+    /* Compile the pattern once instead of interpreting it for every key */
+    p = stringmatchCompile(pattern,sdslen(pattern),0);
+    if (!p) oom("stringmatchCompile");
     di = dictGetIterator(c->db->dict);
     if (!di) oom("dictGetIterator");
     addReply(c,lenobj);
@@ -2484,22 +3965,148 @@ static void keysCommand(redisClient *c) {
         robj *keyobj = dictGetEntryKey(de);
 
         sds key = keyobj->ptr;
-        if ((pattern[0] == '*' && pattern[1] == '\0') ||
-            stringmatchlen(pattern,plen,key,sdslen(key),0)) {
+        if (stringmatchExec(p,key,sdslen(key))) {
             if (expireIfNeeded(c->db,keyobj) == 0) {
                 if (numkeys != 0)
                     addReply(c,shared.space);
-                addReply(c,keyobj);
+                addReplyDbObject(c,keyobj);
                 numkeys++;
                 keyslen += sdslen(key);
             }
         }
     }
     dictReleaseIterator(di);
+    stringmatchFree(p);
     lenobj->ptr = sdscatprintf(sdsempty(),"$%lu\r\n",keyslen+(numkeys ? (numkeys-1) : 0));
     addReply(c,shared.crlf);
 }
 
+static void scanCallback(void *privdata, const dictEntry *de) {
+    list *keys = privdata;
+    robj *key = dictGetEntryKey(de);
+
+    /* Like addReplyDbObject(), don't touch the objects of the DB while
+     * there is a child saving it */
+    if (server.bgsaveinprogress && sdslen(key->ptr) < REDIS_COW_COPY_MAXLEN)
+        key = createStringObject(key->ptr,sdslen(key->ptr));
+    else
+        incrRefCount(key);
+    if (!listAddNodeTail(keys,key)) oom("listAddNodeTail");
+}
+
+/* SCAN cursor [MATCH pattern] [COUNT count]
+ * SSCAN key cursor [MATCH pattern] [COUNT count]
+ *
+ * Incremental iteration of a DB or of a set without keeping any state in
+ * the server: the reply is a two elements multi bulk with the cursor to use
+ * in the next call, and the elements found. The iteration is complete when
+ * the returned cursor is 0. COUNT is just a hint about the amount of work to
+ * do in a single call, MATCH filters the elements after they are retrieved
+ * so a call may return no element at all with a non zero cursor.
+ *
+ * 'd' may be NULL to scan a non existing key. When 'isdb' is true expired
+ * keys are not returned. */
+static void scanGenericCommand(redisClient *c, dict *d, int cursorarg, int isdb) {
+    unsigned long cursor;
+    long count = 10, maxiterations;
+    sds pattern = NULL;
+    stringmatchPattern *compiled = NULL;
+    char *cursorstr = c->argv[cursorarg]->ptr, *eptr;
+    list *keys;
+    listNode *ln;
+    int j;
+
+    errno = 0;
+    cursor = strtoul(cursorstr,&eptr,10);
+    if (!isdigit((unsigned char)cursorstr[0]) || *eptr != '\0' ||
+        errno == ERANGE) {
+        addReplySds(c,sdsnew("-ERR invalid cursor\r\n"));
+        return;
+    }
+    for (j = cursorarg+1; j < c->argc; j += 2) {
+        if (j+1 == c->argc) {
+            addReply(c,shared.syntaxerr);
+            return;
+        } else if (!strcasecmp(c->argv[j]->ptr,"match")) {
+            pattern = c->argv[j+1]->ptr;
+            /* The pattern "*" matches everything */
+            if (pattern[0] == '*' && pattern[1] == '\0') pattern = NULL;
+        } else if (!strcasecmp(c->argv[j]->ptr,"count")) {
+            count = strtol(c->argv[j+1]->ptr,NULL,10);
+            if (count < 1) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+            /* count*10 below must not overflow */
+            if (count > LONG_MAX/10) count = LONG_MAX/10;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    /* Collect the elements of at least 'count' elements worth of buckets,
+     * but don't visit too many empty buckets in a sparse table */
+    if ((keys = listCreate()) == NULL) oom("listCreate");
+    listSetFreeMethod(keys,decrRefCount);
+    maxiterations = count*10;
+    if (d == NULL) {
+        cursor = 0;
+    } else {
+        do {
+            cursor = dictScan(d,cursor,scanCallback,keys);
+        } while (cursor && maxiterations-- &&
+                 listLength(keys) < (unsigned long)count);
+    }
+
+    /* Filter the elements we are not going to return */
+    if (pattern) {
+        compiled = stringmatchCompile(pattern,sdslen(pattern),0);
+        if (!compiled) oom("stringmatchCompile");
+    }
+    listRewind(keys);
+    while((ln = listYield(keys))) {
+        robj *key = ln->value;
+        int filter = 0;
+
+        if (compiled && !stringmatchExec(compiled,key->ptr,sdslen(key->ptr)))
+            filter = 1;
+        if (!filter && isdb && expireIfNeeded(c->db,key)) filter = 1;
+        if (filter) listDelNode(keys,ln);
+    }
+    stringmatchFree(compiled);
+
+    addReplySds(c,sdsnew("*2\r\n"));
+    cursorstr = sdscatprintf(sdsempty(),"%lu",cursor);
+    addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n%s\r\n",
+        (int)sdslen(cursorstr),cursorstr));
+    sdsfree(cursorstr);
+    addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",listLength(keys)));
+    listRewind(keys);
+    while((ln = listYield(keys))) {
+        robj *key = ln->value;
+
+        addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n",sdslen(key->ptr)));
+        addReply(c,key);
+        addReply(c,shared.crlf);
+    }
+    listRelease(keys);
+}
+
+static void scanCommand(redisClient *c) {
+    scanGenericCommand(c,c->db->dict,1,1);
+}
+
+static void sscanCommand(redisClient *c) {
+    robj *o = lookupKeyRead(c->db,c->argv[1]);
+
+    if (o && o->type != REDIS_SET) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+    scanGenericCommand(c,o ? o->ptr : NULL,2,0);
+}
+
 static void dbsizeCommand(redisClient *c) {
     addReplySds(c,
         sdscatprintf(sdsempty(),":%lu\r\n",dictSize(c->db->dict)));
@@ -2514,7 +4121,7 @@ static void typeCommand(redisClient *c) {
     robj *o;
     char *type;
 
-    o = lookupKeyRead(c->db,c->argv[1]);
+    o = lookupKeyReadNoStats(c->db,c->argv[1]);
     if (o == NULL) {
         type = "+none";
     } else {
@@ -2692,6 +4299,7 @@ static void pushGenericCommand(redisClient *c, int where) {
             if (!listAddNodeTail(list,c->argv[2])) oom("listAddNodeTail");
         }
         incrRefCount(c->argv[2]);
+        dbStatsUpdateElements(c->db,REDIS_LIST,1,c->argv[2]);
     }
     server.dirty++;
     addReply(c,shared.ok);
@@ -2743,7 +4351,7 @@ static void lindexCommand(redisClient *c) {
             } else {
                 robj *ele = listNodeValue(ln);
                 addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n",(int)sdslen(ele->ptr)));
-                addReply(c,ele);
+                addReplyDbObject(c,ele);
                 addReply(c,shared.crlf);
             }
         }
@@ -2773,6 +4381,7 @@ static void lsetCommand(redisClient *c) {
                 decrRefCount(ele);
                 listNodeValue(ln) = c->argv[3];
                 incrRefCount(c->argv[3]);
+                dbStatsUpdateElements(c->db,REDIS_LIST,0,c->argv[3]);
                 addReply(c,shared.ok);
                 server.dirty++;
             }
@@ -2806,6 +4415,7 @@ static void popGenericCommand(redisClient *c, int where) {
                 addReply(c,ele);
                 addReply(c,shared.crlf);
                 listDelNode(list,ln);
+                dbStatsUpdateElements(c->db,REDIS_LIST,-1,NULL);
                 server.dirty++;
             }
         }
@@ -2859,7 +4469,7 @@ static void lrangeCommand(redisClient *c) {
             for (j = 0; j < rangelen; j++) {
                 ele = listNodeValue(ln);
                 addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n",(int)sdslen(ele->ptr)));
-                addReply(c,ele);
+                addReplyDbObject(c,ele);
                 addReply(c,shared.crlf);
                 ln = ln->next;
             }
@@ -2910,6 +4520,7 @@ static void ltrimCommand(redisClient *c) {
                 ln = listLast(list);
                 listDelNode(list,ln);
             }
+            dbStatsUpdateElements(c->db,REDIS_LIST,-(ltrim+rtrim),NULL);
             server.dirty++;
             addReply(c,shared.ok);
         }
@@ -2949,6 +4560,7 @@ static void lremCommand(redisClient *c) {
                 }
                 ln = next;
             }
+            dbStatsUpdateElements(c->db,REDIS_LIST,-removed,NULL);
             addReplySds(c,sdscatprintf(sdsempty(),":%d\r\n",removed));
         }
     }
@@ -2972,6 +4584,7 @@ static void saddCommand(redisClient *c) {
     }
     if (dictAdd(set->ptr,c->argv[2],NULL) == DICT_OK) {
         incrRefCount(c->argv[2]);
+        dbStatsUpdateElements(c->db,REDIS_SET,1,c->argv[2]);
         server.dirty++;
         addReply(c,shared.cone);
     } else {
@@ -2991,6 +4604,7 @@ static void sremCommand(redisClient *c) {
             return;
         }
         if (dictDelete(set->ptr,c->argv[2]) == DICT_OK) {
+            dbStatsUpdateElements(c->db,REDIS_SET,-1,NULL);
             server.dirty++;
             if (htNeedsResize(set->ptr)) dictResize(set->ptr);
             addReply(c,shared.cone);
@@ -3023,6 +4637,7 @@ static void smoveCommand(redisClient *c) {
         addReply(c,shared.czero);
         return;
     }
+    dbStatsUpdateElements(c->db,REDIS_SET,-1,NULL);
     server.dirty++;
     /* Add the element to the destination set */
     if (!dstset) {
@@ -3030,8 +4645,10 @@ static void smoveCommand(redisClient *c) {
         dictAdd(c->db->dict,c->argv[2],dstset);
         incrRefCount(c->argv[2]);
     }
-    if (dictAdd(dstset->ptr,c->argv[3],NULL) == DICT_OK)
+    if (dictAdd(dstset->ptr,c->argv[3],NULL) == DICT_OK) {
         incrRefCount(c->argv[3]);
+        dbStatsUpdateElements(c->db,REDIS_SET,1,c->argv[3]);
+    }
     addReply(c,shared.cone);
 }
 
@@ -3094,6 +4711,7 @@ static void spopCommand(redisClient *c) {
             addReply(c,ele);
             addReply(c,shared.crlf);
             dictDelete(set->ptr,ele);
+            dbStatsUpdateElements(c->db,REDIS_SET,-1,NULL);
             if (htNeedsResize(set->ptr)) dictResize(set->ptr);
             server.dirty++;
         }
@@ -3172,7 +4790,7 @@ static void sinterGenericCommand(redisClient *c, robj **setskeys, int setsnum, r
         ele = dictGetEntryKey(de);
         if (!dstkey) {
             addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n",sdslen(ele->ptr)));
-            addReply(c,ele);
+            addReplyDbObject(c,ele);
             addReply(c,shared.crlf);
             cardinality++;
         } else {
@@ -3321,15 +4939,39 @@ static void sdiffstoreCommand(redisClient *c) {
     sunionDiffGenericCommand(c,c->argv+2,c->argc-2,c->argv[1],REDIS_OP_DIFF);
 }
 
+/* Parse the optional ASYNC argument of FLUSHDB and FLUSHALL. Returns -1
+ * after replying with an error if the syntax is wrong. */
+static int getFlushAsyncArg(redisClient *c) {
+    if (c->argc == 1) return 0;
+    if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"async")) return 1;
+    addReplySds(c,sdsnew("-ERR syntax error\r\n"));
+    return -1;
+}
+
 static void flushdbCommand(redisClient *c) {
-    server.dirty += dictSize(c->db->dict);
-    dictEmpty(c->db->dict);
-    dictEmpty(c->db->expires);
+    int async = getFlushAsyncArg(c);
+
+    if (async == -1) return;
+    if (async) {
+        server.dirty += emptyDbAsync(c->db);
+    } else {
+        server.dirty += dictSize(c->db->dict);
+        dictEmpty(c->db->dict);
+        dictEmpty(c->db->expires);
+    }
     addReply(c,shared.ok);
 }
 
 static void flushallCommand(redisClient *c) {
-    server.dirty += emptyDb();
+    int async = getFlushAsyncArg(c), j;
+
+    if (async == -1) return;
+    if (async) {
+        for (j = 0; j < server.dbnum; j++)
+            server.dirty += emptyDbAsync(server.db+j);
+    } else {
+        server.dirty += emptyDb();
+    }
     addReply(c,shared.ok);
     rdbSave(server.dbfilename);
     server.dirty++;
@@ -3377,7 +5019,7 @@ static robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
     keyobj.ptr = ((char*)&keyname)+(sizeof(long)*2);
 
     /* printf("lookup '%s' => %p\n", keyname.buf,de); */
-    return lookupKeyRead(db,&keyobj);
+    return lookupKeyReadNoStats(db,&keyobj);
 }
 
 /* sortCompare() is used by qsort in sortCommand(). Given that qsort_r with
@@ -3598,7 +5240,7 @@ static void sortCommand(redisClient *c) {
                 } else {
                     addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n",
                         sdslen(val->ptr)));
-                    addReply(c,val);
+                    addReplyDbObject(c,val);
                     addReply(c,shared.crlf);
                 }
             } else if (sop->type == REDIS_SORT_DEL) {
@@ -3617,11 +5259,94 @@ static void sortCommand(redisClient *c) {
     zfree(vector);
 }
 
+/* INFO commandstats: for every command called at least once
+ *
+ * cmdstat_<name>:calls=<n>,usec=<total>,usec_per_call=<avg>,max_usec=<max>
+ * cmdhist_<name>:<usec>=<calls>,...
+ *
+ * cmdhist lists the non empty buckets of the latency histogram, every one
+ * with the number of calls that took at most <usec> microseconds (and more
+ * than the previous bucket), "inf" for the last bucket. */
+static sds genCommandStatsString(void) {
+    struct redisCommand *cmd;
+    struct redisCommandStats *st;
+    sds info = sdsempty();
+    int b, first;
+
+    for (cmd = cmdTable, st = cmdStats; cmd->name != NULL; cmd++, st++) {
+        if (st->calls == 0) continue;
+        info = sdscatprintf(info,
+            "cmdstat_%s:calls=%lld,usec=%lld,usec_per_call=%.2f,max_usec=%lld\r\n",
+            cmd->name, st->calls, st->microseconds,
+            (double)st->microseconds/st->calls, st->maxmicroseconds);
+        info = sdscatprintf(info,"cmdhist_%s:",cmd->name);
+        for (b = 0, first = 1; b < REDIS_CMDSTAT_BUCKETS; b++) {
+            if (st->latency[b] == 0) continue;
+            if (b == REDIS_CMDSTAT_BUCKETS-1)
+                info = sdscatprintf(info,"%sinf=%lld", first ? "" : ",",
+                    st->latency[b]);
+            else
+                info = sdscatprintf(info,"%s%lld=%lld", first ? "" : ",",
+                    1LL<<b, st->latency[b]);
+            first = 0;
+        }
+        info = sdscat(info,"\r\n");
+    }
+    return info;
+}
+
+/* INFO datatypes: for every type the keys, the elements and the estimated
+ * bytes used by the values in all the DBs (key names are not accounted).
+ * Strings are accounted exactly. Lists and sets are estimated from the
+ * number of elements and the average size of the elements added to them,
+ * as computing the real size would require to scan every value. */
+static sds genDataTypesString(void) {
+    static char *names[] = {"string","list","set"};
+    sds info = sdsempty();
+    int j, type;
+
+    for (type = REDIS_STRING; type <= REDIS_SET; type++) {
+        long long keys = 0, elements = 0, bytes = 0, elesize;
+
+        for (j = 0; j < server.dbnum; j++) {
+            keys += server.db[j].stats[type].keys;
+            elements += server.db[j].stats[type].elements;
+            bytes += server.db[j].stats[type].bytes;
+        }
+        elesize = server.elesize_count[type] ?
+            server.elesize_sum[type]/server.elesize_count[type] :
+            (long long)sizeof(struct sdshdr)+1;
+        if (type == REDIS_LIST) {
+            bytes = keys*(long long)(sizeof(robj)+sizeof(list))+
+                elements*((long long)(sizeof(listNode)+sizeof(robj))+elesize);
+        } else if (type == REDIS_SET) {
+            bytes = keys*(long long)(sizeof(robj)+sizeof(dict))+
+                elements*((long long)(sizeof(dictEntry)+sizeof(dictEntry*)+
+                sizeof(robj))+elesize);
+        }
+        info = sdscatprintf(info,"type_%s:keys=%lld,elements=%lld,bytes=%lld\r\n",
+            names[type],keys,elements,bytes);
+    }
+    return info;
+}
+
 static void infoCommand(redisClient *c) {
     sds info;
     time_t uptime = time(NULL)-server.stat_starttime;
+    size_t used = zmalloc_used_memory(), rss = zmalloc_get_rss();
     int j;
-    
+
+    if (c->argc == 2) {
+        if (!strcasecmp(c->argv[1]->ptr,"commandstats")) {
+            info = genCommandStatsString();
+        } else if (!strcasecmp(c->argv[1]->ptr,"datatypes")) {
+            info = genDataTypesString();
+        } else {
+            addReplySds(c,sdsnew("-ERR unknown INFO section\r\n"));
+            return;
+        }
+        goto reply;
+    }
     info = sdscatprintf(sdsempty(),
         "redis_version:%s\r\n"
         "uptime_in_seconds:%d\r\n"
@@ -3629,23 +5354,45 @@ static void infoCommand(redisClient *c) {
         "connected_clients:%d\r\n"
         "connected_slaves:%d\r\n"
         "used_memory:%zu\r\n"
+        "used_memory_rss:%zu\r\n"
+        "mem_fragmentation_ratio:%.2f\r\n"
         "changes_since_last_save:%lld\r\n"
         "bgsave_in_progress:%d\r\n"
         "last_save_time:%d\r\n"
+        "latest_fork_usec:%lld\r\n"
+        "rdb_last_cow_size:%zu\r\n"
+        "lazyfree_pending_jobs:%llu\r\n"
+        "lazyfreed_jobs:%llu\r\n"
         "total_connections_received:%lld\r\n"
         "total_commands_processed:%lld\r\n"
+        "keyspace_hits:%lld\r\n"
+        "keyspace_misses:%lld\r\n"
+        "expired_keys_lazy:%lld\r\n"
+        "expired_keys_active:%lld\r\n"
+        "evicted_keys:%lld\r\n"
         "role:%s\r\n"
         ,REDIS_VERSION,
         uptime,
         uptime/(3600*24),
         listLength(server.clients)-listLength(server.slaves),
         listLength(server.slaves),
-        server.usedmemory,
+        used,
+        rss,
+        (float)rss/used,
         server.dirty,
         server.bgsaveinprogress,
         server.lastsave,
+        server.stat_fork_time,
+        server.stat_rdb_cow_bytes,
+        bioPendingJobsOfType(REDIS_BIO_LAZY_FREE),
+        bioProcessedJobsOfType(REDIS_BIO_LAZY_FREE),
         server.stat_numconnections,
         server.stat_numcommands,
+        server.stat_keyspace_hits,
+        server.stat_keyspace_misses,
+        server.stat_expired_lazy,
+        server.stat_expired_active,
+        server.stat_evictedkeys,
         server.masterhost == NULL ? "master" : "slave"
     );
     if (server.masterhost) {
@@ -3654,35 +5401,314 @@ static void infoCommand(redisClient *c) {
             "master_port:%d\r\n"
             "master_link_status:%s\r\n"
             "master_last_io_seconds_ago:%d\r\n"
+            "master_replid:%s\r\n"
+            "slave_repl_offset:%lld\r\n"
             ,server.masterhost,
             server.masterport,
             (server.replstate == REDIS_REPL_CONNECTED) ?
                 "up" : "down",
-            (int)(time(NULL)-server.master->lastinteraction)
+            server.master ?
+                (int)(time(NULL)-server.master->lastinteraction) : -1,
+            server.repl_master_replid,
+            server.repl_master_offset
+        );
+        if (server.replstate == REDIS_REPL_TRANSFER) {
+            info = sdscatprintf(info,
+                "master_sync_in_progress:1\r\n"
+                "master_sync_left_bytes:%lld\r\n"
+                "master_sync_last_io_seconds_ago:%d\r\n"
+                ,(server.repl_transfer_size == -1) ? -1 :
+                    server.repl_transfer_size - (server.loading ?
+                    server.loading_loaded_bytes : server.repl_transfer_read),
+                (int)(time(NULL)-server.repl_transfer_lastio)
+            );
+        }
+    }
+    info = sdscatprintf(info,"loading:%d\r\n",server.loading);
+    if (server.loading) {
+        double perc = 0;
+        time_t elapsed = time(NULL)-server.loading_start_time;
+        int eta = -1;
+
+        if (server.loading_total_bytes)
+            perc = (double)server.loading_loaded_bytes /
+                   server.loading_total_bytes * 100;
+        if (server.loading_loaded_bytes && elapsed)
+            eta = (int)(elapsed * (server.loading_total_bytes -
+                  server.loading_loaded_bytes) / server.loading_loaded_bytes);
+        info = sdscatprintf(info,
+            "loading_start_time:%ld\r\n"
+            "loading_total_bytes:%lld\r\n"
+            "loading_loaded_bytes:%lld\r\n"
+            "loading_loaded_perc:%.2f\r\n"
+            "loading_eta_seconds:%d\r\n"
+            ,(long)server.loading_start_time,
+            server.loading_total_bytes,
+            server.loading_loaded_bytes,
+            perc,
+            eta
         );
     }
-    for (j = 0; j < server.dbnum; j++) {
-        long long keys, vkeys;
+    info = sdscatprintf(info,
+        "replid:%s\r\n"
+        "master_repl_offset:%lld\r\n"
+        "repl_backlog_active:%d\r\n"
+        "repl_backlog_size:%lld\r\n"
+        "repl_backlog_first_byte_offset:%lld\r\n"
+        "repl_backlog_histlen:%lld\r\n"
+        ,server.replid,
+        server.master_repl_offset,
+        server.repl_backlog != NULL,
+        server.repl_backlog_size,
+        server.repl_backlog_off,
+        server.repl_backlog_histlen
+    );
+    for (j = 0; j < REDIS_BIO_NUM_OPS; j++) {
+        info = sdscatprintf(info, "bio_pending_%s:%llu\r\n",
+            bioJobTypeName(j), bioPendingJobsOfType(j));
+    }
+    for (j = 0; j < ZMALLOC_SIZE_CLASSES; j++) {
+        size_t allocs = zmalloc_size_class_allocs(j);
+        size_t limit = zmalloc_size_class_limit(j);
+
+        if (allocs == 0) continue;
+        if (limit)
+            info = sdscatprintf(info, "allocs_upto_%zu:%zu\r\n", limit, allocs);
+        else
+            info = sdscatprintf(info, "allocs_bigger:%zu\r\n", allocs);
+    }
+    for (j = 0; j < server.dbnum; j++) {
+        long long keys, vkeys;
+
+        keys = dictSize(server.db[j].dict);
+        vkeys = dictSize(server.db[j].expires);
+        if (keys || vkeys) {
+            info = sdscatprintf(info, "db%d: keys=%lld,expires=%lld\r\n",
+                j, keys, vkeys);
+        }
+    }
+reply:
+    addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n",sdslen(info)));
+    addReplySds(c,info);
+    addReply(c,shared.crlf);
+}
+
+/* CONFIG SET <parameter> <value>. Only the parameters that are safe to
+ * change at runtime are supported. */
+static void configSetCommand(redisClient *c) {
+    char *param = c->argv[2]->ptr, *eptr;
+    long long ll = strtoll(c->argv[3]->ptr,&eptr,10);
+
+    if (eptr[0] != '\0' || eptr == (char*)c->argv[3]->ptr) {
+        addReplySds(c,sdsnew("-ERR invalid value for CONFIG SET\r\n"));
+        return;
+    }
+    if (!strcasecmp(param,"slowlog-log-slower-than")) {
+        server.slowlog_log_slower_than = ll;
+    } else if (!strcasecmp(param,"slowlog-max-len") && ll >= 0) {
+        server.slowlog_max_len = (unsigned long)ll;
+        while (listLength(server.slowlog) > server.slowlog_max_len)
+            listDelNode(server.slowlog,listLast(server.slowlog));
+    } else if (!strcasecmp(param,"latency-monitor-threshold") && ll >= 0) {
+        server.latency_monitor_threshold = ll;
+    } else if (!strcasecmp(param,"watchdog-period") && ll >= 0 && ll <= INT_MAX) {
+        server.watchdog_period = (int)ll;
+        /* Disarm now, or rearm with the new period */
+        watchdogScheduleSignal(server.watchdog_period);
+    } else {
+        addReplySds(c,sdscatprintf(sdsempty(),
+            "-ERR invalid CONFIG SET parameter or value for '%s'\r\n",param));
+        return;
+    }
+    addReply(c,shared.ok);
+}
+
+/* CONFIG RESETSTAT: reset the stats reported by INFO */
+static void configCommand(redisClient *c) {
+    if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"resetstat")) {
+        server.stat_numcommands = 0;
+        server.stat_numconnections = 0;
+        resetKeyspaceStats();
+        resetCommandStats();
+        addReply(c,shared.ok);
+    } else if (c->argc == 4 && !strcasecmp(c->argv[1]->ptr,"set")) {
+        configSetCommand(c);
+    } else {
+        addReplySds(c,sdsnew("-ERR CONFIG subcommand must be RESETSTAT or SET\r\n"));
+    }
+}
+
+/* Latency monitor: the internal events that can block the server are timed
+ * when latency-monitor-threshold is set, the ones taking at least the
+ * threshold (in milliseconds) are logged in a per event circular buffer. */
+
+static void latencyAddSampleIfNeeded(int event, long long usec) {
+    struct latencyTimeSeries *ts = latencyEvents+event;
+    long long ms = usec/1000;
+    time_t now;
+    int prev;
+
+    if (!server.latency_monitor_threshold ||
+        ms < server.latency_monitor_threshold) return;
+    now = time(NULL);
+    if ((uint32_t)ms > ts->max) ts->max = (uint32_t)ms;
+    prev = (ts->idx+REDIS_LATENCY_TS_LEN-1) % REDIS_LATENCY_TS_LEN;
+    if (ts->samples[prev].time == now) {
+        if ((uint32_t)ms > ts->samples[prev].latency)
+            ts->samples[prev].latency = (uint32_t)ms;
+        return;
+    }
+    ts->samples[ts->idx].time = (int32_t)now;
+    ts->samples[ts->idx].latency = (uint32_t)ms;
+    ts->idx = (ts->idx+1) % REDIS_LATENCY_TS_LEN;
+}
 
-        keys = dictSize(server.db[j].dict);
-        vkeys = dictSize(server.db[j].expires);
-        if (keys || vkeys) {
-            info = sdscatprintf(info, "db%d: keys=%lld,expires=%lld\r\n",
-                j, keys, vkeys);
+static void latencyRehashProc(unsigned long elements, long long usec) {
+    REDIS_NOTUSED(elements);
+    latencyAddSampleIfNeeded(REDIS_LATENCY_REHASH,usec);
+}
+
+static int latencyEventByName(char *name) {
+    int j;
+
+    for (j = 0; j < REDIS_LATENCY_EVENTS; j++)
+        if (!strcasecmp(name,latencyEventNames[j])) return j;
+    return -1;
+}
+
+/* Returns 1 if the event had samples */
+static int latencyResetEvent(int event) {
+    int hadsamples = latencyEvents[event].max != 0;
+
+    memset(latencyEvents+event,0,sizeof(latencyEvents[event]));
+    return hadsamples;
+}
+
+/* LATENCY LATEST: name, time, latency and max latency of every event with
+ * samples. LATENCY HISTORY <event>: time and latency of the samples, the
+ * oldest first. LATENCY RESET: drop the samples of all or of the given
+ * events, replies with the number of events that had samples. */
+static void latencyCommand(redisClient *c) {
+    char *sub = c->argv[1]->ptr;
+    int j, event, count = 0;
+
+    if (c->argc == 2 && !strcasecmp(sub,"latest")) {
+        for (j = 0; j < REDIS_LATENCY_EVENTS; j++)
+            if (latencyEvents[j].max) count++;
+        addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",count));
+        for (j = 0; j < REDIS_LATENCY_EVENTS; j++) {
+            struct latencyTimeSeries *ts = latencyEvents+j;
+            struct latencySample *last;
+
+            if (!ts->max) continue;
+            last = ts->samples+(ts->idx+REDIS_LATENCY_TS_LEN-1)%REDIS_LATENCY_TS_LEN;
+            addReplySds(c,sdscatprintf(sdsempty(),
+                "*4\r\n$%d\r\n%s\r\n:%ld\r\n:%lu\r\n:%lu\r\n",
+                (int)strlen(latencyEventNames[j]),latencyEventNames[j],
+                (long)last->time,(unsigned long)last->latency,
+                (unsigned long)ts->max));
+        }
+    } else if (c->argc == 3 && !strcasecmp(sub,"history")) {
+        struct latencyTimeSeries *ts;
+
+        if ((event = latencyEventByName(c->argv[2]->ptr)) == -1) {
+            addReplySds(c,sdsnew("-ERR unknown latency event\r\n"));
+            return;
+        }
+        ts = latencyEvents+event;
+        for (j = 0; j < REDIS_LATENCY_TS_LEN; j++)
+            if (ts->samples[j].time) count++;
+        addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",count));
+        for (j = 0; j < REDIS_LATENCY_TS_LEN; j++) {
+            struct latencySample *sample =
+                ts->samples+(ts->idx+j)%REDIS_LATENCY_TS_LEN;
+
+            if (!sample->time) continue;
+            addReplySds(c,sdscatprintf(sdsempty(),"*2\r\n:%ld\r\n:%lu\r\n",
+                (long)sample->time,(unsigned long)sample->latency));
+        }
+    } else if (!strcasecmp(sub,"reset")) {
+        if (c->argc == 2) {
+            for (j = 0; j < REDIS_LATENCY_EVENTS; j++)
+                count += latencyResetEvent(j);
+        } else {
+            for (j = 2; j < c->argc; j++) {
+                if ((event = latencyEventByName(c->argv[j]->ptr)) != -1)
+                    count += latencyResetEvent(event);
+            }
         }
+        addReplySds(c,sdscatprintf(sdsempty(),":%d\r\n",count));
+    } else {
+        addReplySds(c,sdsnew("-ERR LATENCY subcommand must be LATEST, HISTORY or RESET\r\n"));
+    }
+}
+
+/* SLOWLOG GET [count] | LEN | RESET
+ *
+ * GET replies with the newest <count> entries (10 by default, all of them if
+ * negative), every one a multi bulk of id, unix time, duration in
+ * microseconds, the logged arguments and the client address. */
+static void slowlogCommand(redisClient *c) {
+    char *sub = c->argv[1]->ptr;
+
+    if (c->argc == 2 && !strcasecmp(sub,"reset")) {
+        while (listLength(server.slowlog) > 0)
+            listDelNode(server.slowlog,listLast(server.slowlog));
+        addReply(c,shared.ok);
+    } else if (c->argc == 2 && !strcasecmp(sub,"len")) {
+        addReplySds(c,sdscatprintf(sdsempty(),":%lu\r\n",
+            (unsigned long)listLength(server.slowlog)));
+    } else if ((c->argc == 2 || c->argc == 3) && !strcasecmp(sub,"get")) {
+        long count = c->argc == 3 ? strtol(c->argv[2]->ptr,NULL,10) : 10;
+        listNode *ln = listFirst(server.slowlog);
+        int j;
+
+        if (count < 0 || (unsigned long)count > listLength(server.slowlog))
+            count = listLength(server.slowlog);
+        addReplySds(c,sdscatprintf(sdsempty(),"*%ld\r\n",count));
+        while (count--) {
+            slowlogEntry *se = listNodeValue(ln);
+
+            addReplySds(c,sdscatprintf(sdsempty(),
+                "*5\r\n:%lld\r\n:%ld\r\n:%lld\r\n*%d\r\n",
+                se->id,(long)se->time,se->duration,se->argc));
+            for (j = 0; j < se->argc; j++) {
+                sds reply = sdscatprintf(sdsempty(),"$%d\r\n",
+                    (int)sdslen(se->argv[j]));
+
+                reply = sdscatlen(reply,se->argv[j],sdslen(se->argv[j]));
+                addReplySds(c,sdscatlen(reply,"\r\n",2));
+            }
+            addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n%s\r\n",
+                (int)strlen(se->addr),se->addr));
+            ln = ln->next;
+        }
+    } else {
+        addReplySds(c,sdsnew("-ERR SLOWLOG subcommand must be GET, LEN or RESET\r\n"));
     }
-    addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n",sdslen(info)));
-    addReplySds(c,info);
-    addReply(c,shared.crlf);
 }
 
+/* MONITOR [CAPTURE]
+ *
+ * With CAPTURE, after the +OK the client receives the binary records of
+ * captureFeedMonitors() instead of the commands in the protocol format. */
 static void monitorCommand(redisClient *c) {
+    int capture = 0;
+
+    if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"capture")) {
+        capture = 1;
+    } else if (c->argc != 1) {
+        addReplySds(c,sdsnew("-ERR syntax error\r\n"));
+        return;
+    }
     /* ignore MONITOR if aleady slave or in monitor mode */
     if (c->flags & REDIS_SLAVE) return;
 
     c->flags |= (REDIS_SLAVE|REDIS_MONITOR);
     c->slaveseldb = 0;
-    if (!listAddNodeTail(server.monitors,c)) oom("listAddNodeTail");
+    if (capture) c->flags |= REDIS_CAPTURE;
+    if (!listAddNodeTail(capture ? server.capturemonitors : server.monitors,c))
+        oom("listAddNodeTail");
     addReply(c,shared.ok);
 }
 
@@ -3729,8 +5755,8 @@ static int expireIfNeeded(redisDb *db, robj *key) {
     if (time(NULL) <= when) return 0;
 
     /* Delete the key */
-    dictDelete(db->expires,key);
-    return dictDelete(db->dict,key) == DICT_OK;
+    server.stat_expired_lazy++;
+    return dbAsyncDelete(db,key);
 }
 
 static int deleteIfVolatile(redisDb *db, robj *key) {
@@ -3740,10 +5766,11 @@ static int deleteIfVolatile(redisDb *db, robj *key) {
     if (dictSize(db->expires) == 0 ||
        (de = dictFind(db->expires,key)) == NULL) return 0;
 
-    /* Delete the key */
+    /* Delete the key. Volatile keys are deleted by writes even before
+     * their expire time: only the ones already expired are accounted. */
+    if (time(NULL) > (time_t) dictGetEntryVal(de)) server.stat_expired_lazy++;
     server.dirty++;
-    dictDelete(db->expires,key);
-    return dictDelete(db->dict,key) == DICT_OK;
+    return dbAsyncDelete(db,key);
 }
 
 static void expireCommand(redisClient *c) {
@@ -3804,46 +5831,134 @@ static int syncWrite(int fd, char *ptr, ssize_t size, int timeout) {
     return ret;
 }
 
-static int syncRead(int fd, char *ptr, ssize_t size, int timeout) {
-    ssize_t nread, totread = 0;
-    time_t start = time(NULL);
+/* ----------------------- Replication backlog (master) -------------------- */
+
+/* The backlog is a circular buffer holding the last repl_backlog_size bytes
+ * of the replication stream we send to slaves. Together with our replication
+ * ID and the master_repl_offset it allows a slave that lost the link for a
+ * short time to ask for just the part of the stream it missed (PSYNC)
+ * instead of a full resynchronization. */
+static void createReplicationBacklog(void) {
+    server.repl_backlog = zmalloc(server.repl_backlog_size);
+    if (!server.repl_backlog) oom("createReplicationBacklog");
+    server.repl_backlog_histlen = 0;
+    server.repl_backlog_idx = 0;
+    /* The first byte we'll accumulate is the next one of the stream */
+    server.repl_backlog_off = server.master_repl_offset+1;
+}
+
+/* Append data to the replication backlog, updating the stream offset */
+static void feedReplicationBacklog(void *ptr, size_t len) {
+    unsigned char *p = ptr;
+
+    server.master_repl_offset += len;
+    while(len) {
+        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
+
+        if (thislen > len) thislen = len;
+        memcpy(server.repl_backlog+server.repl_backlog_idx,p,thislen);
+        server.repl_backlog_idx += thislen;
+        if (server.repl_backlog_idx == server.repl_backlog_size)
+            server.repl_backlog_idx = 0;
+        len -= thislen;
+        p += thislen;
+        server.repl_backlog_histlen += thislen;
+    }
+    if (server.repl_backlog_histlen > server.repl_backlog_size)
+        server.repl_backlog_histlen = server.repl_backlog_size;
+    server.repl_backlog_off = server.master_repl_offset -
+                              server.repl_backlog_histlen + 1;
+}
+
+/* Queue to the slave all the backlog data starting at 'offset'. The caller
+ * must already have checked the offset is inside the backlog. */
+static void addReplyReplicationBacklog(redisClient *c, long long offset) {
+    long long j, skip, len;
+
+    skip = offset - server.repl_backlog_off;
+    /* Index of the oldest byte in the circular buffer */
+    j = (server.repl_backlog_idx +
+        (server.repl_backlog_size-server.repl_backlog_histlen)) %
+        server.repl_backlog_size;
+    j = (j + skip) % server.repl_backlog_size;
+    len = server.repl_backlog_histlen - skip;
+    while(len) {
+        long long thislen = server.repl_backlog_size - j;
+
+        if (thislen > len) thislen = len;
+        addReplySds(c,sdsnewlen(server.repl_backlog+j,thislen));
+        len -= thislen;
+        j = 0;
+    }
+}
+
+/* Try to serve a PSYNC <replid> <offset> request continuing the replication
+ * stream from the backlog. Returns REDIS_OK if the slave was attached,
+ * REDIS_ERR if a full resynchronization is needed. */
+static int masterTryPartialResynchronization(redisClient *c) {
+    char *replid = c->argv[1]->ptr;
+    long long offset = strtoll(c->argv[2]->ptr,NULL,10);
+    char *buf = "+CONTINUE\r\n";
+
+    if (strcasecmp(replid,server.replid) != 0) {
+        if (replid[0] != '?')
+            redisLog(REDIS_NOTICE,"Partial resynchronization not accepted: replication ID mismatch");
+        return REDIS_ERR;
+    }
+    if (!server.repl_backlog || offset < server.repl_backlog_off ||
+        offset > server.repl_backlog_off + server.repl_backlog_histlen)
+    {
+        redisLog(REDIS_NOTICE,"Unable to partial resync with the slave: offset %lld out of the backlog range",offset);
+        return REDIS_ERR;
+    }
 
-    timeout++;
-    while(size) {
-        if (aeWait(fd,AE_READABLE,1000) & AE_READABLE) {
-            nread = read(fd,ptr,size);
-            if (nread == -1) return -1;
-            ptr += nread;
-            size -= nread;
-            totread += nread;
-        }
-        if ((time(NULL)-start) > timeout) {
-            errno = ETIMEDOUT;
-            return -1;
-        }
+    /* We can continue the stream. The +CONTINUE line is written directly
+     * to the socket since the output buffer must contain just the stream. */
+    if (write(c->fd,buf,strlen(buf)) != (signed)strlen(buf)) {
+        c->flags |= REDIS_CLOSE;
+        return REDIS_OK;
+    }
+    c->flags |= REDIS_SLAVE;
+    c->replstate = REDIS_REPL_ONLINE;
+    c->repldbfd = -1;
+    if (!listAddNodeTail(server.slaves,c)) oom("listAddNodeTail");
+    addReplyReplicationBacklog(c,offset);
+    redisLog(REDIS_NOTICE,"Partial resynchronization accepted, sending %lld bytes of backlog",
+        server.repl_backlog_off+server.repl_backlog_histlen-offset);
+    return REDIS_OK;
+}
+
+/* Called when a slave is going to receive the RDB file produced by the
+ * BGSAVE started at replication offset 'offset': remember the offset and,
+ * if the slave talks PSYNC, tell it where its stream starts. */
+static void replicationSetupSlaveForFullResync(redisClient *slave, long long offset) {
+    slave->replinitoff = offset;
+    slave->replstate = REDIS_REPL_WAIT_BGSAVE_END;
+    /* Force a SELECT to be emitted as first thing of the new stream */
+    server.slaveseldb = -1;
+    if (!(slave->flags & REDIS_PRE_PSYNC)) {
+        sds buf = sdscatprintf(sdsempty(),"+FULLRESYNC %s %lld\r\n",
+            server.replid,offset);
+
+        if (write(slave->fd,buf,sdslen(buf)) != (signed)sdslen(buf))
+            slave->flags |= REDIS_CLOSE;
+        sdsfree(buf);
     }
-    return totread;
 }
 
-static int syncReadLine(int fd, char *ptr, ssize_t size, int timeout) {
-    ssize_t nread = 0;
+/* Queue to 'dst' the replication stream accumulated by 'src' while waiting
+ * for the BGSAVE to end. The objects are shared, only the list nodes are
+ * allocated. */
+static void copyReplicationReplies(redisClient *dst, redisClient *src) {
+    listNode *ln;
 
-    size--;
-    while(size) {
-        char c;
+    listRewind(src->reply);
+    while((ln = listYield(src->reply))) {
+        robj *o = ln->value;
 
-        if (syncRead(fd,&c,1,timeout) == -1) return -1;
-        if (c == '\n') {
-            *ptr = '\0';
-            if (nread && *(ptr-1) == '\r') *(ptr-1) = '\0';
-            return nread;
-        } else {
-            *ptr++ = c;
-            *ptr = '\0';
-            nread++;
-        }
+        if (!listAddNodeTail(dst->reply,o)) oom("listAddNodeTail");
+        incrRefCount(o);
     }
-    return nread;
 }
 
 static void syncCommand(redisClient *c) {
@@ -3859,6 +5974,16 @@ static void syncCommand(redisClient *c) {
         return;
     }
 
+    /* The backlog is created as soon as we get the first slave, and from
+     * then on it accumulates our replication stream. */
+    if (server.repl_backlog == NULL) createReplicationBacklog();
+
+    if (!strcasecmp(c->argv[0]->ptr,"psync")) {
+        if (masterTryPartialResynchronization(c) == REDIS_OK) return;
+    } else {
+        c->flags |= REDIS_PRE_PSYNC;
+    }
+
     redisLog(REDIS_NOTICE,"Slave ask for synchronization");
     /* Here we need to check if there is a background saving operation
      * in progress, or if it is required to start one */
@@ -3876,11 +6001,10 @@ static void syncCommand(redisClient *c) {
         }
         if (ln) {
             /* Perfect, the server is already registering differences for
-             * another slave. Set the right state, and copy the buffer. */
-            listRelease(c->reply);
-            c->reply = listDup(slave->reply);
-            if (!c->reply) oom("listDup copying slave reply list");
-            c->replstate = REDIS_REPL_WAIT_BGSAVE_END;
+             * another slave. Set the right state, and reference the same
+             * already encoded commands in our output queue. */
+            copyReplicationReplies(c,slave);
+            replicationSetupSlaveForFullResync(c,slave->replinitoff);
             redisLog(REDIS_NOTICE,"Waiting for end of BGSAVE for SYNC");
         } else {
             /* No way, we need to wait for the next BGSAVE in order to
@@ -3896,7 +6020,7 @@ static void syncCommand(redisClient *c) {
             addReplySds(c,sdsnew("-ERR Unalbe to perform background save\r\n"));
             return;
         }
-        c->replstate = REDIS_REPL_WAIT_BGSAVE_END;
+        replicationSetupSlaveForFullResync(c,server.master_repl_offset);
     }
     c->repldbfd = -1;
     c->flags |= REDIS_SLAVE;
@@ -3975,7 +6099,6 @@ static void updateSlavesWaitingBgsave(int bgsaveerr) {
 
         if (slave->replstate == REDIS_REPL_WAIT_BGSAVE_START) {
             startbgsave = 1;
-            slave->replstate = REDIS_REPL_WAIT_BGSAVE_END;
         } else if (slave->replstate == REDIS_REPL_WAIT_BGSAVE_END) {
             struct redis_stat buf;
            
@@ -4001,91 +6124,339 @@ static void updateSlavesWaitingBgsave(int bgsaveerr) {
         }
     }
     if (startbgsave) {
-        if (rdbSaveBackground(server.dbfilename) != REDIS_OK) {
-            listRewind(server.slaves);
+        int retval = rdbSaveBackground(server.dbfilename);
+
+        if (retval != REDIS_OK)
             redisLog(REDIS_WARNING,"SYNC failed. BGSAVE failed");
-            while((ln = listYield(server.slaves))) {
-                redisClient *slave = ln->value;
+        listRewind(server.slaves);
+        while((ln = listYield(server.slaves))) {
+            redisClient *slave = ln->value;
 
-                if (slave->replstate == REDIS_REPL_WAIT_BGSAVE_START)
-                    freeClient(slave);
+            if (slave->replstate != REDIS_REPL_WAIT_BGSAVE_START) continue;
+            if (retval != REDIS_OK) {
+                freeClient(slave);
+            } else {
+                replicationSetupSlaveForFullResync(slave,
+                    server.master_repl_offset);
             }
         }
     }
 }
 
-static int syncWithMaster(void) {
-    char buf[1024], tmpfile[256];
-    int dumpsize;
-    int fd = anetTcpConnect(NULL,server.masterhost,server.masterport);
-    int dfd;
+/* Forget everything we know about the replication stream of our master, so
+ * that the next synchronization will be a full one. */
+static void resetReplicationMasterState(void) {
+    strcpy(server.repl_master_replid,"?");
+    server.repl_master_offset = -1;
+    server.repl_master_seldb = 0;
+}
+
+/* After a full resynchronization our dataset is a different one: our own
+ * slaves can't continue their stream, so change replication ID, drop the
+ * backlog history, and disconnect them. */
+static void replicationNewDataset(void) {
+    /* What we knew about the master stream is no longer valid for the
+     * dataset we are going to load */
+    resetReplicationMasterState();
+    getRandomHexChars(server.replid,REDIS_REPLID_LEN);
+    server.repl_backlog_histlen = 0;
+    server.repl_backlog_idx = 0;
+    server.repl_backlog_off = server.master_repl_offset+1;
+    while(listLength(server.slaves))
+        freeClient(listNodeValue(listFirst(server.slaves)));
+}
+
+/* Attach the master link as a client, continuing the replication stream */
+static void replicationCreateMasterClient(int fd, int dbid) {
+    server.master = createClient(fd);
+    server.master->flags |= REDIS_MASTER;
+    selectDb(server.master,dbid);
+    server.replstate = REDIS_REPL_CONNECTED;
+}
+
+/* Abort a synchronization with the master that is in progress. The next
+ * serverCron() will try to connect again. */
+static void cancelReplicationHandshake(void) {
+    aeDeleteFileEvent(server.el,server.repl_transfer_s,AE_READABLE);
+    aeDeleteFileEvent(server.el,server.repl_transfer_s,AE_WRITABLE);
+    close(server.repl_transfer_s);
+    server.repl_transfer_s = -1;
+    if (server.repl_transfer_fd != -1) {
+        unlink(server.repl_transfer_tmpfile);
+        bioCreateBackgroundJob(REDIS_BIO_CLOSE_FILE,
+            (void*)(long)server.repl_transfer_fd,NULL);
+        server.repl_transfer_fd = -1;
+    }
+    server.repl_transfer_linelen = 0;
+    server.replstate = REDIS_REPL_CONNECT;
+}
+
+/* Start a non blocking connection with the master. The synchronization
+ * itself is driven by syncWithMaster() as the socket becomes ready. */
+static int connectWithMaster(void) {
+    int fd = anetTcpNonBlockConnect(NULL,server.masterhost,server.masterport);
 
     if (fd == -1) {
         redisLog(REDIS_WARNING,"Unable to connect to MASTER: %s",
             strerror(errno));
         return REDIS_ERR;
     }
-    /* Issue the SYNC command */
-    if (syncWrite(fd,"SYNC \r\n",7,5) == -1) {
+    if (aeCreateFileEvent(server.el,fd,AE_WRITABLE,syncWithMaster,NULL,NULL)
+        == AE_ERR)
+    {
         close(fd);
-        redisLog(REDIS_WARNING,"I/O error writing to MASTER: %s",
-            strerror(errno));
+        redisLog(REDIS_WARNING,"Can't create the file event for SYNC");
         return REDIS_ERR;
     }
-    /* Read the bulk write count */
-    if (syncReadLine(fd,buf,1024,3600) == -1) {
-        close(fd);
-        redisLog(REDIS_WARNING,"I/O error reading bulk count from MASTER: %s",
-            strerror(errno));
-        return REDIS_ERR;
+    server.repl_transfer_s = fd;
+    server.repl_transfer_fd = -1;
+    server.repl_transfer_linelen = 0;
+    server.repl_transfer_lastio = time(NULL);
+    server.replstate = REDIS_REPL_CONNECTING;
+    return REDIS_OK;
+}
+
+/* Read a line sent by the master without blocking. Bytes are consumed one
+ * by one since the DB payload follows and must not be read here. Returns 1
+ * when a full line is in server.repl_transfer_line, 0 if more data is needed,
+ * -1 on error. */
+static int replicationReadLine(int fd) {
+    while(1) {
+        char c;
+        ssize_t nread = read(fd,&c,1);
+
+        if (nread == -1 && errno == EAGAIN) return 0;
+        if (nread <= 0) return -1;
+        server.repl_transfer_lastio = time(NULL);
+        if (c == '\n') {
+            int len = server.repl_transfer_linelen;
+
+            if (len && server.repl_transfer_line[len-1] == '\r') len--;
+            server.repl_transfer_line[len] = '\0';
+            server.repl_transfer_linelen = 0;
+            return 1;
+        }
+        if (server.repl_transfer_linelen ==
+            (signed)sizeof(server.repl_transfer_line)-1) return -1;
+        server.repl_transfer_line[server.repl_transfer_linelen++] = c;
     }
-    dumpsize = atoi(buf+1);
-    redisLog(REDIS_NOTICE,"Receiving %d bytes data dump from MASTER",dumpsize);
-    /* Read the bulk write data on a temp file */
-    snprintf(tmpfile,256,"temp-%d.%ld.rdb",(int)time(NULL),(long int)random());
-    dfd = open(tmpfile,O_CREAT|O_WRONLY,0644);
-    if (dfd == -1) {
-        close(fd);
-        redisLog(REDIS_WARNING,"Opening the temp file needed for MASTER <-> SLAVE synchronization: %s",strerror(errno));
-        return REDIS_ERR;
+}
+
+/* Send PSYNC once connected to the master. We try a partial resynchronization
+ * first: if we know the replication ID of the master and our offset, the
+ * master may be able to just send the part of the stream we missed.
+ * Otherwise PSYNC ? -1 forces a full resynchronization. */
+static int replicationSendPsync(int fd) {
+    sds psync;
+    int retval;
+
+    if (server.repl_master_replid[0] == '?') {
+        psync = sdsnew("PSYNC ? -1\r\n");
+    } else {
+        psync = sdscatprintf(sdsempty(),"PSYNC %s %lld\r\n",
+            server.repl_master_replid, server.repl_master_offset+1);
     }
-    while(dumpsize) {
-        int nread, nwritten;
+    retval = syncWrite(fd,psync,sdslen(psync),5);
+    sdsfree(psync);
+    return (retval == -1) ? REDIS_ERR : REDIS_OK;
+}
 
-        nread = read(fd,buf,(dumpsize < 1024)?dumpsize:1024);
-        if (nread == -1) {
-            redisLog(REDIS_WARNING,"I/O error trying to sync with MASTER: %s",
-                strerror(errno));
-            close(fd);
-            close(dfd);
+/* Handle the reply to PSYNC. Returns REDIS_OK if the DB transfer should
+ * follow, otherwise REDIS_ERR. On +CONTINUE the master link is created
+ * and server.replstate is set to REDIS_REPL_CONNECTED. */
+static int replicationHandlePsyncReply(int fd) {
+    char *buf = server.repl_transfer_line;
+
+    if (!strncmp(buf,"+CONTINUE",9)) {
+        redisLog(REDIS_NOTICE,"MASTER <-> SLAVE partial resynchronization accepted");
+        aeDeleteFileEvent(server.el,fd,AE_READABLE);
+        server.repl_transfer_s = -1;
+        replicationCreateMasterClient(fd,server.repl_master_seldb);
+        return REDIS_OK;
+    } else if (!strncmp(buf,"+FULLRESYNC ",12)) {
+        char *offset = strchr(buf+12,' ');
+
+        if (offset == NULL || offset-(buf+12) != REDIS_REPLID_LEN) {
+            redisLog(REDIS_WARNING,"Bad FULLRESYNC reply from MASTER: %s",buf);
             return REDIS_ERR;
         }
-        nwritten = write(dfd,buf,nread);
-        if (nwritten == -1) {
-            redisLog(REDIS_WARNING,"Write error writing to the DB dump file needed for MASTER <-> SLAVE synchrnonization: %s", strerror(errno));
-            close(fd);
-            close(dfd);
+        /* Used only once the new DB is loaded */
+        memcpy(server.repl_transfer_replid,buf+12,REDIS_REPLID_LEN);
+        server.repl_transfer_replid[REDIS_REPLID_LEN] = '\0';
+        server.repl_transfer_offset = strtoll(offset+1,NULL,10);
+        redisLog(REDIS_NOTICE,"Full resync from MASTER: %s:%lld",
+            server.repl_transfer_replid, server.repl_transfer_offset);
+    } else if (buf[0] == '-') {
+        /* An old master not supporting PSYNC: use SYNC on the same link */
+        redisLog(REDIS_NOTICE,"MASTER does not support PSYNC, using SYNC");
+        strcpy(server.repl_transfer_replid,"?");
+        server.repl_transfer_offset = -1;
+        if (syncWrite(fd,"SYNC \r\n",7,5) == -1) {
+            redisLog(REDIS_WARNING,"I/O error writing to MASTER: %s",
+                strerror(errno));
             return REDIS_ERR;
         }
-        dumpsize -= nread;
-    }
-    close(dfd);
-    if (rename(tmpfile,server.dbfilename) == -1) {
-        redisLog(REDIS_WARNING,"Failed trying to rename the temp DB into dump.rdb in MASTER <-> SLAVE synchronization: %s", strerror(errno));
-        unlink(tmpfile);
-        close(fd);
+    } else {
+        redisLog(REDIS_WARNING,"Unexpected reply to PSYNC from MASTER: %s",buf);
         return REDIS_ERR;
     }
+    server.repl_transfer_size = -1;
+    server.replstate = REDIS_REPL_TRANSFER;
+    return REDIS_OK;
+}
+
+/* The synchronization with the master as a state machine driven by the
+ * events of the master socket: CONNECTING -> RECEIVE_PSYNC -> TRANSFER,
+ * then the DB is loaded and the link becomes a normal master client.
+ * The DB is received into a temp file, or parsed directly from the socket
+ * when repl-diskless-load is enabled. */
+static void syncWithMaster(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[REDIS_REPL_TRANSFER_BUFLEN];
+    ssize_t nread, toread;
+    rdbInput rdb;
+    int retval;
+    REDIS_NOTUSED(privdata);
+    REDIS_NOTUSED(mask);
+
+    if (server.replstate == REDIS_REPL_CONNECTING) {
+        int sockerr = 0;
+        socklen_t errlen = sizeof(sockerr);
+
+        aeDeleteFileEvent(el,fd,AE_WRITABLE);
+        if (getsockopt(fd,SOL_SOCKET,SO_ERROR,&sockerr,&errlen) == -1)
+            sockerr = errno;
+        if (sockerr) {
+            redisLog(REDIS_WARNING,"Unable to connect to MASTER: %s",
+                strerror(sockerr));
+            goto error;
+        }
+        if (replicationSendPsync(fd) == REDIS_ERR) {
+            redisLog(REDIS_WARNING,"I/O error writing to MASTER: %s",
+                strerror(errno));
+            goto error;
+        }
+        if (aeCreateFileEvent(el,fd,AE_READABLE,syncWithMaster,NULL,NULL)
+            == AE_ERR) goto error;
+        server.repl_transfer_lastio = time(NULL);
+        server.replstate = REDIS_REPL_RECEIVE_PSYNC;
+        return;
+    }
+
+    if (server.replstate == REDIS_REPL_RECEIVE_PSYNC) {
+        if ((retval = replicationReadLine(fd)) == 0) return;
+        if (retval == -1) {
+            redisLog(REDIS_WARNING,"I/O error reading PSYNC reply from MASTER");
+            goto error;
+        }
+        if (replicationHandlePsyncReply(fd) == REDIS_ERR) goto error;
+        return;
+    }
+
+    /* REDIS_REPL_TRANSFER: read the bulk count first */
+    if (server.repl_transfer_size == -1) {
+        if ((retval = replicationReadLine(fd)) == 0) return;
+        if (retval == -1) {
+            redisLog(REDIS_WARNING,"I/O error reading bulk count from MASTER");
+            goto error;
+        }
+        if (server.repl_transfer_line[0] == '-') {
+            redisLog(REDIS_WARNING,"MASTER aborted replication with an error: %s",
+                server.repl_transfer_line+1);
+            goto error;
+        } else if (server.repl_transfer_line[0] != '$') {
+            redisLog(REDIS_WARNING,"Bad protocol from MASTER, the first byte is not '$', are you sure the host and port are right?");
+            goto error;
+        }
+        server.repl_transfer_size = strtoll(server.repl_transfer_line+1,NULL,10);
+        server.repl_transfer_read = 0;
+        redisLog(REDIS_NOTICE,"Receiving %lld bytes data dump from MASTER",
+            server.repl_transfer_size);
+
+        if (server.repl_diskless_load) {
+            /* Parse the DB as it arrives. The event loop is still served
+             * while loading, but this socket is read by the loader only. */
+            aeDeleteFileEvent(el,fd,AE_READABLE);
+            replicationNewDataset();
+            emptyDb();
+            startLoading(server.repl_transfer_size);
+            retval = rdbLoadFromSocket(fd,server.repl_transfer_size);
+            stopLoading();
+            if (retval != REDIS_OK) {
+                redisLog(REDIS_WARNING,"Failed trying to load the MASTER synchronization DB from socket");
+                /* Don't serve a partial dataset */
+                emptyDb();
+                goto error;
+            }
+            goto done;
+        }
+        snprintf(server.repl_transfer_tmpfile,256,
+            "temp-%d.%d.rdb",(int)time(NULL),(int)getpid());
+        server.repl_transfer_fd = open(server.repl_transfer_tmpfile,
+            O_CREAT|O_WRONLY|O_TRUNC,0644);
+        if (server.repl_transfer_fd == -1) {
+            redisLog(REDIS_WARNING,"Opening the temp file needed for MASTER <-> SLAVE synchronization: %s",strerror(errno));
+            goto error;
+        }
+        return;
+    }
+
+    /* Read the next chunk of the DB into the temp file */
+    toread = server.repl_transfer_size - server.repl_transfer_read;
+    if (toread > (signed)sizeof(buf)) toread = sizeof(buf);
+    if (toread) {
+        nread = read(fd,buf,toread);
+        if (nread == -1 && errno == EAGAIN) return;
+        if (nread <= 0) {
+            redisLog(REDIS_WARNING,"I/O error trying to sync with MASTER: %s",
+                (nread == -1) ? strerror(errno) : "connection lost");
+            goto error;
+        }
+        server.repl_transfer_lastio = time(NULL);
+        if (write(server.repl_transfer_fd,buf,nread) != nread) {
+            redisLog(REDIS_WARNING,"Write error writing to the DB dump file needed for MASTER <-> SLAVE synchrnonization: %s", strerror(errno));
+            goto error;
+        }
+        server.repl_transfer_read += nread;
+        if (server.repl_transfer_read < server.repl_transfer_size) return;
+    }
+
+    /* The whole DB was received: load it. The file is flushed on disk and
+     * closed by a background job. */
+    aeDeleteFileEvent(el,fd,AE_READABLE);
+    bioCreateBackgroundJob(REDIS_BIO_FSYNC,
+        (void*)(long)server.repl_transfer_fd,(void*)1);
+    server.repl_transfer_fd = -1;
+    /* Load the temp file first: the checksum is verified while loading,
+     * and our DB file is replaced only by a DB that loaded fine. */
+    replicationNewDataset();
     emptyDb();
-    if (rdbLoad(server.dbfilename) != REDIS_OK) {
-        redisLog(REDIS_WARNING,"Failed trying to load the MASTER synchronization DB from disk");
-        close(fd);
-        return REDIS_ERR;
+    startLoading(server.repl_transfer_size);
+    retval = rdbLoadFile(server.repl_transfer_tmpfile,&rdb);
+    stopLoading();
+    if (retval != REDIS_OK) {
+        redisLog(REDIS_WARNING,"Failed trying to load the MASTER synchronization DB from disk%s",
+            rdb.badchecksum ? ": the DB is corrupted" : "");
+        /* Don't serve a partially loaded dataset */
+        emptyDb();
+        unlinkFileInBackground(server.repl_transfer_tmpfile);
+        goto error;
+    }
+    /* The dataset is loaded anyway, the next save will write our DB file */
+    if (renameFileInBackground(server.repl_transfer_tmpfile,server.dbfilename) == -1) {
+        redisLog(REDIS_WARNING,"Failed trying to rename the temp DB into dump.rdb in MASTER <-> SLAVE synchronization: %s", strerror(errno));
+        unlinkFileInBackground(server.repl_transfer_tmpfile);
     }
-    server.master = createClient(fd);
-    server.master->flags |= REDIS_MASTER;
-    server.replstate = REDIS_REPL_CONNECTED;
-    return REDIS_OK;
+
+done:
+    strcpy(server.repl_master_replid,server.repl_transfer_replid);
+    server.repl_master_offset = server.repl_transfer_offset;
+    server.repl_transfer_s = -1;
+    replicationCreateMasterClient(fd,0);
+    redisLog(REDIS_NOTICE,"MASTER <-> SLAVE sync succeeded");
+    return;
+
+error:
+    cancelReplicationHandshake();
 }
 
 static void slaveofCommand(redisClient *c) {
@@ -4095,6 +6466,7 @@ static void slaveofCommand(redisClient *c) {
             sdsfree(server.masterhost);
             server.masterhost = NULL;
             if (server.master) freeClient(server.master);
+            if (server.repl_transfer_s != -1) cancelReplicationHandshake();
             server.replstate = REDIS_REPL_NONE;
             redisLog(REDIS_NOTICE,"MASTER MODE enabled (user request)");
         }
@@ -4103,6 +6475,8 @@ static void slaveofCommand(redisClient *c) {
         server.masterhost = sdsdup(c->argv[1]->ptr);
         server.masterport = atoi(c->argv[2]->ptr);
         if (server.master) freeClient(server.master);
+        if (server.repl_transfer_s != -1) cancelReplicationHandshake();
+        resetReplicationMasterState();
         server.replstate = REDIS_REPL_CONNECT;
         redisLog(REDIS_NOTICE,"SLAVE OF %s:%d enabled (user request)",
             server.masterhost, server.masterport);
@@ -4135,6 +6509,10 @@ static void freeMemoryIfNeeded(void) {
         } else {
             int j, k, freed = 0;
 
+            /* Values being released in background will lower the memory
+             * usage soon: evicting more keys meanwhile would free too much.
+             * Until then commands enlarging the dataset are refused. */
+            if (bioPendingJobsOfType(REDIS_BIO_LAZY_FREE)) return;
             for (j = 0; j < server.dbnum; j++) {
                 int minttl = -1;
                 robj *minkey = NULL;
@@ -4154,7 +6532,8 @@ static void freeMemoryIfNeeded(void) {
                             minttl = t;
                         }
                     }
-                    deleteKey(server.db+j,minkey);
+                    dbAsyncDelete(server.db+j,minkey);
+                    server.stat_evictedkeys++;
                 }
             }
             if (!freed) return; /* nothing to free... */
@@ -4164,6 +6543,83 @@ static void freeMemoryIfNeeded(void) {
 
 /* ================================= Debugging ============================== */
 
+/* Estimated memory used by a value. Every allocation is accounted with its
+ * requested size, the allocator overhead is not. The elements of lists and
+ * sets are sampled: the size of the first 'samples' ones (all of them if
+ * 'samples' is 0) is scaled to the whole value. Shared elements are counted
+ * for every value referencing them. */
+static size_t objectComputeSize(robj *o, long samples) {
+    size_t asize = sizeof(robj), elesize = 0;
+    long sampled = 0;
+
+    if (o->type == REDIS_STRING) {
+        asize += sdsAllocSize(o->ptr);
+    } else if (o->type == REDIS_LIST) {
+        list *l = o->ptr;
+        listNode *ln = listFirst(l);
+
+        asize += sizeof(list);
+        while(ln && (samples == 0 || sampled < samples)) {
+            robj *ele = listNodeValue(ln);
+
+            elesize += sizeof(listNode)+stringObjectSize(ele);
+            sampled++;
+            ln = ln->next;
+        }
+        if (sampled) asize += (double)elesize/sampled*listLength(l);
+    } else if (o->type == REDIS_SET || o->type == REDIS_HASH) {
+        dict *d = o->ptr;
+        dictIterator *di = dictGetIterator(d);
+        dictEntry *de;
+
+        if (!di) oom("dictGetIterator");
+        asize += sizeof(dict)+sizeof(dictEntry*)*dictSlots(d);
+        while((samples == 0 || sampled < samples) && (de = dictNext(di)) != NULL) {
+            robj *val = dictGetEntryVal(de);
+
+            elesize += sizeof(dictEntry)+stringObjectSize(dictGetEntryKey(de));
+            if (o->type == REDIS_HASH && val) elesize += stringObjectSize(val);
+            sampled++;
+        }
+        dictReleaseIterator(di);
+        if (sampled) asize += (double)elesize/sampled*dictSize(d);
+    }
+    return asize;
+}
+
+/* MEMORY USAGE <key> [SAMPLES <count>]: bytes used by the key, its value
+ * and its entries in the DB tables */
+static void memoryCommand(redisClient *c) {
+    long samples = REDIS_MEMORY_USAGE_SAMPLES;
+    dictEntry *de;
+    size_t usage;
+
+    if (strcasecmp(c->argv[1]->ptr,"usage") ||
+        (c->argc != 3 && c->argc != 5) ||
+        (c->argc == 5 && strcasecmp(c->argv[3]->ptr,"samples")))
+    {
+        addReplySds(c,sdsnew("-ERR syntax error, try MEMORY USAGE <key> [SAMPLES <count>]\r\n"));
+        return;
+    }
+    if (c->argc == 5 && (samples = strtol(c->argv[4]->ptr,NULL,10)) < 0) {
+        addReplySds(c,sdsnew("-ERR SAMPLES must be 0 (all) or positive\r\n"));
+        return;
+    }
+    expireIfNeeded(c->db,c->argv[2]);
+    if ((de = dictFind(c->db->dict,c->argv[2])) == NULL ||
+        dictGetEntryVal(de) == NULL)
+    {
+        addReply(c,shared.nullbulk);
+        return;
+    }
+    usage = sizeof(dictEntry)+sizeof(dictEntry*)+
+        stringObjectSize(dictGetEntryKey(de))+
+        objectComputeSize(dictGetEntryVal(de),samples);
+    if (dictFind(c->db->expires,c->argv[2]))
+        usage += sizeof(dictEntry)+sizeof(dictEntry*);
+    addReplySds(c,sdscatprintf(sdsempty(),":%lu\r\n",(unsigned long)usage));
+}
+
 static void debugCommand(redisClient *c) {
     if (!strcasecmp(c->argv[1]->ptr,"segfault")) {
         *((char*)-1) = 'x';
@@ -4180,9 +6636,20 @@ static void debugCommand(redisClient *c) {
         addReplySds(c,sdscatprintf(sdsempty(),
             "+Key at:%p refcount:%d, value at:%p refcount:%d\r\n",
                 key, key->refcount, val, val->refcount));
+    } else if (!strcasecmp(c->argv[1]->ptr,"sleep") && c->argc == 3) {
+        /* Block the server, useful to test the slow log */
+        double dtime = strtod(c->argv[2]->ptr,NULL);
+        struct timespec ts;
+
+        if (dtime < 0) dtime = 0;
+        ts.tv_sec = (time_t)dtime;
+        ts.tv_nsec = (long)((dtime-ts.tv_sec)*1000000000);
+        /* Signals like the watchdog SIGALRM must not cut the sleep short */
+        while (nanosleep(&ts,&ts) == -1 && errno == EINTR);
+        addReply(c,shared.ok);
     } else {
         addReplySds(c,sdsnew(
-            "-ERR Syntax error, try DEBUG [SEGFAULT|OBJECT <key>]\r\n"));
+            "-ERR Syntax error, try DEBUG [SEGFAULT|OBJECT <key>|SLEEP <seconds>]\r\n"));
     }
 }
 
@@ -4322,11 +6789,33 @@ static void *getMcontextEip(ucontext_t *uc) {
 #endif
 }
 
-static void segvHandler(int sig, siginfo_t *info, void *secret) {
+static void logStackTrace(ucontext_t *uc) {
     void *trace[100];
     char **messages = NULL;
     int i, trace_size = 0;
     unsigned long offset=0;
+
+    trace_size = backtrace(trace, 100);
+    /* overwrite sigaction with caller's address */
+    if (getMcontextEip(uc) != NULL) {
+        trace[1] = getMcontextEip(uc);
+    }
+    messages = backtrace_symbols(trace, trace_size);
+
+    for (i=1; i<trace_size; ++i) {
+        char *fn = findFuncName(trace[i], &offset), *p;
+
+        p = strchr(messages[i],'+');
+        if (!fn || (p && ((unsigned long)strtol(p+1,NULL,10)) < offset)) {
+            redisLog(REDIS_WARNING,"%s", messages[i]);
+        } else {
+            redisLog(REDIS_WARNING,"%d redis-server %p %s + %d", i, trace[i], fn, (unsigned int)offset);
+        }
+    }
+    free(messages);
+}
+
+static void segvHandler(int sig, siginfo_t *info, void *secret) {
     time_t uptime = time(NULL)-server.stat_starttime;
     ucontext_t *uc = (ucontext_t*) secret;
     REDIS_NOTUSED(info);
@@ -4357,25 +6846,7 @@ static void segvHandler(int sig, siginfo_t *info, void *secret) {
         server.stat_numcommands,
         server.masterhost == NULL ? "master" : "slave"
     ));
-    
-    trace_size = backtrace(trace, 100);
-    /* overwrite sigaction with caller's address */
-    if (getMcontextEip(uc) != NULL) {
-        trace[1] = getMcontextEip(uc);
-    }
-    messages = backtrace_symbols(trace, trace_size);
-
-    for (i=1; i<trace_size; ++i) {
-        char *fn = findFuncName(trace[i], &offset), *p;
-
-        p = strchr(messages[i],'+');
-        if (!fn || (p && ((unsigned long)strtol(p+1,NULL,10)) < offset)) {
-            redisLog(REDIS_WARNING,"%s", messages[i]);
-        } else {
-            redisLog(REDIS_WARNING,"%d redis-server %p %s + %d", i, trace[i], fn, (unsigned int)offset);
-        }
-    }
-    free(messages);
+    logStackTrace(uc);
     exit(0);
 }
 
@@ -4399,6 +6870,47 @@ static void setupSigSegvAction(void) {
 }
 #endif /* HAVE_BACKTRACE */
 
+/* The watchdog: when watchdog-period is set a SIGALRM is scheduled every
+ * time the event loop starts processing events, and cancelled before it
+ * goes to sleep again. If an iteration takes longer than the period the
+ * signal handler logs where the server is stuck. The server keeps running.
+ *
+ * Note: redisLog() is not async signal safe, this is a debugging tool. */
+static void watchdogSignalHandler(int sig, siginfo_t *info, void *secret) {
+    REDIS_NOTUSED(sig);
+    REDIS_NOTUSED(info);
+
+    redisLog(REDIS_WARNING,
+        "--- WATCHDOG TIMER EXPIRED (event loop iteration running for more than %d ms) ---",
+        server.watchdog_period);
+#ifdef HAVE_BACKTRACE
+    logStackTrace((ucontext_t*) secret);
+#else
+    REDIS_NOTUSED(secret);
+#endif
+    redisLog(REDIS_WARNING,"--------");
+}
+
+static void setupWatchdogAction(void) {
+    struct sigaction act;
+
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_NODEFER | SA_ONSTACK | SA_SIGINFO | SA_RESTART;
+    act.sa_sigaction = watchdogSignalHandler;
+    sigaction(SIGALRM, &act, NULL);
+}
+
+/* Schedule the SIGALRM in 'period' milliseconds, 0 cancels it */
+static void watchdogScheduleSignal(int period) {
+    struct itimerval it;
+
+    it.it_value.tv_sec = period/1000;
+    it.it_value.tv_usec = (period%1000)*1000;
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 0;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
 /* =================================== Main! ================================ */
 
 #ifdef __linux__
@@ -4449,25 +6961,33 @@ static void daemonize(void) {
 
 int main(int argc, char **argv) {
     initServerConfig();
-    if (argc == 2) {
+    crc64Init();
+    if (argc == 3 && !strcmp(argv[1],"--check-rdb")) {
+        /* Verify a DB file and exit, without starting the server */
+        exit(rdbCheckFile(argv[2]) == REDIS_OK ? 0 : 1);
+    } else if (argc == 2) {
         ResetServerSaveParams();
         loadServerConfig(argv[1]);
     } else if (argc > 2) {
         fprintf(stderr,"Usage: ./redis-server [/path/to/redis.conf]\n");
+        fprintf(stderr,"       ./redis-server --check-rdb /path/to/dump.rdb\n");
         exit(1);
     } else {
         redisLog(REDIS_WARNING,"Warning: no config file specified, using the default config. In order to specify a config file use 'redis-server /path/to/redis.conf'");
     }
-    initServer();
+    /* Fork before initServer(): the threads it starts would not survive it */
     if (server.daemonize) daemonize();
+    initServer();
     redisLog(REDIS_NOTICE,"Server started, Redis version " REDIS_VERSION);
 #ifdef __linux__
     linuxOvercommitMemoryWarning();
 #endif
-    if (rdbLoad(server.dbfilename) == REDIS_OK)
-        redisLog(REDIS_NOTICE,"DB loaded from disk");
+    /* Accept connections before loading the DB: while loading we answer to
+     * PING and INFO (that reports the progress), so that a server loading a
+     * big dataset can be told apart from a dead one */
     if (aeCreateFileEvent(server.el, server.fd, AE_READABLE,
         acceptHandler, NULL, NULL) == AE_ERR) oom("creating file event");
+    loadDataFromDisk();
     redisLog(REDIS_NOTICE,"The server is now ready to accept connections on port %d", server.port);
     aeMain(server.el);
     aeDeleteEventLoop(server.el);
@@ -0,0 +1,118 @@
+/* Glob-style pattern matching benchmark.
+ *
+ * Checks that the compiled matcher gives the same results as stringmatchlen()
+ * on random patterns, then compares the speed of the two implementations.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * See the COPYING file for the license (BSD). */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "stringmatch.h"
+
+#define NUMKEYS 100000
+#define FUZZ_ITERATIONS 2000000
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+static void randomString(char *buf, int len, const char *charset) {
+    int j, n = strlen(charset);
+
+    for (j = 0; j < len; j++) buf[j] = charset[random() % n];
+    buf[len] = '\0';
+}
+
+/* Match random patterns against random strings with both the interpreter
+ * and the compiled matcher. Returns the number of mismatches. */
+static int fuzz(void) {
+    char pattern[32], string[32];
+    int j, errors = 0;
+
+    for (j = 0; j < FUZZ_ITERATIONS; j++) {
+        int plen = random() % 12, slen = random() % 12;
+        int nocase = random() % 2;
+        stringmatchPattern *p;
+        int a, b;
+
+        randomString(pattern,plen,"aAb*?[]^-\\");
+        randomString(string,slen,"aAb*?[]^-\\");
+        /* A trailing escape inside a class makes stringmatchlen() read
+         * past the end of the pattern: skip it. */
+        if (plen && pattern[plen-1] == '\\') continue;
+        if ((p = stringmatchCompile(pattern,plen,nocase)) == NULL) {
+            fprintf(stderr,"Out of memory\n");
+            exit(1);
+        }
+        a = stringmatchlen(pattern,plen,string,slen,nocase);
+        b = stringmatchExec(p,string,slen);
+        if (a != b) {
+            if (errors++ < 10)
+                printf("MISMATCH pattern '%s' string '%s' nocase %d: "
+                       "interpreted %d compiled %d\n",
+                       pattern, string, nocase, a, b);
+        }
+        stringmatchFree(p);
+    }
+    return errors;
+}
+
+static void bench(char **keys, int numkeys, char *pattern) {
+    int plen = strlen(pattern), j, m1 = 0, m2 = 0;
+    stringmatchPattern *p = stringmatchCompile(pattern,plen,0);
+    long long t1, t2;
+
+    t1 = ustime();
+    for (j = 0; j < numkeys; j++)
+        m1 += stringmatchlen(pattern,plen,keys[j],strlen(keys[j]),0);
+    t1 = ustime()-t1;
+    t2 = ustime();
+    for (j = 0; j < numkeys; j++)
+        m2 += stringmatchExec(p,keys[j],strlen(keys[j]));
+    t2 = ustime()-t2;
+    printf("%-20s %7d matches  interpreted %6lld us  compiled %6lld us%s\n",
+        pattern, m1, t1, t2, m1 != m2 ? "  MISMATCH" : "");
+    stringmatchFree(p);
+}
+
+int main(void) {
+    char *patterns[] = {
+        "*", "user:*", "*:profile", "user:1*9:profile", "user:?????:*",
+        "*[0-9][0-9]:*", "session:*", "*a*a*a*b", NULL
+    };
+    char **keys = malloc(sizeof(char*)*NUMKEYS);
+    int j, errors;
+
+    srandom(1234);
+    printf("Checking the compiled matcher against stringmatchlen()...\n");
+    errors = fuzz();
+    printf("%d mismatches in %d patterns\n\n", errors, FUZZ_ITERATIONS);
+    fflush(stdout);
+
+    for (j = 0; j < NUMKEYS; j++) {
+        char buf[128];
+
+        switch(j % 3) {
+        case 0: snprintf(buf,sizeof(buf),"user:%d:profile",j); break;
+        case 1: snprintf(buf,sizeof(buf),"counter:%d",j); break;
+        default: randomString(buf,20,"aaaaaaaaaaaaaaaaaaab"); break;
+        }
+        keys[j] = strdup(buf);
+    }
+    printf("Matching %d keys:\n", NUMKEYS);
+    for (j = 0; patterns[j]; j++) bench(keys,NUMKEYS,patterns[j]);
+    for (j = 0; j < NUMKEYS; j++) free(keys[j]);
+    free(keys);
+    return errors ? 1 : 0;
+}
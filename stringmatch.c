@@ -0,0 +1,402 @@
+/* Glob-style pattern matching.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <ctype.h>
+
+#include "stringmatch.h"
+#include "zmalloc.h"
+
+#define SM_ATOM_CHAR 0  /* a given byte */
+#define SM_ATOM_ANY 1   /* '?', any byte */
+#define SM_ATOM_SET 2   /* '[...]' or a byte in case insensitive mode */
+
+/* Glob-style pattern matching. */
+int stringmatchlen(const char *pattern, int patternLen,
+        const char *string, int stringLen, int nocase)
+{
+    while(patternLen) {
+        switch(pattern[0]) {
+        case '*':
+            while (pattern[1] == '*') {
+                pattern++;
+                patternLen--;
+            }
+            if (patternLen == 1)
+                return 1; /* match */
+            while(stringLen) {
+                if (stringmatchlen(pattern+1, patternLen-1,
+                            string, stringLen, nocase))
+                    return 1; /* match */
+                string++;
+                stringLen--;
+            }
+            return 0; /* no match */
+            break;
+        case '?':
+            if (stringLen == 0)
+                return 0; /* no match */
+            string++;
+            stringLen--;
+            break;
+        case '[':
+        {
+            int not, match;
+
+            if (stringLen == 0)
+                return 0; /* no match */
+            pattern++;
+            patternLen--;
+            not = pattern[0] == '^';
+            if (not) {
+                pattern++;
+                patternLen--;
+            }
+            match = 0;
+            while(1) {
+                if (pattern[0] == '\\') {
+                    pattern++;
+                    patternLen--;
+                    if (pattern[0] == string[0])
+                        match = 1;
+                } else if (pattern[0] == ']') {
+                    break;
+                } else if (patternLen == 0) {
+                    pattern--;
+                    patternLen++;
+                    break;
+                } else if (pattern[1] == '-' && patternLen >= 3) {
+                    int start = pattern[0];
+                    int end = pattern[2];
+                    int c = string[0];
+                    if (start > end) {
+                        int t = start;
+                        start = end;
+                        end = t;
+                    }
+                    if (nocase) {
+                        start = tolower(start);
+                        end = tolower(end);
+                        c = tolower(c);
+                    }
+                    pattern += 2;
+                    patternLen -= 2;
+                    if (c >= start && c <= end)
+                        match = 1;
+                } else {
+                    if (!nocase) {
+                        if (pattern[0] == string[0])
+                            match = 1;
+                    } else {
+                        if (tolower((int)pattern[0]) == tolower((int)string[0]))
+                            match = 1;
+                    }
+                }
+                pattern++;
+                patternLen--;
+            }
+            if (not)
+                match = !match;
+            if (!match)
+                return 0; /* no match */
+            string++;
+            stringLen--;
+            break;
+        }
+        case '\\':
+            if (patternLen >= 2) {
+                pattern++;
+                patternLen--;
+            }
+            /* fall through */
+        default:
+            if (stringLen == 0)
+                return 0; /* no match */
+            if (!nocase) {
+                if (pattern[0] != string[0])
+                    return 0; /* no match */
+            } else {
+                if (tolower((int)pattern[0]) != tolower((int)string[0]))
+                    return 0; /* no match */
+            }
+            string++;
+            stringLen--;
+            break;
+        }
+        pattern++;
+        patternLen--;
+        if (stringLen == 0) {
+            while(*pattern == '*') {
+                pattern++;
+                patternLen--;
+            }
+            break;
+        }
+    }
+    if (patternLen == 0 && stringLen == 0)
+        return 1;
+    return 0;
+}
+
+/* ------------------------- Compiled patterns ------------------------------ */
+
+/* Pattern byte at index 'i', or the null term if we are past the end */
+#define PAT(i) ((i) < patternLen ? pattern[(i)] : '\0')
+#define SETBIT(set,b) ((set)[(b)>>3] |= 1<<((b)&7))
+#define TESTBIT(set,b) ((set)[(b)>>3] & (1<<((b)&7)))
+
+/* Fill 'atom' with the set of bytes that are equal to 'c', case insensitive.
+ * Comparisons are done exactly like stringmatchlen() does. */
+static void smCharNocase(stringmatchAtom *atom, char c) {
+    int b;
+
+    atom->type = SM_ATOM_SET;
+    memset(atom->set,0,sizeof(atom->set));
+    for (b = 0; b < 256; b++)
+        if (tolower((int)(char)b) == tolower((int)c)) SETBIT(atom->set,b);
+}
+
+/* Parse the '[...]' class starting at pattern[i] into 'atom'. The bytes
+ * matched are computed once evaluating for every byte the same tests
+ * stringmatchlen() does, so the two functions can't disagree. Returns the
+ * index of the last byte of the class in the pattern. */
+static int smParseClass(stringmatchAtom *atom, const char *pattern,
+        int patternLen, int i, int nocase)
+{
+    int not, b;
+
+    atom->type = SM_ATOM_SET;
+    memset(atom->set,0,sizeof(atom->set));
+    i++;
+    not = PAT(i) == '^';
+    if (not) i++;
+    while(1) {
+        if (PAT(i) == '\\') {
+            i++;
+            SETBIT(atom->set,(unsigned char)PAT(i));
+            if (i == patternLen) i--; /* trailing escape */
+        } else if (PAT(i) == ']') {
+            break;
+        } else if (i >= patternLen) {
+            i = patternLen-1;
+            break;
+        } else if (PAT(i+1) == '-' && patternLen-i >= 3) {
+            int start = pattern[i];
+            int end = pattern[i+2];
+
+            if (start > end) {
+                int t = start;
+                start = end;
+                end = t;
+            }
+            if (nocase) {
+                start = tolower(start);
+                end = tolower(end);
+            }
+            for (b = 0; b < 256; b++) {
+                int c = (char)b;
+
+                if (nocase) c = tolower(c);
+                if (c >= start && c <= end) SETBIT(atom->set,b);
+            }
+            i += 2;
+        } else {
+            for (b = 0; b < 256; b++) {
+                if ((!nocase && (char)b == pattern[i]) ||
+                    (nocase && tolower((int)(char)b) == tolower((int)pattern[i])))
+                    SETBIT(atom->set,b);
+            }
+        }
+        i++;
+    }
+    if (not) {
+        for (b = 0; b < 32; b++) atom->set[b] = ~atom->set[b];
+    }
+    return i;
+}
+
+/* Compile a glob-style pattern. Returns NULL on out of memory. */
+stringmatchPattern *stringmatchCompile(const char *pattern, int patternLen,
+        int nocase)
+{
+    stringmatchPattern *p;
+    stringmatchAtom *atoms;
+    stringmatchSegment *seg;
+    int i, j, natoms = 0;
+
+    if ((p = zmalloc(sizeof(*p))) == NULL) return NULL;
+    /* Every atom and every '*' needs at least a pattern byte */
+    atoms = zmalloc(sizeof(stringmatchAtom)*(patternLen+1));
+    p->seg = zmalloc(sizeof(stringmatchSegment)*(patternLen+1));
+    if (atoms == NULL || p->seg == NULL) {
+        zfree(atoms);
+        zfree(p->seg);
+        zfree(p);
+        return NULL;
+    }
+    p->numseg = 1;
+    p->minlen = 0;
+    seg = p->seg;
+    seg->atoms = atoms;
+    seg->len = 0;
+    for (i = 0; i < patternLen; i++) {
+        stringmatchAtom *atom = atoms+natoms;
+
+        switch(pattern[i]) {
+        case '*':
+            while (PAT(i+1) == '*') i++;
+            seg = p->seg+p->numseg;
+            p->numseg++;
+            seg->atoms = atoms+natoms;
+            seg->len = 0;
+            continue;
+        case '?':
+            atom->type = SM_ATOM_ANY;
+            break;
+        case '[':
+            i = smParseClass(atom,pattern,patternLen,i,nocase);
+            break;
+        case '\\':
+            if (patternLen-i >= 2) i++;
+            /* fall through */
+        default:
+            if (nocase) {
+                smCharNocase(atom,pattern[i]);
+            } else {
+                atom->type = SM_ATOM_CHAR;
+                atom->c = pattern[i];
+            }
+            break;
+        }
+        natoms++;
+        seg->len++;
+        p->minlen++;
+    }
+
+    /* Segments made only of plain bytes are matched with memcmp() */
+    p->matchall = p->numseg > 1;
+    for (j = 0; j < p->numseg; j++) {
+        seg = p->seg+j;
+        seg->literal = NULL;
+        if (seg->len) p->matchall = 0;
+        for (i = 0; i < seg->len; i++)
+            if (seg->atoms[i].type != SM_ATOM_CHAR) break;
+        if (i == seg->len && seg->len) {
+            seg->literal = zmalloc(seg->len);
+            if (seg->literal == NULL) {
+                p->numseg = j;
+                stringmatchFree(p);
+                return NULL;
+            }
+            for (i = 0; i < seg->len; i++)
+                seg->literal[i] = seg->atoms[i].c;
+        }
+    }
+    return p;
+}
+
+void stringmatchFree(stringmatchPattern *p) {
+    int j;
+
+    if (p == NULL) return;
+    for (j = 0; j < p->numseg; j++) zfree(p->seg[j].literal);
+    zfree(p->seg[0].atoms);
+    zfree(p->seg);
+    zfree(p);
+}
+
+/* Match the segment against exactly seg->len bytes of 's' */
+static int smSegmentMatch(stringmatchSegment *seg, const char *s) {
+    int j;
+
+    if (seg->literal)
+        return s[0] == seg->literal[0] && memcmp(s,seg->literal,seg->len) == 0;
+    for (j = 0; j < seg->len; j++) {
+        stringmatchAtom *atom = seg->atoms+j;
+        unsigned char c = s[j];
+
+        if (atom->type == SM_ATOM_CHAR) {
+            if (c != atom->c) return 0;
+        } else if (atom->type == SM_ATOM_SET) {
+            if (!TESTBIT(atom->set,c)) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Return the offset of the leftmost match of 'seg' in s[0..len-1], or -1 */
+static int smSegmentFind(stringmatchSegment *seg, const char *s, int len) {
+    int j, last = len - seg->len;
+
+    if (seg->literal) {
+        const char *p = s;
+
+        while(p-s <= last) {
+            p = memchr(p,seg->literal[0],last-(p-s)+1);
+            if (p == NULL) return -1;
+            if (memcmp(p,seg->literal,seg->len) == 0) return p-s;
+            p++;
+        }
+        return -1;
+    }
+    for (j = 0; j <= last; j++)
+        if (smSegmentMatch(seg,s+j)) return j;
+    return -1;
+}
+
+/* Returns 1 if the string matches the compiled pattern, otherwise 0.
+ *
+ * The first and the last segment are anchored to the start and the end of
+ * the string. All the segments have a fixed length, so it is enough to match
+ * the middle ones at their leftmost position, one after the other: the
+ * string is never rescanned as the recursive interpreter does on every '*'. */
+int stringmatchExec(stringmatchPattern *p, const char *string, int stringLen) {
+    stringmatchSegment *first, *last;
+    int j, pos, end;
+
+    if (p->matchall) return 1;
+    if (stringLen < p->minlen) return 0;
+    first = p->seg;
+    if (p->numseg == 1)
+        return stringLen == first->len && smSegmentMatch(first,string);
+    last = p->seg+p->numseg-1;
+    if (!smSegmentMatch(first,string) ||
+        !smSegmentMatch(last,string+stringLen-last->len)) return 0;
+    pos = first->len;
+    end = stringLen - last->len;
+    for (j = 1; j < p->numseg-1; j++) {
+        stringmatchSegment *seg = p->seg+j;
+        int off = smSegmentFind(seg,string+pos,end-pos);
+
+        if (off == -1) return 0;
+        pos += off+seg->len;
+    }
+    return 1;
+}
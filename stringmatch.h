@@ -0,0 +1,46 @@
+/* Glob-style pattern matching.
+ *
+ * stringmatchlen() interprets the pattern for every string matched.
+ * When the same pattern is matched against many strings (KEYS, SCAN MATCH)
+ * it can be compiled once with stringmatchCompile() and then used with
+ * stringmatchExec(), that gives the same results.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * See the COPYING file for the license (BSD). */
+
+#ifndef __STRINGMATCH_H
+#define __STRINGMATCH_H
+
+/* A compiled pattern is a sequence of segments separated by '*'. Every
+ * segment is a fixed length sequence of atoms, each matching exactly one
+ * byte: so segments can be matched without backtracking. */
+typedef struct stringmatchAtom {
+    int type;               /* SM_ATOM_CHAR, SM_ATOM_ANY or SM_ATOM_SET */
+    unsigned char c;        /* byte to match for SM_ATOM_CHAR */
+    unsigned char set[32];  /* bitmap of the bytes matched by SM_ATOM_SET */
+} stringmatchAtom;
+
+typedef struct stringmatchSegment {
+    stringmatchAtom *atoms;
+    int len;                /* number of atoms, that is bytes matched */
+    char *literal;          /* the bytes to match if all the atoms are
+                               SM_ATOM_CHAR, so memcmp() can be used */
+} stringmatchSegment;
+
+typedef struct stringmatchPattern {
+    stringmatchSegment *seg;
+    int numseg;             /* number of '*' groups plus one */
+    int minlen;             /* sum of the segments len */
+    int matchall;           /* the pattern is made only of '*' */
+} stringmatchPattern;
+
+int stringmatchlen(const char *pattern, int patternLen,
+        const char *string, int stringLen, int nocase);
+stringmatchPattern *stringmatchCompile(const char *pattern, int patternLen,
+        int nocase);
+int stringmatchExec(stringmatchPattern *p, const char *string, int stringLen);
+void stringmatchFree(stringmatchPattern *p);
+
+#endif
@@ -38,6 +38,85 @@ proc randstring {min max {type binary}} {
     return $output
 }
 
+# Read a record of the MONITOR CAPTURE stream, returns db, flags and args
+proc read_capture_record {fd} {
+    set varint {
+        set v 0
+        set shift 0
+        while 1 {
+            binary scan [read $fd 1] c byte
+            set byte [expr {$byte & 0xff}]
+            incr v [expr {($byte & 0x7f) << $shift}]
+            if {$byte < 0x80} break
+            incr shift 7
+        }
+        set v
+    }
+    read $fd 8
+    eval $varint
+    set db [eval $varint]
+    binary scan [read $fd 1] c flags
+    set argc [eval $varint]
+    set argv {}
+    for {set j 0} {$j < $argc} {incr j} {
+        lappend argv [read $fd [eval $varint]]
+    }
+    list $db $flags $argv
+}
+
+# Return the first port starting from 'port' nobody is listening on
+proc find_free_port {port} {
+    for {set j 0} {$j < 100} {incr j} {
+        if {[catch {close [socket 127.0.0.1 [expr {$port+$j}]]}]} {
+            return [expr {$port+$j}]
+        }
+    }
+    error "No free port found after $port"
+}
+
+# Start a daemonized server on a free port starting from 'port', returns a
+# client connected to it as soon as it replies to PING. 'extraconf' is
+# appended to its configuration.
+proc start_daemon_server {port {extraconf {}}} {
+    set port [find_free_port $port]
+    set conf [open test-daemon.conf w]
+    puts $conf "daemonize yes\nport $port\npidfile [pwd]/test-daemon.pid"
+    puts $conf "dbfilename test-daemon.rdb\nlogfile /dev/null"
+    puts $conf $extraconf
+    close $conf
+    exec ./redis-server test-daemon.conf
+    for {set j 0} {$j < 250} {incr j} {
+        if {![catch {redis 127.0.0.1 $port} r]} {
+            if {![catch {$r ping} reply] && $reply eq {PONG}} {return $r}
+            $r close
+        }
+        after 20
+    }
+    error "The daemonized server on port $port is not replying"
+}
+
+# Shut down a server started with start_daemon_server, waiting for it to
+# remove its pidfile on exit
+proc stop_daemon_server {r} {
+    catch {$r shutdown}
+    $r close
+    for {set j 0} {$j < 250 && [file exists test-daemon.pid]} {incr j} {
+        after 20
+    }
+    file delete test-daemon.conf test-daemon.pid test-daemon.rdb
+}
+
+# Wait up to 'timeout' milliseconds for the INFO output of 'r' to match
+# 'pattern', returns 1 if it did
+proc wait_for_info {r pattern {timeout 5000}} {
+    set start [clock clicks -milliseconds]
+    while {![regexp $pattern [$r info]]} {
+        if {[clock clicks -milliseconds]-$start > $timeout} {return 0}
+        after 20
+    }
+    return 1
+}
+
 proc main {server port} {
     set r [redis $server $port]
     set err ""
@@ -79,10 +158,43 @@ proc main {server port} {
         lsort [$r keys foo*]
     } {foo_a foo_b foo_c}
 
+    test {KEYS with complex pattern} {
+        list [lsort [$r keys *_\[a-b\]]] [lsort [$r keys ?e*_?]] [$r keys k*x*y]
+    } {{foo_a foo_b} {key_x key_y key_z} {}}
+
     test {KEYS to get all keys} {
         lsort [$r keys *]
     } {foo_a foo_b foo_c key_x key_y key_z}
 
+    test {SCAN to get all keys} {
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [$r scan $cur count 2]
+            set cur [lindex $res 0]
+            eval lappend keys [lindex $res 1]
+            if {$cur == 0} break
+        }
+        lsort -unique $keys
+    } {foo_a foo_b foo_c key_x key_y key_z}
+
+    test {SCAN with MATCH} {
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [$r scan $cur match key_*]
+            set cur [lindex $res 0]
+            eval lappend keys [lindex $res 1]
+            if {$cur == 0} break
+        }
+        lsort -unique $keys
+    } {key_x key_y key_z}
+
+    test {SCAN with a huge COUNT} {
+        set res [$r scan 0 count 9223372036854775807]
+        list [lindex $res 0] [lsort [lindex $res 1]]
+    } {0 {foo_a foo_b foo_c key_x key_y key_z}}
+
     test {DBSIZE} {
         $r dbsize
     } {6}
@@ -180,6 +292,18 @@ proc main {server port} {
         format $res
     } {1xyzk1}
 
+    test {Commands pipelining after a bulk received in a later read} {
+        set fd [$r channel]
+        puts -nonewline $fd "SET k1 4\r\n"
+        flush $fd
+        after 100
+        puts -nonewline $fd "abcd\r\nGET k1\r\n"
+        flush $fd
+        set res {}
+        append res [string match OK* [::redis::redis_read_reply $fd]]
+        append res [::redis::redis_read_reply $fd]
+    } {1abcd}
+
     test {Non existing command} {
         catch {$r foobaredcommand} err
         string match ERR* $err
@@ -523,6 +647,22 @@ proc main {server port} {
         list [lsort [list [$r spop myset] [$r spop myset] [$r spop myset]]] [$r scard myset]
     } {{1 2 3} 0}
 
+    test {SSCAN basics} {
+        $r del myset
+        for {set i 0} {$i < 100} {incr i} {
+            $r sadd myset $i
+        }
+        set cur 0
+        set members {}
+        while 1 {
+            set res [$r sscan myset $cur count 7]
+            set cur [lindex $res 0]
+            eval lappend members [lindex $res 1]
+            if {$cur == 0} break
+        }
+        list [llength [lsort -unique $members]] [$r sscan nokey 0]
+    } {100 {0 {}}}
+
     test {SAVE - make sure there are all the types as values} {
         $r lpush mysavelist hello
         $r lpush mysavelist world
@@ -758,6 +898,212 @@ proc main {server port} {
         } {0}
     }
 
+    test {UNLINK against big and small values} {
+        for {set i 0} {$i < 1000} {incr i} {
+            $r rpush biglist $i
+            $r sadd bigset $i
+        }
+        $r set small foo
+        list [$r unlink biglist bigset small nokey] [$r exists biglist] [$r exists bigset]
+    } {3 0 0}
+
+    test {FLUSHDB ASYNC} {
+        for {set i 0} {$i < 1000} {incr i} {
+            $r rpush biglist $i
+        }
+        $r flushdb async
+        list [$r dbsize] [$r llen biglist]
+    } {0 0}
+
+    test {INFO commandstats after CONFIG RESETSTAT} {
+        $r config resetstat
+        $r ping
+        $r ping
+        regexp {cmdstat_ping:calls=2,} [$r info commandstats]
+    } {1}
+
+    test {SLOWLOG logs the commands and can be reset} {
+        $r slowlog reset
+        $r debug sleep 0.1
+        set e [lindex [$r slowlog get] 0]
+        list [$r slowlog len] [lindex $e 3] [expr {[lindex $e 2] >= 100000}] \
+            [$r slowlog reset] [$r slowlog len]
+    } {1 {debug sleep 0.1} 1 OK 0}
+
+    test {LATENCY monitor records a slow command} {
+        $r config set latency-monitor-threshold 50
+        $r latency reset
+        $r debug sleep 0.1
+        set e [lindex [$r latency latest] 0]
+        set h [$r latency history command]
+        $r config set latency-monitor-threshold 0
+        $r latency reset
+        list [lindex $e 0] [expr {[lindex $e 2] >= 100}] [llength $h]
+    } {command 1 1}
+
+    test {DEBUG SLEEP is not cut short by the watchdog} {
+        $r config set watchdog-period 20
+        set start [clock clicks -milliseconds]
+        $r debug sleep 0.2
+        set elapsed [expr {[clock clicks -milliseconds]-$start}]
+        $r config set watchdog-period 0
+        expr {$elapsed >= 200}
+    } {1}
+
+    test {MEMORY USAGE and INFO datatypes} {
+        $r flushall
+        $r set mystring [string repeat x 1000]
+        foreach i {1 2 3} {$r rpush mylist $i}
+        $r lpop mylist
+        foreach i {a b c d} {$r sadd myset $i}
+        $r srem myset a
+        $r del mystring
+        $r set mystring [string repeat x 1000]
+        set dt [$r info datatypes]
+        list [expr {[$r memory usage mystring] > 1000}] \
+             [expr {[$r memory usage mylist samples 0] > 0}] \
+             [$r memory usage nokey] \
+             [regexp {type_string:keys=1,elements=1,bytes=10} $dt] \
+             [regexp {type_list:keys=1,elements=2,} $dt] \
+             [regexp {type_set:keys=1,elements=3,} $dt]
+    } {1 1 {} 1 1 1}
+
+    test {INFO keyspace hits and misses} {
+        $r set foo bar
+        $r del mylist
+        $r lpush mylist 1
+        $r lpush mylist 2
+        $r config resetstat
+        $r get foo
+        $r get foo
+        $r get nokey
+        # Only the key of SORT is counted, not the BY and GET lookups
+        $r sort mylist by nokey_* get nokey_*
+        $r type foo
+        set info [$r info]
+        list [regexp {keyspace_hits:3\r} $info] [regexp {keyspace_misses:1\r} $info]
+    } {1 1}
+
+    test {MONITOR CAPTURE} {
+        set cfd [socket $server $port]
+        fconfigure $cfd -translation binary
+        puts -nonewline $cfd "MONITOR CAPTURE\r\n"
+        flush $cfd
+        set res [list [gets $cfd]]
+        $r select 1
+        $r echo captured
+        $r select 0
+        read_capture_record $cfd ;# MONITOR itself
+        read_capture_record $cfd ;# SELECT
+        lappend res [read_capture_record $cfd]
+        close $cfd
+        set res
+    } "{+OK\r} {1 1 {echo captured}}"
+
+    test {PSYNC partial resynchronization from the backlog} {
+        set sfd [socket $server $port]
+        fconfigure $sfd -translation binary
+        puts -nonewline $sfd "PSYNC ? -1\r\n"
+        flush $sfd
+        set full [string trim [gets $sfd]]
+        set len [string range [gets $sfd] 1 end-1]
+        read $sfd $len
+        close $sfd
+        # Written while the slave is disconnected, served from the backlog
+        $r set psynckey foo
+        set sfd [socket $server $port]
+        fconfigure $sfd -translation binary
+        puts -nonewline $sfd "PSYNC [lindex $full 1] [expr {[lindex $full 2]+1}]\r\n"
+        flush $sfd
+        set res [list [lindex $full 0] [string trim [gets $sfd]]]
+        for {set j 0} {$j < 3} {incr j} {
+            set line [string trim [gets $sfd]]
+            if {[string match {set psynckey*} $line]} break
+        }
+        lappend res $line [string trim [gets $sfd]]
+        close $sfd
+        $r del psynckey
+        set res
+    } {+FULLRESYNC +CONTINUE {set psynckey 3} foo}
+
+    test {SYNC slave disconnecting} {
+        set sfd [socket $server $port]
+        fconfigure $sfd -translation binary
+        puts -nonewline $sfd "SYNC\r\n"
+        flush $sfd
+        set len [string range [gets $sfd] 1 end-1]
+        set rdb [read $sfd $len]
+        close $sfd
+        after 100
+        list [string range $rdb 0 4] [$r ping]
+    } {REDIS PONG}
+
+    test {Lazy free works in a daemonized server} {
+        set d [start_daemon_server [expr {$port+11}]]
+        for {set i 0} {$i < 300} {incr i} {$d rpush biglist $i}
+        $d unlink biglist
+        set res [wait_for_info $d {lazyfreed_jobs:1\r}]
+        lappend res [regexp {lazyfree_pending_jobs:0\r} [$d info]]
+        stop_daemon_server $d
+        set res
+    } {1 1}
+
+    test {Background close of the old DB file in a daemonized server} {
+        set d [start_daemon_server [expr {$port+11}]]
+        $d set foo bar
+        for {set i 0} {$i < 5} {incr i} {$d save}
+        set res [wait_for_info $d {bio_pending_close_file:0\r}]
+        stop_daemon_server $d
+        set res
+    } {1}
+
+    test {Read only commands are served while loading with loading-serve-reads} {
+        # A DB of one million keys, takes a fraction of a second to load.
+        # Keys and values are short strings, the checksum is left to zero.
+        set fp [open test-daemon.rdb w]
+        fconfigure $fp -translation binary
+        puts -nonewline $fp REDIS0003
+        for {set j 0} {$j < 1000000} {incr j 10000} {
+            set buf {}
+            for {set k $j} {$k < $j+10000} {incr k} {
+                set key "key:$k"
+                append buf [binary format cca*ca* 0 [string length $key] $key 1 x]
+            }
+            puts -nonewline $fp $buf
+        }
+        puts -nonewline $fp [binary format cx8 255]
+        close $fp
+        set d [start_daemon_server [expr {$port+11}] "loading-serve-reads yes"]
+        set res [regexp {loading:1\r} [$d info]]
+        lappend res [$d get key:1]
+        catch {$d set foo bar} err
+        lappend res $err
+        lappend res [wait_for_info $d {loading:0\r}] [$d dbsize]
+        stop_daemon_server $d
+        set res
+    } {1 x {LOADING Redis is loading the dataset in memory} 1 1000000}
+
+    test {Loading refuses a DB file with a wrong checksum} {
+        $r set crckey crcvalue0123
+        $r save
+        set fp [open dump.rdb r]
+        fconfigure $fp -translation binary
+        set rdb [read $fp]
+        close $fp
+        set fp [open test-corrupt.rdb w]
+        fconfigure $fp -translation binary
+        puts -nonewline $fp [string map {crcvalue0123 crcvaluf0123} $rdb]
+        close $fp
+        set fp [open test-corrupt.conf w]
+        puts $fp "port [find_free_port [expr {$port+11}]]"
+        puts $fp "dbfilename test-corrupt.rdb"
+        close $fp
+        set res [catch {exec ./redis-server test-corrupt.conf} out]
+        file delete test-corrupt.rdb test-corrupt.conf
+        $r del crckey
+        list $res [regexp {Wrong RDB checksum} $out]
+    } {1 1}
+
     # Leave the user with a clean DB before to exit
     test {FLUSHALL} {
         $r flushall
@@ -31,30 +31,115 @@
 #include <stdlib.h>
 //系统标准库(提供的字符串相关操作的函数)
 #include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 //自定的配置的头文件   
 #include "config.h"
+#include "zmalloc.h"
 
 //目前已经使用的内存空间量
 static size_t used_memory = 0;
+/* Live allocations for every size class, see zmalloc_size_class() */
+static size_t zmalloc_class_allocs[ZMALLOC_SIZE_CLASSES];
+/* Allocations done since the start, see zmalloc_total_allocs() */
+static size_t zmalloc_allocs = 0;
+/* Once a thread other than the main one can allocate (the background jobs)
+ * the counters must be updated atomically. */
+static int zmalloc_thread_safe = 0;
+
+/* When the allocator can tell the size of a block there is no need to
+ * store it in a header: this saves memory and also accounts the allocator
+ * rounding, so used_memory is nearer to the real usage. */
+#ifdef HAVE_MALLOC_SIZE
+#define PREFIX_SIZE (0)
+#else
+#define PREFIX_SIZE (sizeof(size_t))
+#endif
+
+#ifdef HAVE_ATOMIC
+#define atomic_incr(var,n) __sync_add_and_fetch(&(var),(n))
+#define atomic_decr(var,n) __sync_sub_and_fetch(&(var),(n))
+#define atomic_get(var,dst) do { (dst) = __sync_add_and_fetch(&(var),0); } while(0)
+#else
+static pthread_mutex_t zmalloc_stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define atomic_incr(var,n) do { \
+    pthread_mutex_lock(&zmalloc_stat_mutex); \
+    (var) += (n); \
+    pthread_mutex_unlock(&zmalloc_stat_mutex); \
+} while(0)
+#define atomic_decr(var,n) do { \
+    pthread_mutex_lock(&zmalloc_stat_mutex); \
+    (var) -= (n); \
+    pthread_mutex_unlock(&zmalloc_stat_mutex); \
+} while(0)
+#define atomic_get(var,dst) do { \
+    pthread_mutex_lock(&zmalloc_stat_mutex); \
+    (dst) = (var); \
+    pthread_mutex_unlock(&zmalloc_stat_mutex); \
+} while(0)
+#endif
+
+#define update_zmalloc_stat_alloc(__n) do { \
+    size_t _n = (__n); \
+    int _c = zmalloc_size_class(_n); \
+    if (zmalloc_thread_safe) { \
+        atomic_incr(used_memory,_n); \
+        atomic_incr(zmalloc_class_allocs[_c],1); \
+        atomic_incr(zmalloc_allocs,1); \
+    } else { \
+        used_memory += _n; \
+        zmalloc_class_allocs[_c]++; \
+        zmalloc_allocs++; \
+    } \
+} while(0)
+
+#define update_zmalloc_stat_free(__n) do { \
+    size_t _n = (__n); \
+    int _c = zmalloc_size_class(_n); \
+    if (zmalloc_thread_safe) { \
+        atomic_decr(used_memory,_n); \
+        atomic_decr(zmalloc_class_allocs[_c],1); \
+    } else { \
+        used_memory -= _n; \
+        zmalloc_class_allocs[_c]--; \
+    } \
+} while(0)
+
+/* Size classes are powers of two: class 0 holds the blocks up to 8 bytes,
+ * class c the ones up to 8<<c bytes, the last class all the bigger ones. */
+static inline int zmalloc_size_class(size_t size) {
+    int c = 0;
+
+    if (size <= 8) return 0;
+    size = (size-1) >> 3;
+    while(size && c < ZMALLOC_SIZE_CLASSES-1) {
+        size >>= 1;
+        c++;
+    }
+    return c;
+}
 
 //申请size大小的空间
 void *zmalloc(size_t size) {
-    //从这里可以看出的是不旦申请了，还多申请了sizeof(size_t)个空间
-    void *ptr = malloc(size+sizeof(size_t));
+    //在不能获取分配空间大小的平台上, 多申请PREFIX_SIZE个字节存放大小
+    void *ptr = malloc(size+PREFIX_SIZE);
     //如果申请失败的情况下，直接返回NULL
     if (!ptr) return NULL;
 #ifdef HAVE_MALLOC_SIZE
-    //redis_malloc_size用于Apple下获取ptr指向的空间大小
-    used_memory += redis_malloc_size(ptr);
+    //redis_malloc_size获取ptr指向的空间的实际大小(包括分配器的对齐)
+    update_zmalloc_stat_alloc(redis_malloc_size(ptr));
     return ptr;
 #else
     //前一个字节用于存放分配的内存空间大小
     *((size_t*)ptr) = size;
     //由于申请了size+sizeof(size_t)个空间
     //因此内存空间的使用量又增加了
-    used_memory += size+sizeof(size_t);
+    update_zmalloc_stat_alloc(size+PREFIX_SIZE);
     //返回的位置向前移动了sizeof(size_t)个空间
-    return (char*)ptr+sizeof(size_t);
+    return (char*)ptr+PREFIX_SIZE;
 #endif
 }
 
@@ -64,7 +149,7 @@ void *zmalloc(size_t size) {
  */
 
 void *zrealloc(void *ptr, size_t size) {
-//在Apple下会定义了HAVE_MALLOC_SIZE
+//在能获取分配空间大小的平台上会定义HAVE_MALLOC_SIZE
 #ifndef HAVE_MALLOC_SIZE
     //返回存放数据的实际地址
     void *realptr;
@@ -82,22 +167,22 @@ void *zrealloc(void *ptr, size_t size) {
     //分配失败的情况下
     if (!newptr) return NULL;
     //记录重新分配后所占用的内存空间大小
-    used_memory -= oldsize;
-    used_memory += redis_malloc_size(newptr);
+    update_zmalloc_stat_free(oldsize);
+    update_zmalloc_stat_alloc(redis_malloc_size(newptr));
     return newptr;
 #else
-    realptr = (char*)ptr-sizeof(size_t);
+    realptr = (char*)ptr-PREFIX_SIZE;
     //前sizeof(size_t)存放着分配的内存空间大小
     oldsize = *((size_t*)realptr);
     //重新分配内存空间的大小
-    newptr = realloc(realptr,size+sizeof(size_t));
+    newptr = realloc(realptr,size+PREFIX_SIZE);
     if (!newptr) return NULL;
     //记录分配的内存空间大小
     *((size_t*)newptr) = size;
-    used_memory -= oldsize;
-    used_memory += size;
+    update_zmalloc_stat_free(oldsize+PREFIX_SIZE);
+    update_zmalloc_stat_alloc(size+PREFIX_SIZE);
     //返回的地址
-    return (char*)newptr+sizeof(size_t);
+    return (char*)newptr+PREFIX_SIZE;
 #endif
 }
 
@@ -106,7 +191,7 @@ void *zrealloc(void *ptr, size_t size) {
  */
 
 void zfree(void *ptr) {
-//如果是apple机的话
+//在能获取分配空间大小的平台上
 //就会定义HAVE_MALLOC_SIZE
 #ifndef HAVE_MALLOC_SIZE
     void *realptr;
@@ -114,17 +199,15 @@ void zfree(void *ptr) {
 #endif
 //ptr=NULL表示ptr压根就没指向任何空间
     if (ptr == NULL) return;
-//如果是在Apple机的情况下
 #ifdef HAVE_MALLOC_SIZE
-    used_memory -= redis_malloc_size(ptr);
+    update_zmalloc_stat_free(redis_malloc_size(ptr));
     free(ptr);
 #else
-    //如果不是在Apple机的情况下
     //realptr指向内存空间的前sizeof(size_t)
     //个字节存放的是分配的内存空间大小
-    realptr = (char*)ptr-sizeof(size_t);
+    realptr = (char*)ptr-PREFIX_SIZE;
     oldsize = *((size_t*)realptr);
-    used_memory -= oldsize+sizeof(size_t);
+    update_zmalloc_stat_free(oldsize+PREFIX_SIZE);
     free(realptr);
 #endif
 }
@@ -148,5 +231,89 @@ char *zstrdup(const char *s) {
 
 //返回使用的内存空间的大小
 size_t zmalloc_used_memory(void) {
-    return used_memory;
+    size_t um;
+
+    if (zmalloc_thread_safe) {
+        atomic_get(used_memory,um);
+    } else {
+        um = used_memory;
+    }
+    return um;
+}
+
+/* Called before starting a thread that uses zmalloc()/zfree(). */
+void zmalloc_enable_thread_safeness(void) {
+    zmalloc_thread_safe = 1;
 }
+
+/* Number of live allocations in the size class 'c' */
+size_t zmalloc_size_class_allocs(int c) {
+    size_t allocs;
+
+    if (zmalloc_thread_safe) {
+        atomic_get(zmalloc_class_allocs[c],allocs);
+    } else {
+        allocs = zmalloc_class_allocs[c];
+    }
+    return allocs;
+}
+
+/* Number of zmalloc()/zrealloc() calls since the start */
+size_t zmalloc_total_allocs(void) {
+    size_t allocs;
+
+    if (zmalloc_thread_safe) {
+        atomic_get(zmalloc_allocs,allocs);
+    } else {
+        allocs = zmalloc_allocs;
+    }
+    return allocs;
+}
+
+/* Biggest block of the size class 'c', or 0 for the last, unbounded class */
+size_t zmalloc_size_class_limit(int c) {
+    return (c == ZMALLOC_SIZE_CLASSES-1) ? 0 : ((size_t)8 << c);
+}
+
+/* Resident set size of the process: the memory really used, that includes
+ * the allocator overhead and fragmentation. Where it can't be obtained the
+ * used memory is returned. */
+#if defined(__linux__)
+size_t zmalloc_get_rss(void) {
+    int page = sysconf(_SC_PAGESIZE);
+    size_t rss;
+    char buf[4096];
+    char filename[256];
+    int fd, count;
+    char *p, *x;
+
+    snprintf(filename,256,"/proc/%d/stat",getpid());
+    if ((fd = open(filename,O_RDONLY)) == -1) return zmalloc_used_memory();
+    if ((count = read(fd,buf,sizeof(buf)-1)) <= 0) {
+        close(fd);
+        return zmalloc_used_memory();
+    }
+    close(fd);
+    buf[count] = '\0';
+
+    /* RSS is the 24th field */
+    p = buf;
+    count = 23;
+    while(p && count--) {
+        p = strchr(p,' ');
+        if (p) p++;
+    }
+    if (!p) return zmalloc_used_memory();
+    x = strchr(p,' ');
+    if (!x) return zmalloc_used_memory();
+    *x = '\0';
+
+    rss = strtoll(p,NULL,10);
+    rss *= page;
+    return rss;
+}
+#else
+size_t zmalloc_get_rss(void) {
+    return zmalloc_used_memory();
+}
+#endif
@@ -75,4 +75,31 @@ char *zstrdup(const char *s);
 
 size_t zmalloc_used_memory(void);
 
+/*
+ * 在其他线程也会分配/释放内存之前调用, 之后内存使用量的统计采用原子操作
+ */
+
+void zmalloc_enable_thread_safeness(void);
+
+/*
+ * 按大小分类的内存分配统计: 第c类包含大小不超过8<<c字节的内存块,
+ * 最后一类包含所有更大的内存块
+ */
+
+#define ZMALLOC_SIZE_CLASSES 16
+size_t zmalloc_size_class_allocs(int c);
+size_t zmalloc_size_class_limit(int c);
+
+/*
+ * 获取自启动以来的内存分配次数(zmalloc与zrealloc的调用次数)
+ */
+
+size_t zmalloc_total_allocs(void);
+
+/*
+ * 获取进程实际占用的物理内存(RSS), 包括分配器的开销与内存碎片
+ */
+
+size_t zmalloc_get_rss(void);
+
 #endif /* _ZMALLOC_H */